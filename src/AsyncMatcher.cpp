@@ -0,0 +1,155 @@
+/**
+ * @brief Queries answered in the background, with bounded concurrency.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file AsyncMatcher.cpp
+ */
+
+#include "AsyncMatcher.h"
+
+#include <boost/shared_ptr.hpp>
+
+namespace
+{
+
+/**
+ * Hands a result to the future of a query.
+ */
+struct SetPromise
+{
+    SetPromise(const boost::shared_ptr<boost::promise<MatchResult> > &promise) :
+        mPromise(promise) {}
+
+    void operator() (const MatchResult &result) const
+    {
+        mPromise->set_value(result);
+    }
+
+    boost::shared_ptr<boost::promise<MatchResult> > mPromise;
+};
+
+} // namespace
+
+AsyncMatcher::AsyncMatcher(ImageMatcher &matcher, unsigned int concurrency,
+                           size_t queueCapacity, unsigned int deadlineMs) :
+    mMatcher(matcher),
+    mConcurrency(concurrency > 0 ? concurrency : 1),
+    mDeadlineMs(deadlineMs),
+    mQueue(queueCapacity),
+    mSubmitted(0),
+    mRejected(0),
+    mExpired(0),
+    mPending(0)
+{
+    for (unsigned int i = 0; i < mConcurrency; ++i)
+        mThreads.add_thread(new boost::thread(&AsyncMatcher::Work, this));
+}
+
+AsyncMatcher::~AsyncMatcher()
+{
+    // The threads drain the queue before they see it closed
+    mQueue.Close();
+    mThreads.join_all();
+}
+
+boost::shared_future<MatchResult>
+AsyncMatcher::Submit(const cv::Mat &image)
+{
+    boost::shared_ptr<boost::promise<MatchResult> > promise(
+            new boost::promise<MatchResult>());
+    boost::shared_future<MatchResult> future(promise->get_future());
+
+    Submit(image, SetPromise(promise));
+    return future;
+}
+
+bool
+AsyncMatcher::Submit(const cv::Mat &image, const MatchCallback &callback)
+{
+    __sync_fetch_and_add(&mSubmitted, 1);
+
+    Job job;
+    job.image = image;
+    job.callback = callback;
+    job.deadline = 0;
+    if (mDeadlineMs > 0)
+        job.deadline = cv::getTickCount() +
+            static_cast<int64>(cv::getTickFrequency() * mDeadlineMs / 1000);
+
+    {
+        // Counted before it is queued, it could be answered right away
+        boost::mutex::scoped_lock lock(mPendingMutex);
+        mPending++;
+    }
+
+    if (!mQueue.TryPush(job))
+    {
+        Done();
+        __sync_fetch_and_add(&mRejected, 1);
+        Reject(callback, "Rejected: too many queries waiting");
+        return false;
+    }
+
+    return true;
+}
+
+void
+AsyncMatcher::Wait()
+{
+    boost::mutex::scoped_lock lock(mPendingMutex);
+    while (mPending > 0)
+        mAnswered.wait(lock);
+}
+
+void
+AsyncMatcher::Done()
+{
+    boost::mutex::scoped_lock lock(mPendingMutex);
+    if (--mPending == 0)
+        mAnswered.notify_all();
+}
+
+void
+AsyncMatcher::Reject(const MatchCallback &callback, const std::string &reason)
+{
+    MatchResult result;
+    result.fileName = "No match found";
+    result.error = reason;
+    callback(result);
+}
+
+void
+AsyncMatcher::Work()
+{
+    Job job;
+    while (mQueue.Pop(job))
+    {
+        // The caller has given up, or will before a match could be found
+        if (job.deadline > 0 && cv::getTickCount() > job.deadline)
+        {
+            __sync_fetch_and_add(&mExpired, 1);
+            Reject(job.callback, "Expired: waited past the deadline");
+        }
+        else
+        {
+            MatchResult result;
+            try
+            {
+                mMatcher.FindBestMatch(job.image, result);
+            }
+            catch (const std::exception &ex)
+            {
+                result.fileName = "No match found";
+                result.error = ex.what();
+            }
+            job.callback(result);
+        }
+
+        // Let go of the image before waiting for the next query
+        job = Job();
+        Done();
+    }
+}
@@ -0,0 +1,175 @@
+/**
+ * @brief Queries answered in the background, with bounded concurrency.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file AsyncMatcher.h
+ */
+
+#ifndef async_matcher_h
+#define async_matcher_h
+
+#include "BoundedQueue.h"
+#include "ImageMatcher.h"
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <opencv2/core/core.hpp>
+
+/**
+ * @brief Receives the result of a query, see AsyncMatcher::Submit()
+ */
+typedef boost::function<void (const MatchResult &)> MatchCallback;
+
+/**
+ * @class AsyncMatcher
+ * @brief Queue queries for a matcher and answer them on a fixed number
+ * of threads.
+ *
+ * Up to concurrency queries are in progress at once, and up to
+ * queueCapacity more wait their turn. The queries in progress overlap
+ * their decoding, feature extraction, query index and candidate
+ * selection, which run on the threads of this object. Their candidate
+ * verification does not overlap: the thread pool of the matcher runs
+ * one loop at a time, so the verifications take turns, each one spread
+ * over all the workers.
+ *
+ * A query submitted while the queue is full is rejected right away
+ * instead of waiting, and a query still queued past its deadline is
+ * answered without being matched: under a burst, the callers are told
+ * early instead of all getting slow answers. The deadline is only
+ * checked when a query leaves the queue; once its matching has started,
+ * a query is always matched to the end.
+ *
+ * Every query gets an answer, through its future or its callback. A
+ * query that was rejected, expired or failed carries the reason in
+ * MatchResult::error, the future never throws.
+ */
+class AsyncMatcher : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor, starts the threads
+     * @param[in] matcher A trained matcher, it must outlive this object
+     * @param[in] concurrency Number of queries in progress at once
+     * @param[in] queueCapacity Number of queries waiting at most
+     * @param[in] deadlineMs Milliseconds a query may wait in the queue
+     * before its matching starts, zero for no limit
+     */
+    AsyncMatcher(ImageMatcher &matcher, unsigned int concurrency = 1,
+                 size_t queueCapacity = 16, unsigned int deadlineMs = 0);
+    /**
+     * @brief Destructor, answers the queries still queued and stops the
+     * threads
+     */
+    ~AsyncMatcher();
+
+    /**
+     * @brief Queue a query
+     * @param[in] image The query image, shared with the caller (not
+     * copied): it must not be modified until the query is answered
+     * @return The future result, already set if the query was rejected
+     */
+    boost::shared_future<MatchResult> Submit(const cv::Mat &image);
+
+    /**
+     * @brief Queue a query, with a function to call once it is answered
+     * @param[in] image The query image, see above
+     * @param[in] callback Called with the result, on one of the threads
+     * of this object; or on the calling thread, before returning, if the
+     * query is rejected. It must not throw.
+     * @return False if the query was rejected
+     */
+    bool Submit(const cv::Mat &image, const MatchCallback &callback);
+
+    /**
+     * @brief Wait until every query accepted so far has been answered
+     */
+    void Wait();
+
+    unsigned int GetConcurrency() const;
+    /**
+     * @brief Retrieve the number of queries waiting
+     */
+    size_t GetQueuedCount();
+    /**
+     * @brief Retrieve the number of queries submitted since construction
+     */
+    unsigned long GetSubmittedCount() const;
+    /**
+     * @brief Retrieve the number of queries rejected, the queue being full
+     */
+    unsigned long GetRejectedCount() const;
+    /**
+     * @brief Retrieve the number of queries dropped past their deadline
+     */
+    unsigned long GetExpiredCount() const;
+
+private:
+
+    struct Job
+    {
+        cv::Mat image;
+        MatchCallback callback;
+        /**
+         * @brief cv::getTickCount() value after which the query is
+         * dropped, zero for never
+         */
+        int64 deadline;
+    };
+
+    void Work();
+    void Reject(const MatchCallback &callback, const std::string &reason);
+    void Done();
+
+    ImageMatcher &mMatcher;
+    unsigned int mConcurrency;
+    unsigned int mDeadlineMs;
+    BoundedQueue<Job> mQueue;
+    boost::thread_group mThreads;
+
+    volatile unsigned long mSubmitted;
+    volatile unsigned long mRejected;
+    volatile unsigned long mExpired;
+
+    /**
+     * @brief Queries accepted and not answered yet
+     */
+    unsigned long mPending;
+    boost::mutex mPendingMutex;
+    boost::condition_variable mAnswered;
+};
+
+inline unsigned int AsyncMatcher::GetConcurrency() const
+{
+    return mConcurrency;
+}
+
+inline size_t AsyncMatcher::GetQueuedCount()
+{
+    return mQueue.Size();
+}
+
+inline unsigned long AsyncMatcher::GetSubmittedCount() const
+{
+    return mSubmitted;
+}
+
+inline unsigned long AsyncMatcher::GetRejectedCount() const
+{
+    return mRejected;
+}
+
+inline unsigned long AsyncMatcher::GetExpiredCount() const
+{
+    return mExpired;
+}
+
+#endif // header guard
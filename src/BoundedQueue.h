@@ -0,0 +1,117 @@
+/**
+ * @brief A blocking FIFO queue with a fixed capacity.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file BoundedQueue.h
+ */
+
+#ifndef bounded_queue_h
+#define bounded_queue_h
+
+#include <deque>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * @class BoundedQueue
+ * @brief Connects the stages of a pipeline.
+ *
+ * Producers block while the queue is full, so a fast stage cannot run
+ * arbitrarily far ahead of a slow one. Once closed, the queue refuses new
+ * items and consumers drain whatever is left.
+ */
+template <typename T>
+class BoundedQueue : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] capacity Maximum number of queued items
+     */
+    explicit BoundedQueue(size_t capacity) :
+        mCapacity(capacity > 0 ? capacity : 1),
+        mClosed(false) {}
+    /**
+     * @brief Append an item, waiting for room if the queue is full
+     * @return False if the queue has been closed
+     */
+    bool Push(const T &item)
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        while (!mClosed && mItems.size() >= mCapacity)
+            mNotFull.wait(lock);
+
+        if (mClosed)
+            return false;
+
+        mItems.push_back(item);
+        mNotEmpty.notify_one();
+        return true;
+    }
+    /**
+     * @brief Append an item if there is room, without waiting
+     * @return False if the queue is full or has been closed
+     */
+    bool TryPush(const T &item)
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        if (mClosed || mItems.size() >= mCapacity)
+            return false;
+
+        mItems.push_back(item);
+        mNotEmpty.notify_one();
+        return true;
+    }
+    /**
+     * @brief Retrieve the number of queued items
+     */
+    size_t Size()
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mItems.size();
+    }
+    /**
+     * @brief Remove the oldest item, waiting for one if the queue is empty
+     * @return False if the queue has been closed and is empty
+     */
+    bool Pop(T &item)
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        while (!mClosed && mItems.empty())
+            mNotEmpty.wait(lock);
+
+        if (mItems.empty())
+            return false;
+
+        item = mItems.front();
+        mItems.pop_front();
+        mNotFull.notify_one();
+        return true;
+    }
+    /**
+     * @brief Refuse new items and wake up all the waiting threads
+     */
+    void Close()
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mClosed = true;
+        mNotEmpty.notify_all();
+        mNotFull.notify_all();
+    }
+
+private:
+
+    std::deque<T> mItems;
+    size_t mCapacity;
+    bool mClosed;
+    boost::mutex mMutex;
+    boost::condition_variable mNotEmpty;
+    boost::condition_variable mNotFull;
+};
+
+#endif // header guard
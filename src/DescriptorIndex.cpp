@@ -0,0 +1,182 @@
+/**
+ * @brief Nearest neighbour search over a set of descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file DescriptorIndex.cpp
+ */
+
+#include "DescriptorIndex.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// Same parameters cv::FlannBasedMatcher uses by default
+static const int KDTREE_TREES = 4;
+static const int SEARCH_CHECKS = 32;
+
+// Multi-probe LSH parameters for binary descriptors
+static const int LSH_TABLES = 12;
+static const int LSH_KEY_SIZE = 20;
+static const int LSH_PROBE_LEVEL = 2;
+
+DescriptorIndex::DescriptorIndex()
+{
+}
+
+void
+DescriptorIndex::Build(const cv::Mat &descriptors)
+{
+    Clear();
+
+    if (descriptors.empty())
+        return;
+
+    mDescriptors = descriptors;
+
+    // Binary descriptors are hashed and compared by Hamming distance
+    // (popcount); float descriptors go to randomized KD-trees
+    if (mDescriptors.depth() == CV_8U)
+        mIndex = new cv::flann::Index(mDescriptors,
+                                      cv::flann::LshIndexParams(LSH_TABLES,
+                                                                LSH_KEY_SIZE,
+                                                                LSH_PROBE_LEVEL),
+                                      cvflann::FLANN_DIST_HAMMING);
+    else
+        mIndex = new cv::flann::Index(mDescriptors,
+                                      cv::flann::KDTreeIndexParams(KDTREE_TREES));
+}
+
+void
+DescriptorIndex::Clear()
+{
+    mIndex.release();
+    mDescriptors.release();
+}
+
+bool
+DescriptorIndex::IsBinary() const
+{
+    return mDescriptors.depth() == CV_8U;
+}
+
+bool
+DescriptorIndex::Empty() const
+{
+    return mIndex.empty();
+}
+
+void
+DescriptorIndex::KnnSearch(const cv::Mat &query, int k,
+                           cv::Mat &indices, cv::Mat &dists) const
+{
+    CV_Assert(!Empty());
+
+    indices.create(query.rows, k, CV_32S);
+    dists.create(query.rows, k, IsBinary() ? CV_32S : CV_32F);
+    mIndex->knnSearch(query, indices, dists, k,
+                      cv::flann::SearchParams(SEARCH_CHECKS));
+}
+
+void
+DescriptorIndex::Reserve(cv::Mat &buffer, int rows, int cols, int type,
+                         cv::Mat &view)
+{
+    if (buffer.rows < rows || buffer.cols != cols || buffer.type() != type)
+        buffer.create(rows, cols, type);
+
+    view = buffer.rowRange(0, rows);
+}
+
+void
+DescriptorIndex::KnnSearch(const cv::Mat &query, int k, SearchBuffers &buffers,
+                           cv::Mat &indices, cv::Mat &dists) const
+{
+    CV_Assert(!Empty());
+
+    // The views have the size and type knnSearch() asks for, so it
+    // writes into the buffers instead of reallocating them
+    Reserve(buffers.indices, query.rows, k, CV_32S, indices);
+    Reserve(buffers.dists, query.rows, k, IsBinary() ? CV_32S : CV_32F, dists);
+    mIndex->knnSearch(query, indices, dists, k,
+                      cv::flann::SearchParams(SEARCH_CHECKS));
+}
+
+float
+DescriptorIndex::Distance(const cv::Mat &dists, int row, int col) const
+{
+    // Fraction of differing bits, in the same range as SURF distances
+    if (IsBinary())
+        return dists.at<int>(row, col) / (8.0f * mDescriptors.cols);
+
+    return std::sqrt(dists.at<float>(row, col));
+}
+
+void
+DescriptorIndex::Match(const cv::Mat &query,
+                       std::vector<cv::DMatch> &matches) const
+{
+    SearchBuffers buffers;
+    Match(query, matches, buffers);
+}
+
+void
+DescriptorIndex::Match(const cv::Mat &query,
+                       std::vector<cv::DMatch> &matches,
+                       SearchBuffers &buffers) const
+{
+    matches.clear();
+
+    if (Empty() || query.empty())
+        return;
+
+    cv::Mat indices, dists;
+    KnnSearch(query, 1, buffers, indices, dists);
+
+    matches.resize(query.rows);
+    for (int i = 0; i < query.rows; ++i)
+    {
+        matches[i] = cv::DMatch(i, indices.at<int>(i, 0),
+                                Distance(dists, i, 0));
+    }
+}
+
+void
+DescriptorIndex::KnnMatch(const cv::Mat &query,
+                          std::vector<cv::DMatch> &matches,
+                          std::vector<float> &second) const
+{
+    SearchBuffers buffers;
+    KnnMatch(query, matches, second, buffers);
+}
+
+void
+DescriptorIndex::KnnMatch(const cv::Mat &query,
+                          std::vector<cv::DMatch> &matches,
+                          std::vector<float> &second,
+                          SearchBuffers &buffers) const
+{
+    matches.clear();
+    second.clear();
+
+    if (Empty() || query.empty())
+        return;
+
+    // FLANN cannot return more neighbours than there are rows
+    const int k = std::min(2, mDescriptors.rows);
+    cv::Mat indices, dists;
+    KnnSearch(query, k, buffers, indices, dists);
+
+    matches.resize(query.rows);
+    second.assign(query.rows, FLT_MAX);
+    for (int i = 0; i < query.rows; ++i)
+    {
+        matches[i] = cv::DMatch(i, indices.at<int>(i, 0),
+                                Distance(dists, i, 0));
+        if (k > 1 && indices.at<int>(i, 1) >= 0)
+            second[i] = Distance(dists, i, 1);
+    }
+}
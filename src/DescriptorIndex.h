@@ -0,0 +1,138 @@
+/**
+ * @brief Nearest neighbour search over a set of descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file DescriptorIndex.h
+ */
+
+#ifndef descriptor_index_h
+#define descriptor_index_h
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/flann/flann.hpp>
+
+/**
+ * @brief Search results reused from one search to the next.
+ *
+ * The matrices only grow: a search takes a view over their first rows,
+ * so once they fit the largest query no more memory is allocated.
+ */
+struct SearchBuffers
+{
+    cv::Mat indices;
+    cv::Mat dists;
+};
+
+/**
+ * @class DescriptorIndex
+ * @brief A FLANN index built once over a descriptor matrix and queried
+ * many times.
+ *
+ * cv::FlannBasedMatcher::match(query, train) rebuilds the index over the
+ * train descriptors on every call; this class keeps it instead. Float
+ * descriptors are indexed by randomized KD-trees, binary (CV_8U)
+ * descriptors by multi-probe LSH with Hamming distance. The
+ * indexed matrix is referenced, not copied, and kept alive by the index.
+ * Searching is read-only, so an index can be shared between threads.
+ */
+class DescriptorIndex
+{
+public:
+
+    /**
+     * @brief Default constructor, creates an empty index
+     */
+    DescriptorIndex();
+    /**
+     * @brief Build the index
+     * @param[in] descriptors One descriptor per row
+     */
+    void Build(const cv::Mat &descriptors);
+    /**
+     * @brief Release the index and the indexed descriptors
+     */
+    void Clear();
+    /**
+     * @brief Check whether the index has been built
+     * @return True if there is nothing to search
+     */
+    bool Empty() const;
+    /**
+     * @brief Check whether the indexed descriptors are binary strings
+     */
+    bool IsBinary() const;
+    /**
+     * @brief Retrieve the indexed descriptors
+     * @return The matrix the index was built over
+     */
+    const cv::Mat& GetDescriptors() const;
+    /**
+     * @brief Find the k nearest neighbours of every query row
+     * @param[in] query One descriptor per row
+     * @param[in] k Number of neighbours
+     * @param[out] indices Row indices of the neighbours (CV_32S)
+     * @param[out] dists Squared L2 distances of the neighbours (CV_32F),
+     * or Hamming distances (CV_32S) for binary descriptors. Indices are
+     * -1 where LSH found no neighbour.
+     */
+    void KnnSearch(const cv::Mat &query, int k,
+                   cv::Mat &indices, cv::Mat &dists) const;
+    /**
+     * @brief Find the k nearest neighbours of every query row, into
+     * reused buffers
+     * @param[in] query One descriptor per row
+     * @param[in] k Number of neighbours
+     * @param buffers Where the results are kept
+     * @param[out] indices A view over the first query.rows rows of
+     * buffers.indices, see KnnSearch()
+     * @param[out] dists A view over the first query.rows rows of
+     * buffers.dists
+     */
+    void KnnSearch(const cv::Mat &query, int k, SearchBuffers &buffers,
+                   cv::Mat &indices, cv::Mat &dists) const;
+    /**
+     * @brief Find the nearest neighbour of every query row
+     * @param[in] query One descriptor per row
+     * @param[out] matches One match per query row, distances are L2
+     * like the ones returned by cv::FlannBasedMatcher, or the fraction of
+     * differing bits for binary descriptors. The train index is -1 if no
+     * neighbour was found.
+     */
+    void Match(const cv::Mat &query, std::vector<cv::DMatch> &matches) const;
+    void Match(const cv::Mat &query, std::vector<cv::DMatch> &matches,
+               SearchBuffers &buffers) const;
+    /**
+     * @brief Find the two nearest neighbours of every query row
+     * @param[in] query One descriptor per row
+     * @param[out] matches The nearest neighbours, as by Match()
+     * @param[out] second The distance of every second nearest neighbour,
+     * FLT_MAX if there is none
+     */
+    void KnnMatch(const cv::Mat &query, std::vector<cv::DMatch> &matches,
+                  std::vector<float> &second) const;
+    void KnnMatch(const cv::Mat &query, std::vector<cv::DMatch> &matches,
+                  std::vector<float> &second, SearchBuffers &buffers) const;
+
+private:
+
+    static void Reserve(cv::Mat &buffer, int rows, int cols, int type,
+                        cv::Mat &view);
+    float Distance(const cv::Mat &dists, int row, int col) const;
+
+    cv::Mat mDescriptors;
+    // knnSearch() is not const in OpenCV 2.4, though searching leaves
+    // the built index unchanged
+    mutable cv::Ptr<cv::flann::Index> mIndex;
+};
+
+inline const cv::Mat& DescriptorIndex::GetDescriptors() const
+{
+    return mDescriptors;
+}
+
+#endif // header guard
@@ -0,0 +1,612 @@
+/**
+ * @brief Compact storage for float descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file DescriptorQuantizer.cpp
+ */
+
+#include "DescriptorQuantizer.h"
+
+#include <float.h>
+#include <string.h>
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+/*
+ * IEEE 754 half float conversions, round to nearest even. Only used to
+ * encode and as the fallback of the F16C instructions.
+ */
+uint16_t
+FloatToHalf(float value)
+{
+    uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const int exponent = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+
+    if ((x & 0x7fffffff) > 0x7f800000)
+        return sign | 0x7e00;                       // NaN
+    if (exponent >= 31)
+        return sign | 0x7c00;                       // overflow, infinity
+
+    if (exponent <= 0)
+    {
+        // Subnormal half, or zero when too small
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | static_cast<uint16_t>(half);
+    }
+
+    uint32_t half = (exponent << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    // A carry out of the mantissa correctly bumps the exponent
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | static_cast<uint16_t>(half);
+}
+
+inline float
+HalfToFloat(uint16_t half)
+{
+    const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1f;
+    const uint32_t mantissa = half & 0x3ff;
+    uint32_t x;
+
+    if (exponent == 0)
+    {
+        // Zero or subnormal: mantissa * 2^-24
+        float value = mantissa * (1.0f / 16777216.0f);
+        return sign ? -value : value;
+    }
+    if (exponent == 31)
+        x = sign | 0x7f800000 | (mantissa << 13);
+    else
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+    float value;
+    memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+/**
+ * Squared distance between a float descriptor and a code of n dimensions
+ */
+typedef float (*DistanceKernel)(const float *query, const void *code,
+                                const float *scales, int n);
+
+float
+DistanceInt8(const float *query, const void *code, const float *scales, int n)
+{
+    const signed char *c = static_cast<const signed char *>(code);
+    float sum = 0;
+    for (int d = 0; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * c[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+float
+DistanceFloat16(const float *query, const void *code, const float *scales,
+                int n)
+{
+    const uint16_t *c = static_cast<const uint16_t *>(code);
+    float sum = 0;
+    for (int d = 0; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * HalfToFloat(c[d]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+#ifdef X86_KERNELS
+
+__attribute__((target("sse2")))
+float
+DistanceInt8Sse2(const float *query, const void *code, const float *scales,
+                 int n)
+{
+    const signed char *c = static_cast<const signed char *>(code);
+    __m128 acc = _mm_setzero_ps();
+    int d = 0;
+
+    for (; d + 8 <= n; d += 8)
+    {
+        // Sign extend 8 codes to 32 bits: duplicate each byte into the
+        // high half of a 16 bit word, then shift it down arithmetically
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c + d));
+        __m128i words = _mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8);
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16);
+
+        __m128 diffLo = _mm_sub_ps(_mm_loadu_ps(query + d),
+                                   _mm_mul_ps(_mm_loadu_ps(scales + d),
+                                              _mm_cvtepi32_ps(lo)));
+        __m128 diffHi = _mm_sub_ps(_mm_loadu_ps(query + d + 4),
+                                   _mm_mul_ps(_mm_loadu_ps(scales + d + 4),
+                                              _mm_cvtepi32_ps(hi)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diffLo, diffLo));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diffHi, diffHi));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    for (; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * c[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+/*
+ * Half floats widened with integer operations: the exponent and the
+ * mantissa are moved into place, and one multiply by 2^112 rebiases the
+ * exponent, subnormals included. Infinities and NaNs are not restored,
+ * the codes are always in [-1, 1].
+ */
+__attribute__((target("sse2")))
+inline __m128
+HalvesToFloats(__m128i halves)
+{
+    const __m128i sign = _mm_slli_epi32(
+            _mm_and_si128(halves, _mm_set1_epi32(0x8000)), 16);
+    const __m128i magnitude = _mm_slli_epi32(
+            _mm_and_si128(halves, _mm_set1_epi32(0x7fff)), 13);
+    const __m128 value = _mm_mul_ps(_mm_castsi128_ps(magnitude),
+                                    _mm_set1_ps(5.192296858534828e+33f));
+    return _mm_or_ps(value, _mm_castsi128_ps(sign));
+}
+
+__attribute__((target("sse2")))
+float
+DistanceFloat16Sse2(const float *query, const void *code,
+                    const float *scales, int n)
+{
+    const uint16_t *c = static_cast<const uint16_t *>(code);
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc = _mm_setzero_ps();
+    int d = 0;
+
+    for (; d + 8 <= n; d += 8)
+    {
+        __m128i halves = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c + d));
+        __m128 lo = HalvesToFloats(_mm_unpacklo_epi16(halves, zero));
+        __m128 hi = HalvesToFloats(_mm_unpackhi_epi16(halves, zero));
+
+        __m128 diffLo = _mm_sub_ps(_mm_loadu_ps(query + d),
+                                   _mm_mul_ps(_mm_loadu_ps(scales + d), lo));
+        __m128 diffHi = _mm_sub_ps(_mm_loadu_ps(query + d + 4),
+                                   _mm_mul_ps(_mm_loadu_ps(scales + d + 4), hi));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diffLo, diffLo));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diffHi, diffHi));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    for (; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * HalfToFloat(c[d]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("avx")))
+inline float
+HorizontalSum(__m256 acc)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                            _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+float
+DistanceInt8Avx2(const float *query, const void *code, const float *scales,
+                 int n)
+{
+    const signed char *c = static_cast<const signed char *>(code);
+    __m256 acc = _mm256_setzero_ps();
+    int d = 0;
+
+    for (; d + 8 <= n; d += 8)
+    {
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c + d));
+        __m256 values = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        __m256 diff = _mm256_fnmadd_ps(_mm256_loadu_ps(scales + d), values,
+                                       _mm256_loadu_ps(query + d));
+        acc = _mm256_fmadd_ps(diff, diff, acc);
+    }
+
+    float sum = HorizontalSum(acc);
+    for (; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * c[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c")))
+float
+DistanceFloat16Avx2(const float *query, const void *code,
+                    const float *scales, int n)
+{
+    const uint16_t *c = static_cast<const uint16_t *>(code);
+    __m256 acc = _mm256_setzero_ps();
+    int d = 0;
+
+    for (; d + 8 <= n; d += 8)
+    {
+        __m128i halves = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c + d));
+        __m256 diff = _mm256_fnmadd_ps(_mm256_loadu_ps(scales + d),
+                                       _mm256_cvtph_ps(halves),
+                                       _mm256_loadu_ps(query + d));
+        acc = _mm256_fmadd_ps(diff, diff, acc);
+    }
+
+    float sum = HorizontalSum(acc);
+    for (; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * HalfToFloat(c[d]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+/*
+ * For the CPUs with F16C but without AVX2 and FMA (Ivy Bridge)
+ */
+__attribute__((target("avx,f16c")))
+float
+DistanceFloat16F16c(const float *query, const void *code,
+                    const float *scales, int n)
+{
+    const uint16_t *c = static_cast<const uint16_t *>(code);
+    __m256 acc = _mm256_setzero_ps();
+    int d = 0;
+
+    for (; d + 8 <= n; d += 8)
+    {
+        __m128i halves = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c + d));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(query + d),
+                                    _mm256_mul_ps(_mm256_loadu_ps(scales + d),
+                                                  _mm256_cvtph_ps(halves)));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+    }
+
+    float sum = HorizontalSum(acc);
+    for (; d < n; ++d)
+    {
+        float diff = query[d] - scales[d] * HalfToFloat(c[d]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+#endif // X86_KERNELS
+
+struct Kernels
+{
+    DistanceKernel int8;
+    DistanceKernel float16;
+    const char *name;
+};
+
+Kernels
+SelectKernels()
+{
+    Kernels kernels = { DistanceInt8, DistanceFloat16, "scalar" };
+
+#ifdef X86_KERNELS
+    unsigned int eax, ebx, ecx, edx;
+    bool f16c = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C);
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && f16c)
+    {
+        kernels.int8 = DistanceInt8Avx2;
+        kernels.float16 = DistanceFloat16Avx2;
+        kernels.name = "avx2";
+    }
+    else if (__builtin_cpu_supports("avx") && f16c)
+    {
+        kernels.int8 = DistanceInt8Sse2;
+        kernels.float16 = DistanceFloat16F16c;
+        kernels.name = "sse2+f16c";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        kernels.int8 = DistanceInt8Sse2;
+        kernels.float16 = DistanceFloat16Sse2;
+        kernels.name = "sse2";
+    }
+#endif
+
+    return kernels;
+}
+
+const Kernels &
+GetKernels()
+{
+    static const Kernels kernels = SelectKernels();
+    return kernels;
+}
+
+} // namespace
+
+DescriptorQuantizer::DescriptorQuantizer() :
+    mStorage(STORAGE_FLOAT)
+{
+}
+
+void
+DescriptorQuantizer::Fit(const std::vector<cv::Mat> &descriptors,
+                         DescriptorStorage storage)
+{
+    CV_Assert(storage == STORAGE_INT8 || storage == STORAGE_FLOAT16);
+
+    cv::Mat maxAbs;
+    for (size_t i = 0; i < descriptors.size(); ++i)
+    {
+        const cv::Mat &desc = descriptors[i];
+        if (desc.empty())
+            continue;
+
+        CV_Assert(desc.type() == CV_32F);
+        if (maxAbs.empty())
+            maxAbs = cv::Mat::zeros(1, desc.cols, CV_32F);
+        CV_Assert(desc.cols == maxAbs.cols);
+
+        float *m = maxAbs.ptr<float>(0);
+        for (int r = 0; r < desc.rows; ++r)
+        {
+            const float *row = desc.ptr<float>(r);
+            for (int d = 0; d < desc.cols; ++d)
+                m[d] = std::max(m[d], std::fabs(row[d]));
+        }
+    }
+
+    // Codes span [-127, 127] for int8 and [-1, 1] for float16
+    const float range = (storage == STORAGE_INT8) ? 127.0f : 1.0f;
+    for (int d = 0; d < maxAbs.cols; ++d)
+    {
+        float &scale = maxAbs.at<float>(0, d);
+        scale = (scale > 0) ? scale / range : 1.0f;
+    }
+
+    mStorage = storage;
+    mScales = maxAbs;
+}
+
+void
+DescriptorQuantizer::SetScales(DescriptorStorage storage,
+                               const cv::Mat &scales)
+{
+    CV_Assert(storage == STORAGE_INT8 || storage == STORAGE_FLOAT16);
+    CV_Assert(scales.type() == CV_32F && scales.rows == 1);
+
+    mStorage = storage;
+    mScales = scales.clone();
+}
+
+void
+DescriptorQuantizer::Clear()
+{
+    mStorage = STORAGE_FLOAT;
+    mScales.release();
+}
+
+void
+DescriptorQuantizer::Encode(const cv::Mat &descriptors, cv::Mat &codes) const
+{
+    CV_Assert(!Empty());
+
+    if (descriptors.empty())
+    {
+        codes.release();
+        return;
+    }
+
+    CV_Assert(descriptors.type() == CV_32F && descriptors.cols == mScales.cols);
+
+    const float *scales = mScales.ptr<float>(0);
+    if (mStorage == STORAGE_INT8)
+    {
+        codes.create(descriptors.rows, descriptors.cols, CV_8S);
+        for (int r = 0; r < descriptors.rows; ++r)
+        {
+            const float *src = descriptors.ptr<float>(r);
+            signed char *dst = codes.ptr<signed char>(r);
+            for (int d = 0; d < descriptors.cols; ++d)
+            {
+                int code = cvRound(src[d] / scales[d]);
+                dst[d] = static_cast<signed char>(std::max(-127, std::min(127, code)));
+            }
+        }
+    }
+    else
+    {
+        codes.create(descriptors.rows, descriptors.cols, CV_16U);
+        for (int r = 0; r < descriptors.rows; ++r)
+        {
+            const float *src = descriptors.ptr<float>(r);
+            uint16_t *dst = codes.ptr<uint16_t>(r);
+            for (int d = 0; d < descriptors.cols; ++d)
+                dst[d] = FloatToHalf(src[d] / scales[d]);
+        }
+    }
+}
+
+void
+DescriptorQuantizer::Decode(const cv::Mat &codes, cv::Mat &descriptors) const
+{
+    CV_Assert(!Empty());
+
+    if (codes.empty())
+    {
+        descriptors.release();
+        return;
+    }
+
+    CV_Assert(codes.cols == mScales.cols);
+
+    const float *scales = mScales.ptr<float>(0);
+    descriptors.create(codes.rows, codes.cols, CV_32F);
+    for (int r = 0; r < codes.rows; ++r)
+    {
+        float *dst = descriptors.ptr<float>(r);
+        if (mStorage == STORAGE_INT8)
+        {
+            const signed char *src = codes.ptr<signed char>(r);
+            for (int d = 0; d < codes.cols; ++d)
+                dst[d] = scales[d] * src[d];
+        }
+        else
+        {
+            const uint16_t *src = codes.ptr<uint16_t>(r);
+            for (int d = 0; d < codes.cols; ++d)
+                dst[d] = scales[d] * HalfToFloat(src[d]);
+        }
+    }
+}
+
+void
+DescriptorQuantizer::Match(const cv::Mat &query, const cv::Mat &codes,
+                           std::vector<cv::DMatch> &matches12,
+                           std::vector<cv::DMatch> &matches21,
+                           std::vector<float> *second) const
+{
+    CV_Assert(!Empty());
+
+    matches12.assign(query.rows, cv::DMatch(0, -1, FLT_MAX));
+    matches21.assign(codes.rows, cv::DMatch(0, -1, FLT_MAX));
+    if (second)
+        second->assign(query.rows, FLT_MAX);
+
+    if (query.empty() || codes.empty())
+        return;
+
+    CV_Assert(query.type() == CV_32F && query.cols == mScales.cols &&
+              codes.cols == mScales.cols);
+
+    const Kernels &kernels = GetKernels();
+    const DistanceKernel distance =
+        (mStorage == STORAGE_INT8) ? kernels.int8 : kernels.float16;
+    const float *scales = mScales.ptr<float>(0);
+    const int n = mScales.cols;
+
+    // Exact search: one pass over the whole distance matrix gives the
+    // nearest neighbour of every row and of every column. The codes of
+    // one image fit in L2, they are streamed once per query row.
+    for (int i = 0; i < query.rows; ++i)
+    {
+        const float *q = query.ptr<float>(i);
+        cv::DMatch &forward = matches12[i];
+        float runnerUp = FLT_MAX;
+        forward.queryIdx = i;
+
+        for (int j = 0; j < codes.rows; ++j)
+        {
+            float dist = distance(q, codes.ptr(j), scales, n);
+
+            if (dist < forward.distance)
+            {
+                runnerUp = forward.distance;
+                forward.trainIdx = j;
+                forward.distance = dist;
+            }
+            else if (dist < runnerUp)
+            {
+                runnerUp = dist;
+            }
+
+            cv::DMatch &backward = matches21[j];
+            if (dist < backward.distance)
+            {
+                backward.trainIdx = i;
+                backward.distance = dist;
+            }
+        }
+
+        if (second && runnerUp < FLT_MAX)
+            (*second)[i] = std::sqrt(runnerUp);
+    }
+
+    for (int i = 0; i < query.rows; ++i)
+        matches12[i].distance = std::sqrt(matches12[i].distance);
+
+    for (int j = 0; j < codes.rows; ++j)
+    {
+        matches21[j].queryIdx = j;
+        matches21[j].distance = std::sqrt(matches21[j].distance);
+    }
+}
+
+const char *
+DescriptorQuantizer::GetKernelName()
+{
+    return GetKernels().name;
+}
+
+const char *
+DescriptorQuantizer::GetStorageName(DescriptorStorage storage)
+{
+    switch (storage)
+    {
+    case STORAGE_INT8:
+        return "int8";
+    case STORAGE_FLOAT16:
+        return "float16";
+    default:
+        return "float";
+    }
+}
+
+bool
+DescriptorQuantizer::ParseStorage(const std::string &name,
+                                  DescriptorStorage &storage)
+{
+    if (name == "float")
+        storage = STORAGE_FLOAT;
+    else if (name == "int8")
+        storage = STORAGE_INT8;
+    else if (name == "float16")
+        storage = STORAGE_FLOAT16;
+    else
+        return false;
+
+    return true;
+}
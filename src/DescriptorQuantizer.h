@@ -0,0 +1,150 @@
+/**
+ * @brief Compact storage for float descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file DescriptorQuantizer.h
+ */
+
+#ifndef descriptor_quantizer_h
+#define descriptor_quantizer_h
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+/**
+ * @brief How the training descriptors are kept in memory
+ */
+enum DescriptorStorage
+{
+    STORAGE_FLOAT,      ///< 32 bit floats, searched through FLANN
+    STORAGE_INT8,       ///< 8 bit codes (CV_8S), 4 times smaller
+    STORAGE_FLOAT16     ///< Half floats (CV_16U), 2 times smaller
+};
+
+/**
+ * @class DescriptorQuantizer
+ * @brief Encode float descriptors to compact codes and match against them.
+ *
+ * Every dimension d has its own scale s[d], taken from the largest
+ * magnitude found in the training set, and a descriptor value x is
+ * stored as the code x / s[d]: rounded to an integer in [-127, 127] for
+ * int8, as a half float in [-1, 1] for float16.
+ *
+ * Codes are never decoded as a whole: Match() compares float query
+ * descriptors against the codes with the distance
+ * sum((q[d] - s[d] * code[d])^2), in SSE2, F16C or AVX2 kernels picked
+ * at run time for the host CPU.
+ *
+ * The search is exhaustive, every query row against every code: for a
+ * candidate of m rows and a query of n, n x m distances instead of the
+ * few FLANN checks per row of the float storage. The kernels keep that
+ * cost down, but it still grows with the size of both images, and
+ * verifying a candidate is slower than with STORAGE_FLOAT: the compact
+ * storages trade query time for memory. paintMatcherBench measures both
+ * side by side.
+ */
+class DescriptorQuantizer
+{
+public:
+
+    DescriptorQuantizer();
+
+    /**
+     * @brief Compute the per-dimension scales from a set of descriptors
+     * @param[in] descriptors The float descriptors, one matrix per image
+     * @param[in] storage STORAGE_INT8 or STORAGE_FLOAT16
+     */
+    void Fit(const std::vector<cv::Mat> &descriptors,
+             DescriptorStorage storage);
+    /**
+     * @brief Restore the scales saved from a previous Fit()
+     * @param[in] storage STORAGE_INT8 or STORAGE_FLOAT16
+     * @param[in] scales One CV_32F row, a scale per dimension
+     */
+    void SetScales(DescriptorStorage storage, const cv::Mat &scales);
+    /**
+     * @brief Forget the scales
+     */
+    void Clear();
+    /**
+     * @brief Check whether the scales are set
+     */
+    bool Empty() const;
+    /**
+     * @brief Retrieve the code format
+     */
+    DescriptorStorage GetStorage() const;
+    /**
+     * @brief Retrieve the per-dimension scales, one CV_32F row
+     */
+    const cv::Mat &GetScales() const;
+    /**
+     * @brief Encode float descriptors
+     * @param[in] descriptors The descriptors, CV_32F
+     * @param[out] codes The codes, CV_8S or CV_16U
+     */
+    void Encode(const cv::Mat &descriptors, cv::Mat &codes) const;
+    /**
+     * @brief Decode codes back to approximate float descriptors
+     * @param[in] codes The codes, CV_8S or CV_16U
+     * @param[out] descriptors The descriptors, CV_32F
+     */
+    void Decode(const cv::Mat &codes, cv::Mat &descriptors) const;
+    /**
+     * @brief Find the exact nearest neighbours in both directions
+     * @param[in] query Float descriptors, CV_32F
+     * @param[in] codes Encoded descriptors
+     * @param[out] matches12 For every query row, its nearest code
+     * @param[out] matches21 For every code row, its nearest query row
+     * @param[out] second If not NULL, the distance of the second nearest
+     * code of every query row, FLT_MAX if there is none
+     *
+     * Distances are L2, like the ones DescriptorIndex::Match() returns.
+     * Both directions come from the same pass over the distance matrix.
+     */
+    void Match(const cv::Mat &query, const cv::Mat &codes,
+               std::vector<cv::DMatch> &matches12,
+               std::vector<cv::DMatch> &matches21,
+               std::vector<float> *second = NULL) const;
+    /**
+     * @brief Name of the distance kernels used on this CPU
+     */
+    static const char *GetKernelName();
+    /**
+     * @brief Retrieve the name of a storage, as ParseStorage() reads it
+     */
+    static const char *GetStorageName(DescriptorStorage storage);
+    /**
+     * @brief Retrieve the storage named "float", "int8" or "float16"
+     * @return False if the name is unknown
+     */
+    static bool ParseStorage(const std::string &name,
+                             DescriptorStorage &storage);
+
+private:
+
+    DescriptorStorage mStorage;
+    cv::Mat mScales;
+};
+
+inline bool DescriptorQuantizer::Empty() const
+{
+    return mScales.empty();
+}
+
+inline DescriptorStorage DescriptorQuantizer::GetStorage() const
+{
+    return mStorage;
+}
+
+inline const cv::Mat &DescriptorQuantizer::GetScales() const
+{
+    return mScales;
+}
+
+#endif // header guard
@@ -0,0 +1,209 @@
+/**
+ * @brief Keep a matcher in sync with a directory of images.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file DirectoryWatcher.cpp
+ */
+
+#include "DirectoryWatcher.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <algorithm>
+#include <iostream>
+#include <boost/filesystem.hpp>
+
+// Written files are only complete at IN_CLOSE_WRITE
+static const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO |
+                                     IN_DELETE | IN_MOVED_FROM;
+
+DirectoryWatcher::DirectoryWatcher(ImageMatcher &matcher,
+                                   const std::string &directory) :
+    mMatcher(matcher),
+    mDirectory(directory),
+    mSyncTime(time(NULL))
+{
+    if (!mDirectory.empty() && mDirectory[mDirectory.size() - 1] != '/')
+        mDirectory += '/';
+
+    mNotifyFd = inotify_init();
+    if (mNotifyFd < 0)
+        throw DirectoryWatcherIOException(std::string("inotify_init: ") +
+                                          strerror(errno));
+
+    if (inotify_add_watch(mNotifyFd, mDirectory.c_str(), WATCH_EVENTS) < 0)
+    {
+        int error = errno;
+        close(mNotifyFd);
+        throw DirectoryWatcherIOException("Cannot watch " + directory + ": " +
+                                          strerror(error));
+    }
+
+    if (pipe(mWakePipe) < 0)
+    {
+        int error = errno;
+        close(mNotifyFd);
+        throw DirectoryWatcherIOException(std::string("pipe: ") +
+                                          strerror(error));
+    }
+
+    mThread.reset(new boost::thread(&DirectoryWatcher::Run, this));
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    Stop();
+
+    close(mWakePipe[0]);
+    close(mWakePipe[1]);
+    close(mNotifyFd);
+}
+
+void
+DirectoryWatcher::Stop()
+{
+    if (!mThread)
+        return;
+
+    char wake = 0;
+    while (write(mWakePipe[1], &wake, 1) < 0 && errno == EINTR)
+        ;
+
+    mThread->join();
+    mThread.reset();
+}
+
+void
+DirectoryWatcher::Run()
+{
+    // Events are variable sized, the buffer must be aligned for them
+    union
+    {
+        struct inotify_event event;
+        char bytes[4096];
+    } buffer;
+
+    while (true)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = mNotifyFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = mWakePipe[0];
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "poll: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        if (fds[1].revents)
+            return;
+
+        ssize_t length = read(mNotifyFd, buffer.bytes, sizeof(buffer.bytes));
+        if (length < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            std::cerr << "inotify: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        for (ssize_t offset = 0; offset < length; )
+        {
+            const struct inotify_event *event =
+                reinterpret_cast<const struct inotify_event *>(buffer.bytes + offset);
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                std::cerr << "inotify queue overflow, rescanning "
+                          << mDirectory << std::endl;
+                Rescan();
+            }
+            else if (event->len > 0)
+                HandleEvent(event->mask, event->name);
+
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void
+DirectoryWatcher::HandleEvent(unsigned int mask, const std::string &name)
+{
+    // A shard only follows its own images
+    if ((mask & IN_ISDIR) || !ImageReader::IsSupported(name) ||
+        !mMatcher.OwnsImage(name))
+        return;
+
+    try
+    {
+        if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        {
+            mMatcher.UpdateImage(mDirectory + name);
+            std::cerr << "Updated " << name << std::endl;
+        }
+        else if (mMatcher.RemoveImage(name))
+        {
+            std::cerr << "Removed " << name << std::endl;
+        }
+    }
+    catch (const std::exception &ex)
+    {
+        // e.g. an image that cannot be decoded, the others go on
+        std::cerr << ex.what() << ": " << name << std::endl;
+    }
+}
+
+void
+DirectoryWatcher::Rescan()
+{
+    namespace fs = boost::filesystem;
+
+    // Writes during the scan are seen again by the next one
+    const time_t scanTime = time(NULL);
+
+    std::vector<std::string> known = mMatcher.GetImageNames();
+    std::sort(known.begin(), known.end());
+
+    std::vector<std::string> present;
+    try
+    {
+        fs::directory_iterator end, it(mDirectory);
+        for (; it != end; ++it)
+        {
+            if (!fs::is_regular_file(it->status()))
+                continue;
+
+            // The lost events may have added an image (moved files keep
+            // their time) or changed any one written since the last scan
+            const std::string name = it->path().filename().string();
+            present.push_back(name);
+            if (!std::binary_search(known.begin(), known.end(), name) ||
+                fs::last_write_time(it->path()) >= mSyncTime)
+                HandleEvent(IN_CLOSE_WRITE, name);
+        }
+    }
+    catch (const fs::filesystem_error &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return;
+    }
+    std::sort(present.begin(), present.end());
+
+    for (size_t i = 0; i < known.size(); ++i)
+    {
+        if (!std::binary_search(present.begin(), present.end(), known[i]))
+            HandleEvent(IN_DELETE, known[i]);
+    }
+
+    mSyncTime = scanTime;
+}
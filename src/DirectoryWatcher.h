@@ -0,0 +1,84 @@
+/**
+ * @brief Keep a matcher in sync with a directory of images.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file DirectoryWatcher.h
+ */
+
+#ifndef directory_watcher_h
+#define directory_watcher_h
+
+#include "ImageMatcher.h"
+
+#include <time.h>
+#include <string>
+#include <stdexcept>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ * @class DirectoryWatcher
+ * @brief Apply the changes of a directory to a matcher while it serves.
+ *
+ * A background thread waits for inotify events on the directory: an
+ * image written or moved in is passed to ImageMatcher::UpdateImage(),
+ * one deleted or moved out to ImageMatcher::RemoveImage(). Only the
+ * file types listed by ImageReader are considered, and subdirectories
+ * are not watched. A sharded matcher ignores the images of the other
+ * shards. If the kernel drops events, the directory is scanned again
+ * and compared with the dataset. Every change is reported on std::cerr.
+ */
+class DirectoryWatcher : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor, starts watching
+     * @param[in] matcher The matcher to update, usually trained on the
+     * same directory
+     * @param[in] directory The directory to watch
+     */
+    DirectoryWatcher(ImageMatcher &matcher, const std::string &directory);
+    /**
+     * @brief Destructor, stops watching
+     */
+    ~DirectoryWatcher();
+    /**
+     * @brief Stop watching and wait for the change in progress, if any
+     */
+    void Stop();
+
+private:
+
+    void Run();
+    void HandleEvent(unsigned int mask, const std::string &name);
+    void Rescan();
+
+    ImageMatcher &mMatcher;
+    std::string mDirectory;
+    /**
+     * @brief Start of the last scan, or of the watch: files written
+     * since then may not be in the matcher yet
+     */
+    time_t mSyncTime;
+
+    int mNotifyFd;
+    /**
+     * @brief Written by Stop() to wake the thread up
+     */
+    int mWakePipe[2];
+    boost::scoped_ptr<boost::thread> mThread;
+};
+
+class DirectoryWatcherIOException : public std::runtime_error
+{
+public:
+    DirectoryWatcherIOException(const std::string &msg = "") :
+        runtime_error(msg) {}
+};
+
+#endif // header guard
@@ -0,0 +1,178 @@
+/**
+ * @brief Keypoint detection and description with a choice of features.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file FeatureExtractor.cpp
+ */
+
+#include "FeatureExtractor.h"
+
+#include <algorithm>
+#include <opencv2/nonfree/features2d.hpp>
+
+// About as many ORB keypoints as SURF finds with the default threshold
+static const int ORB_FEATURES = 1000;
+static const int BRISK_THRESHOLD = 30;
+// Threshold halvings tried to reach the target keypoint count
+static const int ADAPTIVE_STEPS = 3;
+
+FeatureExtractor::FeatureExtractor(FeatureType type, int minHessian) :
+    mType(type),
+    mMinHessian(minHessian)
+{
+    CreateAlgorithms();
+}
+
+FeatureExtractor::FeatureExtractor(const FeatureExtractor &other) :
+    mType(other.mType),
+    mMinHessian(other.mMinHessian)
+{
+    CreateAlgorithms();
+}
+
+FeatureExtractor &
+FeatureExtractor::operator=(const FeatureExtractor &other)
+{
+    if (this != &other)
+    {
+        boost::mutex::scoped_lock lock(mTargetMutex);
+        mType = other.mType;
+        mMinHessian = other.mMinHessian;
+        mTargetDetectors.clear();
+        lock.unlock();
+
+        CreateAlgorithms();
+    }
+
+    return *this;
+}
+
+void
+FeatureExtractor::CreateAlgorithms()
+{
+    mDetectors.clear();
+
+    double relax = 1;
+    for (int step = 0; step <= ADAPTIVE_STEPS; ++step, relax /= 2)
+        mDetectors.push_back(CreateDetector(relax, 0));
+
+    switch (mType)
+    {
+    case FEATURE_ORB:
+        mDescriber = new cv::ORB();
+        break;
+    case FEATURE_BRISK:
+        mDescriber = new cv::BRISK();
+        break;
+    case FEATURE_FREAK:
+        // FREAK builds its sampling pattern on the first compute(), which
+        // is not safe to share: it gets one extractor per image instead
+        mDescriber.release();
+        break;
+    case FEATURE_SURF:
+    default:
+        mDescriber = new cv::SurfDescriptorExtractor();
+        break;
+    }
+}
+
+cv::Ptr<cv::FeatureDetector>
+FeatureExtractor::CreateDetector(double relax, int target) const
+{
+    switch (mType)
+    {
+    case FEATURE_ORB:
+        return new cv::ORB(target > 0 ? target : ORB_FEATURES);
+    case FEATURE_BRISK:
+    case FEATURE_FREAK:
+        // FREAK is a descriptor only, BRISK provides scale-aware keypoints
+        return new cv::BRISK(std::max(1, cvRound(BRISK_THRESHOLD * relax)));
+    case FEATURE_SURF:
+    default:
+        return new cv::SurfFeatureDetector(mMinHessian * relax);
+    }
+}
+
+const cv::Ptr<cv::FeatureDetector> &
+FeatureExtractor::GetDetector(int step, int target) const
+{
+    // Only ORB depends on the target, and it is never relaxed
+    if (mType != FEATURE_ORB || target <= 0 || target == ORB_FEATURES)
+        return mDetectors[step];
+
+    boost::mutex::scoped_lock lock(mTargetMutex);
+    cv::Ptr<cv::FeatureDetector> &detector = mTargetDetectors[target];
+    if (detector.empty())
+        detector = CreateDetector(1, target);
+
+    // Map entries are never erased while the extractor is in use
+    return detector;
+}
+
+void
+FeatureExtractor::Compute(const cv::Mat &image,
+                          std::vector<cv::KeyPoint> &keypoints,
+                          cv::Mat &descriptors,
+                          const KeypointBudget &budget,
+                          size_t *detected) const
+{
+    // The target only steers the detector, the cap is maxKeypoints alone
+    const int target = budget.targetKeypoints;
+    const int limit = budget.maxKeypoints;
+
+    // Flat images: relax the detector threshold until the target is met.
+    // ORB is not thresholded, it always finds its best n keypoints.
+    GetDetector(0, target)->detect(image, keypoints);
+    for (int step = 1; step <= ADAPTIVE_STEPS && mType != FEATURE_ORB &&
+            static_cast<int>(keypoints.size()) < target; ++step)
+    {
+        GetDetector(step, target)->detect(image, keypoints);
+    }
+
+    if (detected)
+        *detected = keypoints.size();
+
+    // Textured images: keep the strongest responses, which is the same
+    // as raising the threshold, before paying for their descriptors
+    if (limit > 0 && static_cast<int>(keypoints.size()) > limit)
+        cv::KeyPointsFilter::retainBest(keypoints, limit);
+
+    if (mDescriber.empty())
+    {
+        cv::FREAK extractor;
+        extractor.compute(image, keypoints, descriptors);
+    }
+    else
+    {
+        mDescriber->compute(image, keypoints, descriptors);
+    }
+}
+
+int
+FeatureExtractor::GetDescriptorSize() const
+{
+    if (mDescriber.empty())
+        return cv::FREAK().descriptorSize();
+
+    return mDescriber->descriptorSize();
+}
+
+bool
+FeatureExtractor::ParseType(const std::string &name, FeatureType &type)
+{
+    if (name == "surf")
+        type = FEATURE_SURF;
+    else if (name == "orb")
+        type = FEATURE_ORB;
+    else if (name == "brisk")
+        type = FEATURE_BRISK;
+    else if (name == "freak")
+        type = FEATURE_FREAK;
+    else
+        return false;
+
+    return true;
+}
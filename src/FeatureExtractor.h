@@ -0,0 +1,161 @@
+/**
+ * @brief Keypoint detection and description with a choice of features.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file FeatureExtractor.h
+ */
+
+#ifndef feature_extractor_h
+#define feature_extractor_h
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+/**
+ * @brief The supported local features
+ */
+enum FeatureType
+{
+    FEATURE_SURF,   ///< SURF keypoints, 64 float descriptor (nonfree)
+    FEATURE_ORB,    ///< ORB keypoints, 256 bit descriptor
+    FEATURE_BRISK,  ///< BRISK keypoints, 512 bit descriptor
+    FEATURE_FREAK   ///< BRISK keypoints, 512 bit FREAK descriptor
+};
+
+/**
+ * @brief How many keypoints an image may keep
+ */
+struct KeypointBudget
+{
+    KeypointBudget(int maxKeypoints = 0, int targetKeypoints = 0) :
+        maxKeypoints(maxKeypoints), targetKeypoints(targetKeypoints) {}
+
+    /**
+     * @brief Keep only this many keypoints, the strongest ones. Zero
+     * keeps them all.
+     */
+    int maxKeypoints;
+    /**
+     * @brief Relax the detector threshold (up to 8 times) while fewer
+     * keypoints are found. Zero disables. ORB, which has no threshold,
+     * detects this many keypoints instead of its default. It does not
+     * cap anything, maxKeypoints does.
+     */
+    int targetKeypoints;
+};
+
+/**
+ * @class FeatureExtractor
+ * @brief Detect keypoints and compute their descriptors.
+ *
+ * SURF gives float descriptors, matched by L2 distance. The other
+ * features give binary descriptors (CV_8U rows), matched by Hamming
+ * distance; they are several times faster to compute and 8 times
+ * smaller than SURF.
+ *
+ * The detectors (one per threshold relaxation step) and the descriptor
+ * extractor are created once and shared by all the threads computing
+ * features: building them, the BRISK sampling pattern in particular,
+ * is not repeated for every image. A copy creates its own. FREAK, whose
+ * pattern is built lazily, still gets a fresh extractor per image.
+ */
+class FeatureExtractor
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] type The features to compute
+     * @param[in] minHessian SURF Hessian threshold, ignored by the
+     * other features
+     */
+    FeatureExtractor(FeatureType type = FEATURE_SURF, int minHessian = 400);
+    FeatureExtractor(const FeatureExtractor &other);
+    FeatureExtractor &operator=(const FeatureExtractor &other);
+    /**
+     * @brief Detect the keypoints of an image and describe them
+     * @param[in] image The image
+     * @param[out] keypoints The keypoints, some may be dropped by the
+     * description
+     * @param[out] descriptors One descriptor per keypoint
+     * @param[in] budget How many keypoints to keep
+     * @param[out] detected If not NULL, the number of keypoints detected
+     * before the budget was applied
+     */
+    void Compute(const cv::Mat &image, std::vector<cv::KeyPoint> &keypoints,
+                 cv::Mat &descriptors,
+                 const KeypointBudget &budget = KeypointBudget(),
+                 size_t *detected = NULL) const;
+    /**
+     * @brief Retrieve the features computed
+     */
+    FeatureType GetType() const;
+    /**
+     * @brief Retrieve the SURF Hessian threshold
+     */
+    int GetMinHessian() const;
+    /**
+     * @brief Check whether the descriptors are binary strings
+     */
+    bool IsBinary() const;
+    /**
+     * @brief Retrieve the length of a descriptor: floats for SURF, bytes
+     * for the binary features
+     */
+    int GetDescriptorSize() const;
+    /**
+     * @brief Retrieve the features named "surf", "orb", "brisk" or "freak"
+     * @return False if the name is unknown
+     */
+    static bool ParseType(const std::string &name, FeatureType &type);
+
+private:
+
+    void CreateAlgorithms();
+    cv::Ptr<cv::FeatureDetector> CreateDetector(double relax,
+                                                int target) const;
+    const cv::Ptr<cv::FeatureDetector> &GetDetector(int step,
+                                                    int target) const;
+
+    FeatureType mType;
+    int mMinHessian;
+
+    /**
+     * @brief The detectors with the threshold halved 0 to ADAPTIVE_STEPS
+     * times
+     */
+    std::vector<cv::Ptr<cv::FeatureDetector> > mDetectors;
+    /**
+     * @brief ORB detectors by target keypoint count, created on demand
+     */
+    mutable std::map<int, cv::Ptr<cv::FeatureDetector> > mTargetDetectors;
+    mutable boost::mutex mTargetMutex;
+    /**
+     * @brief The shared descriptor extractor, empty for FREAK
+     */
+    cv::Ptr<cv::DescriptorExtractor> mDescriber;
+};
+
+inline FeatureType FeatureExtractor::GetType() const
+{
+    return mType;
+}
+
+inline int FeatureExtractor::GetMinHessian() const
+{
+    return mMinHessian;
+}
+
+inline bool FeatureExtractor::IsBinary() const
+{
+    return mType != FEATURE_SURF;
+}
+
+#endif // header guard
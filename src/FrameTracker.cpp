@@ -0,0 +1,85 @@
+/**
+ * @brief Match a stream of video frames, following the matched painting.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file FrameTracker.cpp
+ */
+
+#include "FrameTracker.h"
+
+#include <vector>
+
+FrameTracker::FrameTracker(ImageMatcher &matcher, int minInliers,
+                           unsigned int refreshInterval) :
+    mMatcher(matcher),
+    mMinInliers(minInliers),
+    mRefreshInterval(refreshInterval),
+    mTrackedIndex(-1),
+    mFramesSinceSearch(0),
+    mFrameCount(0),
+    mSearchCount(0)
+{
+}
+
+void
+FrameTracker::Reset()
+{
+    mTrackedIndex = -1;
+    mTrackedName.clear();
+    mHomography.release();
+    mFramesSinceSearch = 0;
+}
+
+void
+FrameTracker::Follow(const MatchResult &result)
+{
+    if (result.index >= 0 && result.inliers >= mMinInliers)
+    {
+        mTrackedIndex = result.index;
+        mTrackedName = result.fileName;
+        mHomography = result.homography;
+    }
+    else
+    {
+        Reset();
+    }
+}
+
+bool
+FrameTracker::Track(const cv::Mat &frame, MatchResult &result)
+{
+    mFrameCount++;
+
+    // The features are extracted once, for the tracked painting and for
+    // the search that follows if it is lost
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    mMatcher.ExtractFeatures(frame, keypoints, descriptors);
+
+    bool refresh = mRefreshInterval > 0 &&
+                   mFramesSinceSearch >= mRefreshInterval;
+    if (IsTracking() && !refresh)
+    {
+        std::vector<int> tracked(1, mTrackedIndex);
+        mMatcher.MatchFeatures(keypoints, descriptors, result, &tracked);
+
+        if (result.index == mTrackedIndex &&
+            result.fileName == mTrackedName &&
+            result.inliers >= mMinInliers)
+        {
+            mHomography = result.homography;
+            mFramesSinceSearch++;
+            return true;
+        }
+    }
+
+    mMatcher.MatchFeatures(keypoints, descriptors, result);
+    mSearchCount++;
+    mFramesSinceSearch = 0;
+    Follow(result);
+
+    return false;
+}
@@ -0,0 +1,122 @@
+/**
+ * @brief Match a stream of video frames, following the matched painting.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file FrameTracker.h
+ */
+
+#ifndef frame_tracker_h
+#define frame_tracker_h
+
+#include "ImageMatcher.h"
+
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <opencv2/core/core.hpp>
+
+/**
+ * @class FrameTracker
+ * @brief A streaming query: consecutive frames of one camera.
+ *
+ * Consecutive frames almost always show the same painting. Once a frame
+ * is matched with enough inliers, the next frames are verified against
+ * that painting only, and the dataset is searched again only when the
+ * painting is lost (too few inliers) or every refresh interval, to
+ * notice a better match. A tracked frame costs one feature extraction
+ * and one homography instead of a whole query.
+ *
+ * The confidence of a tracked frame is measured against the "no match"
+ * distance of the paintings not verified, so it is higher than the one
+ * of a full search.
+ *
+ * One tracker per stream; the matcher can be shared.
+ */
+class FrameTracker : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] matcher A trained matcher
+     * @param[in] minInliers RANSAC inliers a match needs to be tracked
+     * @param[in] refreshInterval Frames after which the dataset is
+     * searched again even if the match holds, zero for never
+     */
+    FrameTracker(ImageMatcher &matcher, int minInliers = 15,
+                 unsigned int refreshInterval = 30);
+
+    /**
+     * @brief Match the next frame of the stream
+     * @param[in] frame The frame, decoded as the matcher expects
+     * @param[out] result The best match
+     * @return True if the frame was verified against the tracked
+     * painting only, false if the dataset was searched
+     */
+    bool Track(const cv::Mat &frame, MatchResult &result);
+
+    /**
+     * @brief Forget the tracked painting, e.g. on a cut
+     */
+    void Reset();
+
+    bool IsTracking() const;
+    /**
+     * @brief The homography from the last tracked frame to its painting
+     */
+    const cv::Mat &GetHomography() const;
+    /**
+     * @brief Number of frames since construction
+     */
+    unsigned int GetFrameCount() const;
+    /**
+     * @brief Number of frames for which the dataset was searched
+     */
+    unsigned int GetSearchCount() const;
+
+private:
+
+    void Follow(const MatchResult &result);
+
+    ImageMatcher &mMatcher;
+    int mMinInliers;
+    unsigned int mRefreshInterval;
+
+    /**
+     * @brief The tracked painting, -1 if none
+     */
+    int mTrackedIndex;
+    /**
+     * @brief Its name, in case the dataset is trained again meanwhile
+     */
+    std::string mTrackedName;
+    cv::Mat mHomography;
+    unsigned int mFramesSinceSearch;
+
+    unsigned int mFrameCount;
+    unsigned int mSearchCount;
+};
+
+inline bool FrameTracker::IsTracking() const
+{
+    return mTrackedIndex >= 0;
+}
+
+inline const cv::Mat &FrameTracker::GetHomography() const
+{
+    return mHomography;
+}
+
+inline unsigned int FrameTracker::GetFrameCount() const
+{
+    return mFrameCount;
+}
+
+inline unsigned int FrameTracker::GetSearchCount() const
+{
+    return mSearchCount;
+}
+
+#endif // header guard
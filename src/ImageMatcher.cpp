@@ -9,13 +9,22 @@
  */
 
 #include "ImageMatcher.h"
+#include "BoundedQueue.h"
+#include "Stats.h"
 
 #include <stdio.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <numeric>
-#include <opencv2/nonfree/features2d.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
@@ -23,63 +32,1543 @@
 
 using namespace cv;
 
-ImageMatcher::ImageMatcher(int minHessian) :
-    mMinHessian(minHessian)
+namespace
 {
+
+typedef boost::shared_lock<boost::shared_mutex> ReadLock;
+typedef boost::unique_lock<boost::shared_mutex> WriteLock;
+
+// Images added since the voting index was built that are tolerated
+// before rebuilding it, for small candidate counts
+const size_t MIN_PENDING_IMAGES = 8;
+
+/**
+ * A vocabulary only quantizes the descriptors it was clustered from:
+ * other lengths would fail deep in Quantize(), another kind of the same
+ * length would give meaningless words.
+ */
+void
+CheckVocabulary(const Vocabulary &vocabulary, const FeatureExtractor &extractor)
+{
+    if (vocabulary.GetDescriptorSize() != extractor.GetDescriptorSize() ||
+            vocabulary.IsBinary() != extractor.IsBinary())
+        throw VocabularyIOException("Vocabulary built for other descriptors");
+}
+
+} // namespace
+
+ImageMatcher::ImageMatcher(int minHessian, unsigned int numThreads,
+                           FeatureType features) :
+    mThreadPool(new ThreadPool(numThreads)),
+    mRemovedCount(0),
+    mRemovedRows(0),
+    mStorage(STORAGE_FLOAT),
+    mGlobalImageCount(0),
+    mCandidateCount(0),
+    mPrefilterCount(0),
+    mEarlyExitInliers(0),
+    mEarlyExitMargin(0),
+    mExtractor(features, minHessian),
+    mShard(0),
+    mShardCount(1)
+{
+    mWorkerScratch.resize(mThreadPool->GetNumThreads());
+}
+
+void
+ImageMatcher::SetNumThreads(unsigned int numThreads)
+{
+    WriteLock lock(mDatasetMutex);
+    mThreadPool.reset(new ThreadPool(numThreads));
+    mWorkerScratch.resize(mThreadPool->GetNumThreads());
+}
+
+void
+ImageMatcher::SetCandidateCount(unsigned int candidateCount)
+{
+    WriteLock lock(mDatasetMutex);
+    mCandidateCount = candidateCount;
+    BuildSearchIndex();
+    mResultCache.Clear();
+}
+
+void
+ImageMatcher::SetPrefilter(unsigned int prefilterCount)
+{
+    WriteLock lock(mDatasetMutex);
+    mPrefilterCount = prefilterCount;
+    mResultCache.Clear();
+}
+
+void
+ImageMatcher::SetEarlyExit(int minInliers, float minConfidence)
+{
+    WriteLock lock(mDatasetMutex);
+    mEarlyExitInliers = std::max(0, minInliers);
+    mEarlyExitMargin = minConfidence;
+    BuildSearchIndex();
+    mResultCache.Clear();
+}
+
+void
+ImageMatcher::SetMatchFilter(const MatchFilter &filter)
+{
+    WriteLock lock(mDatasetMutex);
+    mFilter = filter;
+    mResultCache.Clear();
+}
+
+void
+ImageMatcher::SetResultCache(size_t capacity, int maxHashDistance)
+{
+    mResultCache.SetCapacity(capacity, maxHashDistance);
+}
+
+ResultCacheStats
+ImageMatcher::GetResultCacheStats() const
+{
+    return mResultCache.GetStats();
+}
+
+void
+ImageMatcher::SetDescriptorStorage(DescriptorStorage storage)
+{
+    mStorage = storage;
+}
+
+void
+ImageMatcher::SetDecodePolicy(const DecodePolicy &policy)
+{
+    mImageReader.SetDecodePolicy(policy);
+    mResultCache.Clear();
+}
+
+const DecodePolicy &
+ImageMatcher::GetDecodePolicy() const
+{
+    return mImageReader.GetDecodePolicy();
+}
+
+void
+ImageMatcher::SetTrainKeypointBudget(const KeypointBudget &budget)
+{
+    WriteLock lock(mDatasetMutex);
+    mTrainBudget = budget;
+}
+
+void
+ImageMatcher::SetQueryKeypointBudget(const KeypointBudget &budget)
+{
+    WriteLock lock(mDatasetMutex);
+    mResultCache.Clear();
+    mQueryBudget = budget;
+}
+
+TrainingStats
+ImageMatcher::GetTrainingStats() const
+{
+    ReadLock lock(mDatasetMutex);
+    return mTrainingStats;
+}
+
+void
+ImageMatcher::SetShard(unsigned int shard, unsigned int shardCount)
+{
+    if (shardCount == 0 || shard >= shardCount)
+        throw ImageMatcherIOException("Bad shard");
+
+    WriteLock lock(mDatasetMutex);
+    mShard = shard;
+    mShardCount = shardCount;
+}
+
+bool
+ImageMatcher::OwnsImage(const std::string &name) const
+{
+    ReadLock lock(mDatasetMutex);
+    return ImageReader::ShardOf(name, mShardCount) == mShard;
+}
+
+std::vector<std::string>
+ImageMatcher::GetImageNames() const
+{
+    ReadLock lock(mDatasetMutex);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < mFileNames.size(); ++i)
+    {
+        if (!mRemoved[i])
+            names.push_back(mFileNames[i]);
+    }
+    return names;
+}
+
+void
+ImageMatcher::BuildVocabulary(int branching, int depth)
+{
+    WriteLock lock(mDatasetMutex);
+    boost::shared_ptr<Vocabulary> vocabulary(new Vocabulary);
+
+    // k-means needs the float values back for codes, only while building
+    std::vector<Mat> descriptors;
+    for (size_t i = 0; i < mArena.GetImageCount(); ++i)
+    {
+        if (mRemoved[i] || mArena.GetCount(i) == 0)
+            continue;
+
+        descriptors.push_back(Mat());
+        GetFloatDescriptors(i, descriptors.back());
+    }
+    vocabulary->Build(descriptors, branching, depth);
+
+    InvertedFile invertedFile;
+    BuildInvertedFile(*vocabulary, invertedFile);
+
+    mVocabulary = vocabulary;
+    mInvertedFile = invertedFile;
+    BuildSearchIndex();
+    mResultCache.Clear();
+}
+
+void
+ImageMatcher::SaveVocabulary(const std::string &vocabularyFile) const
+{
+    if (!mVocabulary)
+        throw VocabularyIOException("No vocabulary to save");
+
+    mVocabulary->Save(vocabularyFile);
+}
+
+void
+ImageMatcher::LoadVocabulary(const std::string &vocabularyFile)
+{
+    boost::shared_ptr<Vocabulary> vocabulary(new Vocabulary);
+    vocabulary->Load(vocabularyFile);
+
+    WriteLock lock(mDatasetMutex);
+    CheckVocabulary(*vocabulary, mExtractor);
+
+    // The matcher keeps its vocabulary if the words cannot be indexed
+    InvertedFile invertedFile;
+    BuildInvertedFile(*vocabulary, invertedFile);
+
+    mVocabulary = vocabulary;
+    mInvertedFile = invertedFile;
+    BuildSearchIndex();
+    mResultCache.Clear();
+}
+
+/**
+ * Quantize the descriptors of one training image.
+ */
+class ImageMatcher::WordsTask : public ParallelTask
+{
+public:
+
+    WordsTask(const ImageMatcher &matcher, const Vocabulary &vocabulary,
+              std::vector<std::vector<int> > &imageWords) :
+        mMatcher(matcher),
+        mVocabulary(vocabulary),
+        mImageWords(imageWords) {}
+
+    void operator() (size_t index, unsigned int /*worker*/)
+    {
+        Mat descriptors;
+        mMatcher.GetFloatDescriptors(index, descriptors);
+        mVocabulary.Quantize(descriptors, mImageWords[index]);
+    }
+
+private:
+
+    const ImageMatcher &mMatcher;
+    const Vocabulary &mVocabulary;
+    std::vector<std::vector<int> > &mImageWords;
+};
+
+/**
+ * Build the index of one training image.
+ */
+class ImageMatcher::IndexTask : public ParallelTask
+{
+public:
+
+    IndexTask(ImageMatcher &matcher) :
+        mMatcher(matcher) {}
+
+    void operator() (size_t index, unsigned int /*worker*/)
+    {
+        Mat descriptors = mMatcher.mArena.GetDescriptors(index);
+        if (!descriptors.empty())
+            mMatcher.mTrainIndices[index].Build(descriptors);
+    }
+
+private:
+
+    ImageMatcher &mMatcher;
+};
+
+void
+ImageMatcher::BuildInvertedFile(const Vocabulary &vocabulary,
+                                InvertedFile &invertedFile) const
+{
+    const size_t imageCount = mArena.GetImageCount();
+    if (imageCount == 0)
+        return;
+
+    std::vector<std::vector<int> > imageWords(imageCount);
+
+    WordsTask task(*this, vocabulary, imageWords);
+    mThreadPool->ParallelFor(imageCount, task);
+
+    invertedFile.Build(imageWords, vocabulary.GetWordCount());
+}
+
+void
+ImageMatcher::BuildSearchIndex()
+{
+    const size_t imageCount = mArena.GetImageCount();
+
+    if (mTrainIndices.size() != imageCount)
+    {
+        mTrainIndices.assign(imageCount, DescriptorIndex());
+
+        // Compact descriptors are searched exhaustively instead
+        if (mQuantizer.Empty())
+        {
+            IndexTask task(*this);
+            mThreadPool->ParallelFor(imageCount, task);
+        }
+    }
+
+    // The inverted file replaces the voting index when there is a
+    // vocabulary, it needs much less memory
+    if (mVocabulary && mInvertedFile.Empty())
+        BuildInvertedFile(*mVocabulary, mInvertedFile);
+
+    if ((mCandidateCount == 0 && mEarlyExitInliers == 0) || mVocabulary)
+    {
+        mGlobalIndex.Clear();
+        mGlobalImageIds.clear();
+        return;
+    }
+
+    if (!mGlobalIndex.Empty() || mArena.GetRowCount() == 0)
+        return;
+
+    // The arena is already one block: float descriptors are indexed in
+    // place, codes are decoded all at once. Rows of removed images stay
+    // in and vote for nothing.
+    Mat all = mArena.GetDescriptors();
+    if (!mQuantizer.Empty())
+        mQuantizer.Decode(mArena.GetDescriptors(), all);
+
+    std::vector<int> imageIds(mArena.GetRowCount(), -1);
+    for (size_t i = 0; i < imageCount; ++i)
+    {
+        if (!mRemoved[i])
+            std::fill(imageIds.begin() + mArena.GetBegin(i),
+                      imageIds.begin() + mArena.GetBegin(i) + mArena.GetCount(i),
+                      static_cast<int>(i));
+    }
+
+    mGlobalIndex.Build(all);
+    mGlobalImageIds.swap(imageIds);
+    mGlobalImageCount = imageCount;
+}
+
+namespace
+{
+
+/**
+ * Order image indices by decreasing score, ties going to the lowest index.
+ */
+template <typename T>
+struct HigherScore
+{
+    HigherScore(const std::vector<T> &scores) : mScores(scores) {}
+
+    bool operator() (int a, int b) const
+    {
+        if (mScores[a] != mScores[b])
+            return mScores[a] > mScores[b];
+        return a < b;
+    }
+
+    const std::vector<T> &mScores;
+};
+
+template <typename T>
+void
+TopScores(const std::vector<T> &scores, size_t count,
+          std::vector<int> &order, std::vector<int> &top)
+{
+    order.resize(scores.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    std::partial_sort(order.begin(), order.begin() + count, order.end(),
+                      HigherScore<T>(scores));
+
+    top.assign(order.begin(), order.begin() + count);
+}
+
+/**
+ * The two smallest distances seen so far, ties going to the lowest
+ * image index.
+ */
+struct Ranking
+{
+    Ranking() :
+        bestDistance(FLT_MAX), secondDistance(FLT_MAX),
+        bestIndex(-1), secondIndex(-1) {}
+
+    static bool Before(float d1, int i1, float d2, int i2)
+    {
+        return i2 < 0 || d1 < d2 || (d1 == d2 && i1 < i2);
+    }
+
+    void Add(float distance, int index)
+    {
+        if (Before(distance, index, bestDistance, bestIndex))
+        {
+            secondDistance = bestDistance;
+            secondIndex = bestIndex;
+            bestDistance = distance;
+            bestIndex = index;
+        }
+        else if (Before(distance, index, secondDistance, secondIndex))
+        {
+            secondDistance = distance;
+            secondIndex = index;
+        }
+    }
+
+    void Merge(const Ranking &other)
+    {
+        if (other.bestIndex >= 0)
+            Add(other.bestDistance, other.bestIndex);
+        if (other.secondIndex >= 0)
+            Add(other.secondDistance, other.secondIndex);
+    }
+
+    float bestDistance;
+    float secondDistance;
+    int bestIndex;
+    int secondIndex;
+};
+
+} // namespace
+
+/**
+ * Everything a query needs besides the dataset, kept from one query to
+ * the next on the same thread. The buffers are refilled with assign(),
+ * resize() and clear(), which keep their capacity, so once they have
+ * grown to fit the queries they stop allocating.
+ */
+struct ImageMatcher::QueryContext
+{
+    QueryFeatures query;
+
+    // Candidate selection
+    std::vector<int> candidates;
+    std::vector<int> words;
+    std::vector<float> scores;
+    std::vector<int> votes;
+    std::vector<int> pending;
+    std::vector<int> order;
+    SearchBuffers search;
+    std::vector<float> similarities;
+    std::vector<int> nearest;
+    std::vector<bool> excluded;
+
+    // Verification, see MatchTask
+    std::vector<Ranking> rankings;
+    std::vector<unsigned int> verifiedCounts;
+    std::vector<Mat> homographies;
+    std::vector<int> inliers;
+    std::vector<bool> verified;
+};
+
+ImageMatcher::QueryContext &
+ImageMatcher::GetQueryContext()
+{
+    QueryContext *context = mQueryContexts.get();
+    if (!context)
+    {
+        context = new QueryContext;
+        mQueryContexts.reset(context);
+    }
+
+    return *context;
+}
+
+bool
+ImageMatcher::UsePrefilter(const QueryFeatures &query) const
+{
+    const size_t liveCount = mArena.GetImageCount() - mRemovedCount;
+    return mPrefilterCount > 0 && mPrefilterCount < liveCount &&
+           !query.signature.empty() &&
+           mSignatures.GetCount() == mArena.GetImageCount();
+}
+
+void
+ImageMatcher::RankSignatures(const Mat &signature, size_t count,
+                             std::vector<float> &similarities,
+                             std::vector<int> &order,
+                             std::vector<int> &nearest) const
+{
+    mSignatures.Score(signature, similarities);
+
+    // Removed images sort last and never make the list
+    for (size_t i = 0; i < similarities.size(); ++i)
+    {
+        if (mRemoved[i])
+            similarities[i] = -FLT_MAX;
+    }
+
+    TopScores(similarities, count, order, nearest);
+}
+
+void
+ImageMatcher::SelectCandidates(const QueryFeatures &query,
+                               QueryContext &context) const
+{
+    const Mat &queryDescriptors = query.descriptors;
+    std::vector<int> &candidates = context.candidates;
+    const int count = static_cast<int>(mArena.GetImageCount());
+    const size_t liveCount = count - mRemovedCount;
+
+    // The prefilter keeps the images that look like the query, the
+    // selection below only ranks those
+    const bool prefilter = UsePrefilter(query);
+    std::vector<int> &nearest = context.nearest;
+    nearest.clear();
+    if (prefilter)
+        RankSignatures(query.signature, mPrefilterCount, context.similarities,
+                       context.order, nearest);
+    const size_t eligibleCount = prefilter ? nearest.size() : liveCount;
+
+    const bool shortList = mCandidateCount > 0 &&
+                           mCandidateCount < eligibleCount;
+    const size_t listSize = shortList ? mCandidateCount : eligibleCount;
+
+    candidates.clear();
+
+    // Early exit needs the most promising candidates first, even when
+    // all of them are verified
+    if ((mGlobalIndex.Empty() && mInvertedFile.Empty()) ||
+            (!shortList && mEarlyExitInliers == 0) ||
+            queryDescriptors.empty())
+    {
+        if (prefilter)
+        {
+            // Already the most similar first
+            candidates.assign(nearest.begin(), nearest.end());
+            return;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (!mRemoved[i])
+                candidates.push_back(i);
+        }
+        return;
+    }
+
+    // Images left out by the prefilter are treated as removed
+    std::vector<bool> &excluded = context.excluded;
+    excluded.assign(count, prefilter);
+    for (size_t n = 0; n < nearest.size(); ++n)
+        excluded[nearest[n]] = false;
+
+    if (!mInvertedFile.Empty())
+    {
+        // Short list by tf-idf similarity of the visual words
+        std::vector<int> &words = context.words;
+        std::vector<float> &scores = context.scores;
+        mVocabulary->Quantize(queryDescriptors, words);
+        mInvertedFile.Score(words, scores);
+
+        // Removed and prefiltered images sort last and never make the list
+        for (int i = 0; i < count; ++i)
+        {
+            if (mRemoved[i] || excluded[i])
+                scores[i] = -1;
+        }
+
+        TopScores(scores, listSize, context.order, candidates);
+        return;
+    }
+
+    // Every query descriptor votes for the image of its nearest neighbour
+    Mat indices, dists;
+    mGlobalIndex.KnnSearch(queryDescriptors, 1, context.search, indices, dists);
+
+    std::vector<int> &votes = context.votes;
+    votes.assign(count, 0);
+    for (int i = 0; i < indices.rows; ++i)
+    {
+        int idx = indices.at<int>(i, 0);
+        if (idx >= 0 && mGlobalImageIds[idx] >= 0)
+            votes[mGlobalImageIds[idx]]++;
+    }
+
+    // Images added after the voting index was built have no votes, they
+    // are all verified until the next rebuild
+    std::vector<int> &pending = context.pending;
+    pending.clear();
+    for (int i = 0; i < count; ++i)
+    {
+        if (mRemoved[i] || excluded[i])
+            votes[i] = -1;
+        else if (static_cast<size_t>(i) >= mGlobalImageCount)
+        {
+            votes[i] = -1;
+            pending.push_back(i);
+        }
+    }
+
+    TopScores(votes, std::min(listSize, eligibleCount - pending.size()),
+              context.order, candidates);
+    candidates.insert(candidates.end(), pending.begin(), pending.end());
+}
+
+void
+ImageMatcher::CompactDescriptors()
+{
+    mQuantizer.Clear();
+
+    if (mStorage == STORAGE_FLOAT || mExtractor.IsBinary())
+        return;
+
+    if (mArena.GetRowCount() == 0)
+        return;
+
+    // The whole arena is encoded at once, the float block is dropped
+    Mat codes;
+    mQuantizer.Fit(std::vector<Mat>(1, mArena.GetDescriptors()), mStorage);
+    mQuantizer.Encode(mArena.GetDescriptors(), codes);
+    mArena.SetDescriptors(codes);
+}
+
+void
+ImageMatcher::GetFloatDescriptors(size_t index, Mat &descriptors) const
+{
+    Mat stored = mArena.GetDescriptors(index);
+
+    if (mQuantizer.Empty() || stored.empty())
+        descriptors = stored;
+    else
+        mQuantizer.Decode(stored, descriptors);
+}
+
+void
+ImageMatcher::ComputeDescriptors(const Mat &image, Mat &desc,
+                                 const KeypointBudget &budget)
+{
+    std::vector<KeyPoint> keypoints;
+
+    mExtractor.Compute(image, keypoints, desc, budget);
+}
+
+void
+ImageMatcher::ComputeDescriptors(const Mat &image, Mat &desc,
+                                 std::vector<KeyPoint> &keypoints,
+                                 const KeypointBudget &budget,
+                                 size_t *detected)
+{
+    STATS_TIMER(timer, STAGE_EXTRACT);
+    mExtractor.Compute(image, keypoints, desc, budget, detected);
+    STATS_ADD(COUNTER_KEYPOINTS, keypoints.size());
+}
+
+void
+ImageMatcher::ComputeTrainingStats(const std::vector<size_t> &detected)
+{
+    TrainingStats stats;
+    stats.fileNames = mFileNames;
+    stats.detected = detected;
+    stats.kept.resize(detected.size());
+
+    for (size_t i = 0; i < mArena.GetImageCount(); ++i)
+    {
+        stats.kept[i] = mArena.GetCount(i);
+        stats.totalDetected += detected[i];
+        stats.totalKept += stats.kept[i];
+    }
+
+    // Dropped keypoints are costed at the size they would be stored at:
+    // a descriptor row and a position
+    const Mat &all = mArena.GetDescriptors();
+    const size_t rowBytes = all.cols * all.elemSize() + 2 * sizeof(float);
+    stats.descriptorBytes = stats.totalKept * all.cols * all.elemSize();
+    stats.bytesSaved = (stats.totalDetected - stats.totalKept) * rowBytes;
+    mTrainingStats = stats;
+}
+
+/**
+ * Decode and describe one training image into its own slot.
+ */
+class ImageMatcher::TrainTask : public ParallelTask
+{
+public:
+
+    TrainTask(ImageMatcher &matcher,
+              std::vector<Mat> &descriptors,
+              std::vector<std::vector<KeyPoint> > &keypoints,
+              std::vector<Mat> &signatures,
+              std::vector<size_t> &detected) :
+        mMatcher(matcher),
+        mDescriptors(descriptors),
+        mKeypoints(keypoints),
+        mSignatures(signatures),
+        mDetected(detected) {}
+
+    void operator() (size_t index, unsigned int /*worker*/)
+    {
+        try
+        {
+            Mat image = mMatcher.mImageReader.LoadImage(index);
+            SignatureIndex::Compute(image, mSignatures[index]);
+            mMatcher.ComputeDescriptors(image, mDescriptors[index],
+                                        mKeypoints[index],
+                                        mMatcher.mTrainBudget,
+                                        &mDetected[index]);
+        }
+        catch (const ImageReaderIOException &ex)
+        {
+            std::cerr << ex.what() << ": "
+                      << mMatcher.mFileNames[index] << std::endl;
+        }
+    }
+
+private:
+
+    ImageMatcher &mMatcher;
+    std::vector<Mat> &mDescriptors;
+    std::vector<std::vector<KeyPoint> > &mKeypoints;
+    std::vector<Mat> &mSignatures;
+    std::vector<size_t> &mDetected;
+};
+
+void
+ImageMatcher::Train (const std::string &imageDirectory)
+{
+    Train(ImageReader(imageDirectory));
+}
+
+void
+ImageMatcher::Train (const ImageReader &images)
+{
+    WriteLock lock(mDatasetMutex);
+    if (mVocabulary)
+        CheckVocabulary(*mVocabulary, mExtractor);
+
+    // The set brings its images, the matcher its decode policy
+    const DecodePolicy policy = mImageReader.GetDecodePolicy();
+    mImageReader = images;
+    mImageReader.SetDecodePolicy(policy);
+    if (mShardCount > 1)
+        mImageReader.KeepShard(mShard, mShardCount);
+    mFileNames = mImageReader.GetFileNames();
+
+    std::vector<Mat> descriptors(mFileNames.size());
+    std::vector<std::vector<KeyPoint> > keypoints(mFileNames.size());
+    std::vector<Mat> signatures(mFileNames.size());
+    std::vector<size_t> detected(mFileNames.size(), 0);
+
+    TrainTask task(*this, descriptors, keypoints, signatures, detected);
+    mThreadPool->ParallelFor(mFileNames.size(), task);
+
+    // The per-image results are gathered into the arena in one allocation
+    mArena.Assign(descriptors, keypoints);
+    mSignatures.Assign(signatures);
+    descriptors.clear();
+    keypoints.clear();
+    mRemoved.assign(mFileNames.size(), false);
+    mRemovedCount = 0;
+    mRemovedRows = 0;
+    mIndexRegion.reset();
+    CompactDescriptors();
+    ComputeTrainingStats(detected);
+
+    mTrainIndices.clear();
+    mGlobalIndex.Clear();
+    mInvertedFile.Clear();
+    BuildSearchIndex();
+    mResultCache.Clear();
+}
+
+void
+ImageMatcher::AddImage(const std::string &fileName)
+{
+    Mat image = ImageReader::LoadImage(fileName, GetDecodePolicy());
+    AddImage(boost::filesystem::path(fileName).filename().string(), image);
+}
+
+void
+ImageMatcher::AddImage(const std::string &name, const Mat &image)
+{
+    Mat descriptors, signature;
+    std::vector<KeyPoint> keypoints;
+    DescribeImage(image, descriptors, keypoints, signature);
+
+    WriteLock lock(mDatasetMutex);
+    if (FindImage(name) >= 0)
+        throw ImageMatcherIOException(name + " is already in the dataset");
+
+    InsertImage(name, descriptors, keypoints, signature);
+}
+
+bool
+ImageMatcher::RemoveImage(const std::string &name)
+{
+    WriteLock lock(mDatasetMutex);
+    int i = FindImage(name);
+    if (i < 0)
+        return false;
+
+    EraseImage(i);
+    return true;
+}
+
+void
+ImageMatcher::UpdateImage(const std::string &fileName)
+{
+    Mat image = ImageReader::LoadImage(fileName, GetDecodePolicy());
+    UpdateImage(boost::filesystem::path(fileName).filename().string(), image);
+}
+
+void
+ImageMatcher::UpdateImage(const std::string &name, const Mat &image)
+{
+    Mat descriptors, signature;
+    std::vector<KeyPoint> keypoints;
+    DescribeImage(image, descriptors, keypoints, signature);
+
+    WriteLock lock(mDatasetMutex);
+    int i = FindImage(name);
+    if (i >= 0)
+        EraseImage(i);
+
+    InsertImage(name, descriptors, keypoints, signature);
+}
+
+void
+ImageMatcher::DescribeImage(const Mat &image, Mat &descriptors,
+                            std::vector<KeyPoint> &keypoints,
+                            Mat &signature)
+{
+    // Extraction only reads the settings, queries keep running
+    ReadLock lock(mDatasetMutex);
+    ComputeDescriptors(image, descriptors, keypoints, mTrainBudget);
+    SignatureIndex::Compute(image, signature);
+
+    if (!mQuantizer.Empty() && !descriptors.empty())
+    {
+        Mat codes;
+        mQuantizer.Encode(descriptors, codes);
+        descriptors = codes;
+    }
+}
+
+int
+ImageMatcher::FindImage(const std::string &name) const
+{
+    for (size_t i = 0; i < mFileNames.size(); ++i)
+    {
+        if (!mRemoved[i] && mFileNames[i] == name)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+void
+ImageMatcher::EraseImage(size_t index)
+{
+    // The slot stays as a tombstone, so that the indices of the other
+    // images (and the search indices built over them) remain valid
+    mRemoved[index] = true;
+    mRemovedCount++;
+    mRemovedRows += mArena.GetCount(index);
+    mTrainIndices[index].Clear();
+    mResultCache.Clear();
+
+    // Once removed images hold half of the arena, it is compacted; the
+    // indices built over the old block are built again
+    if (mRemovedRows > 0 &&
+            mRemovedRows * 2 >= static_cast<size_t>(mArena.GetRowCount()))
+    {
+        mArena.Compact(mRemoved);
+        mRemovedRows = 0;
+        RebuildSearchIndex();
+        mIndexRegion.reset();
+    }
+}
+
+void
+ImageMatcher::RebuildSearchIndex()
+{
+    mTrainIndices.clear();
+    mGlobalIndex.Clear();
+    mGlobalImageIds.clear();
+    BuildSearchIndex();
+}
+
+void
+ImageMatcher::InsertImage(const std::string &name, const Mat &descriptors,
+                          const std::vector<KeyPoint> &keypoints,
+                          const Mat &signature)
+{
+    const uchar *block = mArena.GetDescriptors().data;
+    const size_t index = mArena.Add(descriptors, keypoints);
+
+    // A dataset loaded without signatures gets none for its new images
+    if (mSignatures.GetCount() == index)
+        mSignatures.Add(signature);
+
+    mFileNames.push_back(name);
+    mRemoved.push_back(false);
+    mResultCache.Clear();
+
+    // Growing the arena may move it; the indices built over the old
+    // block would keep it alive, so they are built again. The arena grows
+    // geometrically, which amortizes the cost over the additions.
+    if (block && mArena.GetDescriptors().data != block)
+    {
+        RebuildSearchIndex();
+        mIndexRegion.reset();
+    }
+    else
+    {
+        mTrainIndices.push_back(DescriptorIndex());
+        if (mQuantizer.Empty() && !descriptors.empty())
+            mTrainIndices.back().Build(mArena.GetDescriptors(index));
+    }
+
+    if (!mInvertedFile.Empty())
+    {
+        Mat values;
+        std::vector<int> words;
+        GetFloatDescriptors(index, values);
+        mVocabulary->Quantize(values, words);
+        mInvertedFile.Add(words);
+    }
+
+    // Pending images are verified on every query; once there are as many
+    // of them as regular candidates, the voting index is rebuilt
+    if (!mGlobalIndex.Empty() &&
+            mFileNames.size() - mGlobalImageCount >
+            std::max<size_t>(mCandidateCount, MIN_PENDING_IMAGES))
+    {
+        mGlobalIndex.Clear();
+        BuildSearchIndex();
+    }
+}
+
+/*
+ * Index file layout (all integers are little-endian, as written by the host):
+ *
+ *   IndexHeader
+ *   IndexSection[sectionCount]      table of contents
+ *   section payloads                each one starts on a 16-byte boundary
+ *
+ * Sections are looked up by tag, so readers skip the ones they do not know.
+ *   NAME: uint32 count, then count x (uint32 length, chars)
+ *   SPAN: uint32 count, then count x (uint32 first row, uint32 rows)
+ *   PTXY: uint32 rows, uint32 reserved, rows x float x, rows x float y
+ *   DBLK: IndexMatEntry, then the descriptor rows of all the images
+ *   PARM: int32 minHessian, int32 FeatureType (SURF if missing)
+ *   QSCL: int32 DescriptorStorage, uint32 cols, cols x float scale
+ *         (only for compact descriptors)
+ *   GSIG: uint32 count, uint32 cols, count x cols float, the global
+ *         signatures of SignatureIndex (missing in older files)
+ *
+ * SPAN, PTXY and DBLK are the TrainingArena arrays. Older files have
+ * per-image sections instead, which are still read:
+ *   DESC: uint32 count, then count x IndexMatEntry, then the matrix data
+ *   KEYP: uint32 count, then count x (uint32 n, n x IndexKeyPoint)
+ */
+namespace
+{
+
+const char INDEX_MAGIC[8] = { 'P', 'M', 'I', 'N', 'D', 'E', 'X', '\0' };
+const uint32_t INDEX_VERSION = 1;
+const size_t INDEX_ALIGNMENT = 16;
+
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+};
+
+struct IndexSection
+{
+    char tag[4];
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct IndexMatEntry
+{
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+    int32_t reserved;
+    uint64_t offset;
+};
+
+struct IndexKeyPoint
+{
+    float x, y, size, angle, response;
+    int32_t octave;
+    int32_t classId;
+};
+
+class IndexWriter
+{
+public:
+
+    IndexWriter(const std::string &fileName, uint32_t sectionCount) :
+        mStream(fileName.c_str(), std::ios::binary | std::ios::trunc),
+        mFileName(fileName),
+        mSections(sectionCount)
+    {
+        if (!mStream)
+            throw ImageMatcherIOException("Cannot write index: " + fileName);
+
+        // Reserve room for the header and the table of contents
+        IndexHeader header;
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.version = INDEX_VERSION;
+        header.sectionCount = sectionCount;
+        Write(&header, sizeof(header));
+        Write(&mSections[0], sizeof(IndexSection) * mSections.size());
+        mCurrent = 0;
+    }
+
+    void BeginSection(const char tag[4])
+    {
+        Align();
+        IndexSection &section = mSections.at(mCurrent);
+        memcpy(section.tag, tag, sizeof(section.tag));
+        section.reserved = 0;
+        section.offset = Tell();
+    }
+
+    void EndSection()
+    {
+        IndexSection &section = mSections.at(mCurrent++);
+        section.size = Tell() - section.offset;
+    }
+
+    void Write(const void *data, size_t size)
+    {
+        mStream.write(static_cast<const char *>(data), size);
+    }
+
+    template <typename T>
+    void WriteValue(const T &value)
+    {
+        Write(&value, sizeof(T));
+    }
+
+    void Align()
+    {
+        static const char zeros[INDEX_ALIGNMENT] = { 0 };
+        size_t pad = (INDEX_ALIGNMENT - Tell() % INDEX_ALIGNMENT) % INDEX_ALIGNMENT;
+        Write(zeros, pad);
+    }
+
+    uint64_t Tell()
+    {
+        return static_cast<uint64_t>(mStream.tellp());
+    }
+
+    void Close()
+    {
+        mStream.seekp(sizeof(IndexHeader));
+        Write(&mSections[0], sizeof(IndexSection) * mSections.size());
+        mStream.close();
+
+        if (!mStream)
+            throw ImageMatcherIOException("Cannot write index: " + mFileName);
+    }
+
+private:
+
+    std::ofstream mStream;
+    std::string mFileName;
+    std::vector<IndexSection> mSections;
+    size_t mCurrent;
+};
+
+class IndexReader
+{
+public:
+
+    IndexReader(const char *data, size_t size) :
+        mData(data), mSize(size)
+    {
+        if (size < sizeof(IndexHeader))
+            throw ImageMatcherIOException("Index file is truncated");
+
+        const IndexHeader *header =
+            reinterpret_cast<const IndexHeader *>(data);
+        if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0)
+            throw ImageMatcherIOException("Not an index file");
+        if (header->version != INDEX_VERSION)
+            throw ImageMatcherIOException("Unsupported index version");
+
+        mSections = reinterpret_cast<const IndexSection *>(header + 1);
+        mSectionCount = header->sectionCount;
+        Check(sizeof(IndexHeader), sizeof(IndexSection) * mSectionCount);
+    }
+
+    /**
+     * Return a pointer to the payload of the section, or NULL if missing.
+     */
+    const char *FindSection(const char tag[4], uint64_t &size) const
+    {
+        for (uint32_t i = 0; i < mSectionCount; ++i)
+        {
+            if (memcmp(mSections[i].tag, tag, 4) == 0)
+            {
+                Check(mSections[i].offset, mSections[i].size);
+                size = mSections[i].size;
+                return mData + mSections[i].offset;
+            }
+        }
+        return NULL;
+    }
+
+    const char *GetSection(const char tag[4], uint64_t &size) const
+    {
+        const char *section = FindSection(tag, size);
+        if (!section)
+            throw ImageMatcherIOException(
+                "Index file lacks section " + std::string(tag, 4));
+        return section;
+    }
+
+    void Check(uint64_t offset, uint64_t size) const
+    {
+        if (offset > mSize || size > mSize - offset)
+            throw ImageMatcherIOException("Index file is truncated");
+    }
+
+    const char *Base() const
+    {
+        return mData;
+    }
+
+private:
+
+    const char *mData;
+    size_t mSize;
+    const IndexSection *mSections;
+    uint32_t mSectionCount;
+};
+
+/**
+ * Sequential cursor over a section payload, with bounds checking.
+ */
+class SectionCursor
+{
+public:
+
+    SectionCursor(const char *data, uint64_t size) :
+        mData(data), mEnd(data + size) {}
+
+    const char *Take(uint64_t size)
+    {
+        if (size > static_cast<uint64_t>(mEnd - mData))
+            throw ImageMatcherIOException("Index section is truncated");
+        const char *p = mData;
+        mData += size;
+        return p;
+    }
+
+    template <typename T>
+    T ReadValue()
+    {
+        T value;
+        memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    uint64_t Remaining() const
+    {
+        return static_cast<uint64_t>(mEnd - mData);
+    }
+
+private:
+
+    const char *mData;
+    const char *mEnd;
+};
+
+/**
+ * Descriptors of another type or length than the ones the index says it
+ * holds would be read as garbage, or past their rows in the mapping.
+ */
+void
+CheckDescriptorFormat(const IndexMatEntry &entry, int type, int cols)
+{
+    if (entry.type != type || entry.cols != cols)
+        throw ImageMatcherIOException("Index file holds descriptors of "
+                                      "another type or size");
 }
 
+/**
+ * Wrap the arena arrays of an index file in place: the matrices point
+ * straight into the read-only mapping.
+ */
 void
-ImageMatcher::ComputeDescriptors(const Mat &image, Mat &desc)
+ReadArena(const IndexReader &reader, uint32_t count, int type, int cols,
+          TrainingArena &arena)
 {
-    std::vector<KeyPoint> keypoints;
+    uint64_t size;
+
+    SectionCursor span(reader.GetSection("SPAN", size), size);
+    if (span.ReadValue<uint32_t>() != count)
+        throw ImageMatcherIOException("Index file is inconsistent");
+    std::vector<int> begin(count), rows(count);
+    std::vector<uint32_t> spans(2 * count);
+    memcpy(&spans[0], span.Take(spans.size() * sizeof(uint32_t)),
+           spans.size() * sizeof(uint32_t));
+
+    SectionCursor ptxy(reader.GetSection("PTXY", size), size);
+    const uint32_t total = ptxy.ReadValue<uint32_t>();
+    ptxy.ReadValue<uint32_t>();
+    if (total > static_cast<uint32_t>(INT_MAX))
+        throw ImageMatcherIOException("Index file is inconsistent");
+    const char *x = ptxy.Take(static_cast<uint64_t>(total) * sizeof(float));
+    const char *y = ptxy.Take(static_cast<uint64_t>(total) * sizeof(float));
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (spans[2 * i] > total || spans[2 * i + 1] > total - spans[2 * i])
+            throw ImageMatcherIOException("Index file is inconsistent");
+        begin[i] = spans[2 * i];
+        rows[i] = spans[2 * i + 1];
+    }
 
-    SurfFeatureDetector detector(mMinHessian);
-    detector.detect(image, keypoints);
+    SectionCursor dblk(reader.GetSection("DBLK", size), size);
+    IndexMatEntry entry = dblk.ReadValue<IndexMatEntry>();
+    if (entry.rows != static_cast<int32_t>(total) || entry.cols < 0)
+        throw ImageMatcherIOException("Index file is inconsistent");
 
-    SurfDescriptorExtractor extractor;
-    extractor.compute(image, keypoints, desc);
+    Mat descriptors, xs, ys;
+    if (total > 0)
+    {
+        CheckDescriptorFormat(entry, type, cols);
+        uint64_t bytes = static_cast<uint64_t>(entry.rows) *
+                         entry.cols * CV_ELEM_SIZE(entry.type);
+        reader.Check(entry.offset, bytes);
+        char *base = const_cast<char *>(reader.Base());
+        descriptors = Mat(entry.rows, entry.cols, entry.type,
+                          base + entry.offset);
+        xs = Mat(total, 1, CV_32F, const_cast<char *>(x));
+        ys = Mat(total, 1, CV_32F, const_cast<char *>(y));
+    }
+
+    arena.Wrap(descriptors, xs, ys, begin, rows);
 }
 
+/**
+ * Read the per-image sections of an older index file into an arena.
+ */
 void
-ImageMatcher::ComputeDescriptors(const Mat &image, Mat &desc,
-                                 std::vector<KeyPoint> &keypoints)
+ReadLegacyArena(const IndexReader &reader, uint32_t count, int type,
+                int cols, TrainingArena &arena)
 {
-    SurfFeatureDetector detector(mMinHessian);
-    detector.detect(image, keypoints);
+    uint64_t size;
+
+    SectionCursor keyp(reader.GetSection("KEYP", size), size);
+    if (keyp.ReadValue<uint32_t>() != count)
+        throw ImageMatcherIOException("Index file is inconsistent");
+    std::vector<std::vector<KeyPoint> > keypoints(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t n = keyp.ReadValue<uint32_t>();
+        keypoints[i].resize(n);
+        for (uint32_t k = 0; k < n; ++k)
+        {
+            IndexKeyPoint kp = keyp.ReadValue<IndexKeyPoint>();
+            keypoints[i][k] = KeyPoint(kp.x, kp.y, kp.size, kp.angle,
+                                       kp.response, kp.octave, kp.classId);
+        }
+    }
+
+    SectionCursor desc(reader.GetSection("DESC", size), size);
+    if (desc.ReadValue<uint32_t>() != count)
+        throw ImageMatcherIOException("Index file is inconsistent");
+    std::vector<Mat> descriptors(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        IndexMatEntry entry = desc.ReadValue<IndexMatEntry>();
+        if (entry.rows < 0 || entry.cols < 0 ||
+                static_cast<size_t>(entry.rows) != keypoints[i].size())
+            throw ImageMatcherIOException("Index file is inconsistent");
+
+        if (entry.rows == 0)
+            continue;
+
+        CheckDescriptorFormat(entry, type, cols);
+        uint64_t bytes = static_cast<uint64_t>(entry.rows) *
+                         entry.cols * CV_ELEM_SIZE(entry.type);
+        reader.Check(entry.offset, bytes);
+        descriptors[i] = Mat(entry.rows, entry.cols, entry.type,
+                             const_cast<char *>(reader.Base() + entry.offset));
+    }
 
-    SurfDescriptorExtractor extractor;
-    extractor.compute(image, keypoints, desc);
+    arena.Assign(descriptors, keypoints);
 }
 
+} // namespace
+
 void
-ImageMatcher::Train (const std::string &imageDirectory)
+ImageMatcher::SaveIndex(const std::string &indexFile) const
 {
-    bool done = false;
+    ReadLock lock(mDatasetMutex);
 
-    mImageReader(imageDirectory);
-    mFileNames = mImageReader.GetFileNames();
+    if (mArena.GetImageCount() != mFileNames.size())
+        throw ImageMatcherIOException("The classifier is not trained");
+
+    // Removed images are left out, which compacts the dataset
+    std::vector<size_t> live;
+    for (size_t i = 0; i < mFileNames.size(); ++i)
+    {
+        if (!mRemoved[i])
+            live.push_back(i);
+    }
 
-    mMatcher.clear();
+    const uint32_t count = static_cast<uint32_t>(live.size());
+    const bool signatures = mSignatures.GetCount() > 0 &&
+                            mSignatures.GetCount() == mFileNames.size();
+    IndexWriter writer(indexFile, (mQuantizer.Empty() ? 5 : 6) +
+                                  (signatures ? 1 : 0));
 
-    while (!done)
+    writer.BeginSection("PARM");
+    writer.WriteValue<int32_t>(mExtractor.GetMinHessian());
+    writer.WriteValue<int32_t>(mExtractor.GetType());
+    writer.EndSection();
+
+    if (!mQuantizer.Empty())
     {
-        try
-        {
-            Mat image = mImageReader.LoadNextImage();
+        const Mat &scales = mQuantizer.GetScales();
+        writer.BeginSection("QSCL");
+        writer.WriteValue<int32_t>(mQuantizer.GetStorage());
+        writer.WriteValue<uint32_t>(scales.cols);
+        writer.Write(scales.ptr(0), scales.cols * sizeof(float));
+        writer.EndSection();
+    }
 
-            Mat descriptors;
-            std::vector<KeyPoint> keypoints;
+    if (signatures)
+    {
+        const Mat &all = mSignatures.GetSignatures();
+        writer.BeginSection("GSIG");
+        writer.WriteValue(count);
+        writer.WriteValue<uint32_t>(all.cols);
+        for (uint32_t i = 0; i < count; ++i)
+            writer.Write(all.ptr(live[i]), all.cols * sizeof(float));
+        writer.EndSection();
+    }
 
-            ComputeDescriptors(image, descriptors, keypoints);
+    writer.BeginSection("NAME");
+    writer.WriteValue(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const std::string &name = mFileNames[live[i]];
+        writer.WriteValue<uint32_t>(name.size());
+        writer.Write(name.data(), name.size());
+    }
+    writer.EndSection();
 
-            mTrainDescriptors.push_back(descriptors);
-            mTrainKeypoints.push_back(keypoints);
-        }
-        catch (const ImageReaderIOException &ex)
+    writer.BeginSection("SPAN");
+    writer.WriteValue(count);
+    uint32_t rows = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        writer.WriteValue(rows);
+        writer.WriteValue<uint32_t>(mArena.GetCount(live[i]));
+        rows += mArena.GetCount(live[i]);
+    }
+    writer.EndSection();
+
+    // Every array is written image after image, skipping the removed ones
+    writer.BeginSection("PTXY");
+    writer.WriteValue(rows);
+    writer.WriteValue<uint32_t>(0);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        KeypointSpan points = mArena.GetKeypoints(live[i]);
+        writer.Write(points.x, points.count * sizeof(float));
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        KeypointSpan points = mArena.GetKeypoints(live[i]);
+        writer.Write(points.y, points.count * sizeof(float));
+    }
+    writer.EndSection();
+
+    const Mat &all = mArena.GetDescriptors();
+    const size_t rowBytes = all.cols * all.elemSize();
+    writer.BeginSection("DBLK");
+
+    IndexMatEntry entry;
+    uint64_t offset = writer.Tell() + sizeof(IndexMatEntry);
+    entry.rows = rows;
+    entry.cols = all.cols;
+    entry.type = all.type();
+    entry.reserved = 0;
+    entry.offset = offset + (INDEX_ALIGNMENT - offset % INDEX_ALIGNMENT) %
+                   INDEX_ALIGNMENT;
+    writer.WriteValue(entry);
+
+    writer.Align();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        int n = mArena.GetCount(live[i]);
+        if (n > 0)
+            writer.Write(all.ptr(mArena.GetBegin(live[i])), n * rowBytes);
+    }
+    writer.EndSection();
+
+    writer.Close();
+}
+
+void
+ImageMatcher::LoadIndex(const std::string &indexFile)
+{
+    WriteLock lock(mDatasetMutex);
+
+    namespace ipc = boost::interprocess;
+    boost::shared_ptr<ipc::mapped_region> region;
+
+    try
+    {
+        ipc::file_mapping mapping(indexFile.c_str(), ipc::read_only);
+        region.reset(new ipc::mapped_region(mapping, ipc::read_only));
+    }
+    catch (const ipc::interprocess_exception &ex)
+    {
+        throw ImageMatcherIOException("Cannot map index " + indexFile +
+                                      ": " + ex.what());
+    }
+
+    IndexReader reader(static_cast<const char *>(region->get_address()),
+                       region->get_size());
+    uint64_t size;
+
+    SectionCursor parm(reader.GetSection("PARM", size), size);
+    int minHessian = parm.ReadValue<int32_t>();
+    int featureType = FEATURE_SURF;
+    if (parm.Remaining() >= sizeof(int32_t))
+        featureType = parm.ReadValue<int32_t>();
+    if (featureType < FEATURE_SURF || featureType > FEATURE_FREAK)
+        throw ImageMatcherIOException("Index file uses unknown features");
+
+    DescriptorQuantizer quantizer;
+    const char *qscl = reader.FindSection("QSCL", size);
+    if (qscl)
+    {
+        SectionCursor cursor(qscl, size);
+        int storage = cursor.ReadValue<int32_t>();
+        uint32_t cols = cursor.ReadValue<uint32_t>();
+        if (storage != STORAGE_INT8 && storage != STORAGE_FLOAT16)
+            throw ImageMatcherIOException("Index file uses unknown storage");
+
+        Mat scales(1, cols, CV_32F);
+        memcpy(scales.ptr(0), cursor.Take(cols * sizeof(float)),
+               cols * sizeof(float));
+        quantizer.SetScales(static_cast<DescriptorStorage>(storage), scales);
+    }
+
+    SectionCursor names(reader.GetSection("NAME", size), size);
+    const uint32_t count = names.ReadValue<uint32_t>();
+    std::vector<std::string> fileNames(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t length = names.ReadValue<uint32_t>();
+        fileNames[i].assign(names.Take(length), length);
+    }
+
+    // Signatures of another size were computed differently, the
+    // prefilter goes without them
+    SignatureIndex signatures;
+    const char *gsig = reader.FindSection("GSIG", size);
+    if (gsig)
+    {
+        SectionCursor cursor(gsig, size);
+        if (cursor.ReadValue<uint32_t>() != count)
+            throw ImageMatcherIOException("Index file is inconsistent");
+        const uint32_t cols = cursor.ReadValue<uint32_t>();
+        if (count > 0 && cols == static_cast<uint32_t>(
+                    SignatureIndex::SIGNATURE_SIZE))
         {
-            done = true;
+            const char *values = cursor.Take(
+                    static_cast<uint64_t>(count) * cols * sizeof(float));
+            signatures.Assign(Mat(count, cols, CV_32F,
+                                  const_cast<char *>(values)));
         }
     }
+
+    // The descriptors must be the ones of the features in PARM, stored
+    // as QSCL says
+    FeatureExtractor extractor(static_cast<FeatureType>(featureType),
+                               minHessian);
+    const int cols = extractor.GetDescriptorSize();
+    int type = extractor.IsBinary() ? CV_8U : CV_32F;
+    if (!quantizer.Empty())
+    {
+        if (extractor.IsBinary() || quantizer.GetScales().cols != cols)
+            throw ImageMatcherIOException("Index file is inconsistent");
+        type = quantizer.GetStorage() == STORAGE_INT8 ? CV_8S : CV_16U;
+    }
+    if (mVocabulary)
+        CheckVocabulary(*mVocabulary, extractor);
+
+    // Older files are copied into a new arena, current ones are used in
+    // place and keep the mapping
+    TrainingArena arena;
+    const bool mapped = reader.FindSection("SPAN", size) != NULL;
+    if (mapped)
+        ReadArena(reader, count, type, cols, arena);
+    else
+        ReadLegacyArena(reader, count, type, cols, arena);
+
+    mFileNames.swap(fileNames);
+    mArena = arena;
+    mSignatures = signatures;
+    mRemoved.assign(count, false);
+    mRemovedCount = 0;
+    mRemovedRows = 0;
+    if (mapped)
+        mIndexRegion = region;
+    else
+        mIndexRegion.reset();
+    mExtractor = extractor;
+    mQuantizer = quantizer;
+    mTrainingStats = TrainingStats();
+
+    // A float index is quantized on load if compact storage is wanted;
+    // the codes are copies, the mapping is not needed any more
+    if (mQuantizer.Empty() && mStorage != STORAGE_FLOAT &&
+            !mExtractor.IsBinary())
+    {
+        CompactDescriptors();
+        mArena.Detach();
+        mIndexRegion.reset();
+    }
+
+    mTrainIndices.clear();
+    mGlobalIndex.Clear();
+    mInvertedFile.Clear();
+    BuildSearchIndex();
+    mResultCache.Clear();
 }
 
 bool CompFunc (float val, DMatch d)
@@ -94,41 +1583,89 @@ float sumFunc (float val, DMatch d)
 
 float
 ImageMatcher::HomographyMatching(const Mat &objDescriptors,
-                                 const Mat &sceneDescriptors,
+                                 const DescriptorIndex &objIndex,
+                                 const DescriptorIndex &sceneIndex,
                                  const std::vector<KeyPoint> &objKeypoints,
-                                 const std::vector<KeyPoint> &sceneKeypoints,
-                                 Mat &homography)
+                                 const KeypointSpan &scenePoints,
+                                 MatchScratch &scratch,
+                                 Mat &homography,
+                                 int &inliers)
 {
-    typedef std::vector<cv::DMatch>::iterator DMatchIt;
-    std::vector<DMatch> filteredMatches, matches12, matches21;
-    std::vector<Point2f> obj;
-    std::vector<Point2f> scene;
+    inliers = 0;
+
+    // Images that could not be read during training never match
+    if (objDescriptors.empty() || sceneIndex.Empty())
+        return 100;
+
+    // Each side is searched in the index prebuilt over the other one
+    mFilter.Match(objDescriptors, objIndex, sceneIndex, scratch.buffers,
+                  scratch.filteredMatches);
+
+    return VerifyMatches(objKeypoints, scenePoints, scratch, homography,
+                         inliers);
+}
+
+float
+ImageMatcher::HomographyMatching(const Mat &objDescriptors,
+                                 const Mat &sceneCodes,
+                                 const std::vector<KeyPoint> &objKeypoints,
+                                 const KeypointSpan &scenePoints,
+                                 MatchScratch &scratch,
+                                 Mat &homography,
+                                 int &inliers)
+{
+    inliers = 0;
+
+    if (objDescriptors.empty() || sceneCodes.empty())
+        return 100;
+
+    mFilter.Match(mQuantizer, objDescriptors, sceneCodes, scratch.buffers,
+                  scratch.filteredMatches);
 
-    mMatcher.match(objDescriptors, sceneDescriptors, matches12);
-    mMatcher.match(sceneDescriptors, objDescriptors, matches21);
+    return VerifyMatches(objKeypoints, scenePoints, scratch, homography,
+                         inliers);
+}
+
+float
+ImageMatcher::VerifyMatches(const std::vector<KeyPoint> &objKeypoints,
+                            const KeypointSpan &scenePoints,
+                            MatchScratch &scratch,
+                            Mat &homography,
+                            int &inliers)
+{
+    const std::vector<DMatch> &filteredMatches = scratch.filteredMatches;
+    std::vector<Point2f> &obj = scratch.obj;
+    std::vector<Point2f> &scene = scratch.scene;
 
-    // Cross-validation
-    for (size_t i = 0; i < matches12.size(); i++)
+    obj.clear();
+    scene.clear();
+
+    // The matches kept by the filter
+    for (size_t i = 0; i < filteredMatches.size(); i++)
     {
-        DMatch forward = matches12[i];
-        DMatch backward = matches21[forward.trainIdx];
-        if (backward.trainIdx == forward.queryIdx)
-        {
-            filteredMatches.push_back(forward);
-            obj.push_back (objKeypoints[forward.queryIdx].pt);
-            scene.push_back (sceneKeypoints[forward.trainIdx].pt);
-        }
+        const DMatch &match = filteredMatches[i];
+        obj.push_back (objKeypoints[match.queryIdx].pt);
+        scene.push_back (Point2f(scenePoints.x[match.trainIdx],
+                                 scenePoints.y[match.trainIdx]));
     }
 
     float meanDistance = 100;
+    inliers = 0;
 
     if (obj.size() >= 4)
     {
-        Mat mask;
+        // A view of the size findHomography() asks for, over a mask
+        // that only grows, so it is not reallocated for every candidate
+        const int count = static_cast<int>(obj.size());
+        if (scratch.mask.rows < count)
+            scratch.mask.create(count, 1, CV_8U);
+        Mat mask = scratch.mask.rowRange(0, count);
         meanDistance = 0;
 
         // Compute homography and retrieve inliers
+        STATS_TIMER(ransacTimer, STAGE_RANSAC);
         homography = findHomography (obj, scene, CV_RANSAC, 3, mask);
+        STATS_STOP(ransacTimer);
 
         // Compute mean distance for inliers only
         int *maskPtr = mask.ptr<int>(0);
@@ -140,12 +1677,161 @@ ImageMatcher::HomographyMatching(const Mat &objDescriptors,
             maskPtr++;
         }
 
-        meanDistance /= countNonZero(mask);
+        inliers = countNonZero(mask);
+        meanDistance /= inliers;
+        STATS_ADD(COUNTER_INLIERS, inliers);
     }
 
     return meanDistance;
 }
 
+/**
+ * Verify one candidate, keeping a partial ranking per worker.
+ *
+ * With early exit, the workers also share the ranking so far and the
+ * candidates that are still pending are skipped once the leader is good
+ * enough. The per-worker and per-candidate state lives in the query
+ * context of the calling thread.
+ */
+class ImageMatcher::MatchTask : public ParallelTask
+{
+public:
+
+    MatchTask(ImageMatcher &matcher,
+              const QueryFeatures &query,
+              const std::vector<int> &candidates,
+              QueryContext &context) :
+        mMatcher(matcher),
+        mQuery(query),
+        mCandidates(candidates),
+        mRankings(context.rankings),
+        mVerified(context.verifiedCounts),
+        mHomographies(context.homographies),
+        mInliers(context.inliers),
+        mLeaderInliers(0),
+        mStopped(false)
+    {
+        const unsigned int workers = matcher.mThreadPool->GetNumThreads();
+        mRankings.assign(workers, Ranking());
+        mVerified.assign(workers, 0);
+        mInliers.assign(candidates.size(), -1);
+
+        // The homographies of the previous query must not show through
+        mHomographies.resize(candidates.size());
+        for (size_t c = 0; c < mHomographies.size(); ++c)
+            mHomographies[c].release();
+    }
+
+    void operator() (size_t c, unsigned int worker)
+    {
+        const bool earlyExit = mMatcher.mEarlyExitInliers > 0;
+        if (earlyExit && Stopped())
+            return;
+
+        const int i = mCandidates[c];
+        const TrainingArena &arena = mMatcher.mArena;
+        float dist;
+        int inliers;
+
+        if (mMatcher.mQuantizer.Empty())
+            dist = mMatcher.HomographyMatching(mQuery.descriptors,
+                                               mQuery.index,
+                                               mMatcher.mTrainIndices[i],
+                                               mQuery.keypoints,
+                                               arena.GetKeypoints(i),
+                                               mMatcher.mWorkerScratch[worker],
+                                               mHomographies[c],
+                                               inliers);
+        else
+            dist = mMatcher.HomographyMatching(mQuery.descriptors,
+                                               arena.GetDescriptors(i),
+                                               mQuery.keypoints,
+                                               arena.GetKeypoints(i),
+                                               mMatcher.mWorkerScratch[worker],
+                                               mHomographies[c],
+                                               inliers);
+        mRankings[worker].Add(dist, i);
+        mInliers[c] = inliers;
+        mVerified[worker]++;
+
+        if (earlyExit)
+            UpdateLeader(dist, i, inliers);
+    }
+
+    Ranking Reduce() const
+    {
+        Ranking ranking;
+        for (size_t w = 0; w < mRankings.size(); ++w)
+            ranking.Merge(mRankings[w]);
+        return ranking;
+    }
+
+    const Mat& GetHomography(size_t c) const
+    {
+        return mHomographies[c];
+    }
+
+    bool IsVerified(size_t c) const
+    {
+        return mInliers[c] >= 0;
+    }
+
+    int GetInliers(size_t c) const
+    {
+        return mInliers[c];
+    }
+
+    unsigned int GetVerifiedCount() const
+    {
+        return std::accumulate(mVerified.begin(), mVerified.end(), 0u);
+    }
+
+private:
+
+    bool Stopped()
+    {
+        boost::mutex::scoped_lock lock(mLeaderMutex);
+        return mStopped;
+    }
+
+    /**
+     * Stop when the leader has enough inliers and its margin over the
+     * runner-up is already the confidence asked for. The runner-up must
+     * have been verified: until then the margin is only the one over the
+     * "no match" distance, which any competitor could shrink.
+     */
+    void UpdateLeader(float dist, int index, int inliers)
+    {
+        boost::mutex::scoped_lock lock(mLeaderMutex);
+
+        mLeader.Add(dist, index);
+        if (mLeader.bestIndex == index)
+            mLeaderInliers = inliers;
+
+        if (mLeader.secondIndex < 0)
+            return;
+
+        float margin = std::min(mLeader.secondDistance, 100.0f) -
+                       mLeader.bestDistance;
+        if (mLeaderInliers >= mMatcher.mEarlyExitInliers &&
+                margin >= mMatcher.mEarlyExitMargin)
+            mStopped = true;
+    }
+
+    ImageMatcher &mMatcher;
+    const QueryFeatures &mQuery;
+    const std::vector<int> &mCandidates;
+    std::vector<Ranking> &mRankings;
+    std::vector<unsigned int> &mVerified;
+    std::vector<Mat> &mHomographies;
+    std::vector<int> &mInliers;
+
+    boost::mutex mLeaderMutex;
+    Ranking mLeader;
+    int mLeaderInliers;
+    bool mStopped;
+};
+
 const std::string
 ImageMatcher::FindBestMatch(const std::string &fileName)
 {
@@ -157,61 +1843,411 @@ const std::string
 ImageMatcher::FindBestMatch(const std::string &fileName,
                             float &confidence)
 {
-    typedef std::vector<cv::DMatch>::iterator DMatchIt;
-    typedef std::vector<cv::Mat>::iterator descIt;
+    MatchResult result;
 
-    std::string result("No match found");
+    confidence = 0;
 
-    Mat queryDesc;
-    std::vector<KeyPoint> queryKey;
-    std::vector<float> distances;
+    {
+        ReadLock lock(mDatasetMutex);
+        if (mArena.GetImageCount() == 0)
+            return "No match found";
+    }
 
     // Safety load the query image
-    Mat image = ImageReader::LoadImage(fileName);
+    Mat image = ImageReader::LoadImage(fileName, GetDecodePolicy());
+
+    FindBestMatch(image, result);
+
+    confidence = result.confidence;
+    return result.fileName;
+}
+
+void
+ImageMatcher::FindBestMatch(const Mat &image, MatchResult &result)
+{
+    // The generation is taken before matching, so that a result computed
+    // while the dataset changes is not kept
+    const bool cached = mResultCache.IsEnabled();
+    ImageHash hash;
+    unsigned long generation = 0;
+    if (cached)
+    {
+        ResultCache::Hash(image, hash);
+        generation = mResultCache.GetGeneration();
+        if (mResultCache.Find(hash, result))
+            return;
+    }
+
+    QueryFeatures &query = GetQueryContext().query;
+
+    DescribeQuery(image, query);
+    MatchQuery(query, result);
+
+    if (cached)
+        mResultCache.Insert(hash, result, generation);
+}
+
+void
+ImageMatcher::FindBestMatch(const unsigned char *data, size_t size,
+                            MatchResult &result)
+{
+    Mat image = ImageReader::DecodeImage(data, size, GetDecodePolicy());
+    FindBestMatch(image, result);
+}
+
+void
+ImageMatcher::DescribeQuery(const Mat &image, QueryFeatures &query)
+{
+    ReadLock lock(mDatasetMutex);
 
     // Compute keypoints for query image
-    ComputeDescriptors(image, queryDesc, queryKey);
+    ComputeDescriptors(image, query.descriptors, query.keypoints,
+                       mQueryBudget);
+
+    // The signature costs a pass over the image, only taken when needed
+    if (mPrefilterCount > 0 && mSignatures.GetCount() > 0)
+        SignatureIndex::Compute(image, query.signature);
+    else
+        query.signature.release();
+
+    // The query index is built once and reused for every candidate,
+    // compact training descriptors and the ratio test do without it
+    if (mQuantizer.Empty() && mFilter.NeedsQueryIndex())
+        query.index.Build(query.descriptors);
+    else
+        query.index.Clear();
+
+#ifdef SHOW_WARPED
+    query.image = image;
+#endif
+}
 
-    // Match against every image in the set
-    for (int i = 0; i < mTrainDescriptors.size(); ++i)
+void
+ImageMatcher::MatchQuery(const QueryFeatures &query, MatchResult &result,
+                         const std::vector<int> *chosen)
+{
+    ReadLock lock(mDatasetMutex);
+    STATS_TIMER(timer, STAGE_QUERY);
+    STATS_ADD(COUNTER_QUERIES, 1);
+    QueryContext &context = GetQueryContext();
+    std::vector<int> &candidates = context.candidates;
+
+    result.fileName = "No match found";
+    result.index = -1;
+    result.confidence = 0;
+    result.distance = 100;
+    result.secondDistance = 100;
+    result.inliers = 0;
+    result.homography.release();
+    result.candidatesVerified = 0;
+
+    const size_t liveCount = mArena.GetImageCount() - mRemovedCount;
+    if (liveCount == 0)
+        return;
+
+    // Match against the most promising images in the set, or against
+    // the ones the caller chose as long as they are still there
+    STATS_TIMER(candidatesTimer, STAGE_CANDIDATES);
+    if (chosen)
+    {
+        candidates.clear();
+        for (size_t c = 0; c < chosen->size(); ++c)
+        {
+            int i = (*chosen)[c];
+            if (i >= 0 && static_cast<size_t>(i) < mRemoved.size() &&
+                !mRemoved[i])
+                candidates.push_back(i);
+        }
+    }
+    else
     {
-        cv::Mat H;
+        SelectCandidates(query, context);
+    }
+    STATS_STOP(candidatesTimer);
+
+    MatchTask task(*this, query, candidates, context);
+    mThreadPool->ParallelFor(candidates.size(), task);
+
+    Ranking ranking = task.Reduce();
+    const unsigned int verifiedCount = task.GetVerifiedCount();
+    STATS_ADD(COUNTER_CANDIDATES_VERIFIED, verifiedCount);
 
-        float dist = HomographyMatching(queryDesc, mTrainDescriptors[i],
-                                        queryKey, mTrainKeypoints[i], H);
+    // Images that are not verified keep the "no match" distance
+    if (verifiedCount < liveCount)
+    {
+        std::vector<bool> &verified = context.verified;
+        verified.assign(mArena.GetImageCount(), false);
+        for (size_t c = 0; c < candidates.size(); ++c)
+            verified[candidates[c]] = task.IsVerified(c);
 
-        distances.push_back(dist);
+        int added = 0;
+        for (size_t i = 0; i < verified.size() && added < 2; ++i)
+        {
+            if (!verified[i] && !mRemoved[i])
+            {
+                ranking.Add(100, i);
+                added++;
+            }
+        }
+    }
 
 #ifdef SHOW_WARPED
+    for (size_t c = 0; c < candidates.size(); ++c)
+    {
         // Reload image in the dataset
-        Mat trainImage = mImageReader.LoadImage(i);
+        Mat trainImage = mImageReader.LoadImage(candidates[c]);
         try
         {
             Mat warped;
-            warpPerspective(image, warped, H, trainImage.size());
+            warpPerspective(query.image, warped, task.GetHomography(c),
+                            trainImage.size());
             cv::namedWindow("warped", CV_WINDOW_KEEPRATIO);
             cv::imshow("warped", warped);
             cv::waitKey(0);
         }
         catch (const cv::Exception &ex) {}
-#endif
     }
+#endif
 
-    std::vector<float>::iterator best =
-        std::min_element (distances.begin(), distances.end());
+    result.index = ranking.bestIndex;
+    result.fileName = mFileNames[ranking.bestIndex];
+    result.candidatesVerified = verifiedCount;
 
-    if (best != distances.end())
-        result = mFileNames[best - distances.begin()];
+    for (size_t c = 0; c < candidates.size(); ++c)
+    {
+        if (candidates[c] == ranking.bestIndex && task.IsVerified(c))
+        {
+            result.inliers = task.GetInliers(c);
+            result.homography = task.GetHomography(c);
+        }
+    }
 
     // Compute second best match in order to compare the different algos
-    float real_best = *best;
-    *best = 100;
-    std::vector<float>::iterator second_best =
-        std::min_element (distances.begin(), distances.end());
+    result.distance = ranking.bestDistance;
+    result.secondDistance = std::min(ranking.secondDistance, 100.0f);
+    result.confidence = result.secondDistance - result.distance;
+}
+
+void
+ImageMatcher::RankBySignature(const Mat &image,
+                              std::vector<int> &ranking) const
+{
+    Mat signature;
+    SignatureIndex::Compute(image, signature);
+
+    ReadLock lock(mDatasetMutex);
+    ranking.clear();
+    if (mSignatures.GetCount() == 0 ||
+            mSignatures.GetCount() != mArena.GetImageCount())
+        return;
+
+    std::vector<float> similarities;
+    std::vector<int> order;
+    RankSignatures(signature, mArena.GetImageCount() - mRemovedCount,
+                   similarities, order, ranking);
+}
 
-    confidence = *second_best - real_best;
+void
+ImageMatcher::ExtractFeatures(const Mat &image, std::vector<KeyPoint> &keypoints,
+                              Mat &descriptors)
+{
+    ReadLock lock(mDatasetMutex);
+    ComputeDescriptors(image, descriptors, keypoints, mQueryBudget);
+}
 
-    return result;
+void
+ImageMatcher::MatchFeatures(const std::vector<KeyPoint> &keypoints,
+                            const Mat &descriptors, MatchResult &result,
+                            const std::vector<int> *candidates)
+{
+    QueryFeatures &query = GetQueryContext().query;
+    query.keypoints.assign(keypoints.begin(), keypoints.end());
+    query.descriptors = descriptors;
+    // Without the image there is no signature, nor prefilter
+    query.signature.release();
+
+    {
+        ReadLock lock(mDatasetMutex);
+
+        // Compact codes are matched against float queries
+        const Mat &train = mArena.GetDescriptors();
+        int type = mQuantizer.Empty() ? train.type() : CV_32F;
+        if (!train.empty() && !descriptors.empty() &&
+            (descriptors.cols != train.cols || descriptors.type() != type))
+            throw ImageMatcherIOException("Query features do not match "
+                                          "the training features");
+
+        if (keypoints.size() != static_cast<size_t>(descriptors.rows))
+            throw ImageMatcherIOException("One keypoint per descriptor "
+                                          "expected");
+
+        if (mQuantizer.Empty() && mFilter.NeedsQueryIndex())
+            query.index.Build(query.descriptors);
+        else
+            query.index.Clear();
+    }
+
+    MatchQuery(query, result, candidates);
+}
+
+/**
+ * Three stage pipeline over a list of queries: one thread decodes, a few
+ * threads extract features and the calling thread matches (the matching
+ * itself being spread over the thread pool).
+ */
+class ImageMatcher::QueryPipeline
+{
+public:
+
+    /**
+     * The queries are the files listed, or the images of a set if one is
+     * given (fileNames then being its names).
+     */
+    QueryPipeline(ImageMatcher &matcher,
+                  const std::vector<std::string> &fileNames,
+                  const ImageReader *images,
+                  unsigned int extractors) :
+        mMatcher(matcher),
+        mFileNames(fileNames),
+        mImages(images),
+        mDecoded(2 * extractors),
+        mDescribed(2 * extractors),
+        mExtractors(extractors),
+        mRunningExtractors(extractors) {}
+
+    void Run(std::vector<MatchResult> &results)
+    {
+        boost::thread_group threads;
+        threads.add_thread(new boost::thread(&QueryPipeline::Decode, this));
+        for (unsigned int i = 0; i < mExtractors; ++i)
+            threads.add_thread(new boost::thread(&QueryPipeline::Extract, this));
+
+        Item item;
+        while (mDescribed.Pop(item))
+        {
+            MatchResult &result = results[item.index];
+            try
+            {
+                if (item.error.empty())
+                    mMatcher.MatchQuery(*item.features, result);
+            }
+            catch (const std::exception &ex)
+            {
+                item.error = ex.what();
+            }
+            result.error = item.error;
+        }
+
+        threads.join_all();
+    }
+
+private:
+
+    struct Item
+    {
+        size_t index;
+        Mat image;
+        boost::shared_ptr<QueryFeatures> features;
+        std::string error;
+    };
+
+    void Decode()
+    {
+        for (size_t i = 0; i < mFileNames.size(); ++i)
+        {
+            Item item;
+            item.index = i;
+            try
+            {
+                if (mImages)
+                    item.image = mImages->LoadImage(i);
+                else
+                    item.image = ImageReader::LoadImage(
+                            mFileNames[i], mMatcher.GetDecodePolicy());
+            }
+            catch (const std::exception &ex)
+            {
+                item.error = ex.what();
+            }
+
+            if (!mDecoded.Push(item))
+                break;
+        }
+        mDecoded.Close();
+    }
+
+    void Extract()
+    {
+        Item item;
+        while (mDecoded.Pop(item))
+        {
+            try
+            {
+                if (item.error.empty())
+                {
+                    item.features.reset(new QueryFeatures);
+                    mMatcher.DescribeQuery(item.image, *item.features);
+                }
+            }
+            catch (const std::exception &ex)
+            {
+                item.error = ex.what();
+            }
+            item.image.release();
+            mDescribed.Push(item);
+        }
+
+        boost::mutex::scoped_lock lock(mMutex);
+        if (--mRunningExtractors == 0)
+            mDescribed.Close();
+    }
+
+    ImageMatcher &mMatcher;
+    const std::vector<std::string> &mFileNames;
+    const ImageReader *mImages;
+    BoundedQueue<Item> mDecoded;
+    BoundedQueue<Item> mDescribed;
+    unsigned int mExtractors;
+    unsigned int mRunningExtractors;
+    boost::mutex mMutex;
+};
+
+std::vector<MatchResult>
+ImageMatcher::FindBestMatches(const std::vector<std::string> &fileNames)
+{
+    std::vector<MatchResult> results(fileNames.size());
+
+    if (fileNames.empty())
+        return results;
+
+    // Extraction is the most expensive stage before matching, give it
+    // half of the cores; matching keeps the thread pool
+    unsigned int extractors = std::max(1u, mThreadPool->GetNumThreads() / 2);
+
+    QueryPipeline pipeline(*this, fileNames, NULL, extractors);
+    pipeline.Run(results);
+
+    return results;
+}
+
+std::vector<MatchResult>
+ImageMatcher::FindBestMatches(const ImageReader &images)
+{
+    ImageReader queries(images);
+    queries.SetDecodePolicy(GetDecodePolicy());
+
+    const std::vector<std::string> &names = queries.GetFileNames();
+    std::vector<MatchResult> results(names.size());
+
+    if (names.empty())
+        return results;
+
+    unsigned int extractors = std::max(1u, mThreadPool->GetNumThreads() / 2);
+
+    QueryPipeline pipeline(*this, names, &queries, extractors);
+    pipeline.Run(results);
+
+    return results;
 }
 
 const std::string
@@ -222,18 +2258,28 @@ ImageMatcher::MatchImageDebug (const std::string &imageDirectory,
     typedef std::vector<cv::DMatch>::iterator DMatchIt;
     typedef std::vector<cv::Mat>::iterator descIt;
 
-    mTrainDescriptors.clear();
+    mArena.Clear();
+    mSignatures.Clear();
+    mTrainIndices.clear();
+    mGlobalIndex.Clear();
+    mInvertedFile.Clear();
+    mIndexRegion.reset();
 
     mImageReader(imageDirectory);
     mFileNames = mImageReader.GetFileNames();
+    mRemoved.assign(mFileNames.size(), false);
+    mRemovedCount = 0;
+    mRemovedRows = 0;
 
-    cv::FlannBasedMatcher matcher;
-
-    Mat image = ImageReader::LoadImage(fileName);
+    Mat image = ImageReader::LoadImage(fileName, GetDecodePolicy());
 
     Mat descriptors;
     std::vector<KeyPoint> keypoints;
-    ComputeDescriptors(image, descriptors, keypoints);
+    ComputeDescriptors(image, descriptors, keypoints, mQueryBudget);
+
+    DescriptorIndex index;
+    index.Build(descriptors);
+    MatchBuffers buffers;
 
     int count = 0;
     while (!done)
@@ -245,21 +2291,15 @@ ImageMatcher::MatchImageDebug (const std::string &imageDirectory,
 
             Mat descriptors2;
             std::vector<KeyPoint> keypoints2;
-            ComputeDescriptors(image2, descriptors2, keypoints2);
-
-//            std::vector<cv::DMatch> matches;
-//            matcher.match(descriptors2, descriptors, matches);
-
-            std::vector<DMatch> matches, matches12, matches21;
-            matcher.match(descriptors2, descriptors, matches12);
-            matcher.match(descriptors, descriptors2, matches21);
-            for (size_t i = 0; i < matches12.size(); i++)
-            {
-                DMatch forward = matches12[i];
-                DMatch backward = matches21[forward.trainIdx];
-                if (backward.trainIdx == forward.queryIdx)
-                    matches.push_back(forward);
-            }
+            ComputeDescriptors(image2, descriptors2, keypoints2,
+                               mTrainBudget);
+
+            // The same filter as the queries
+            DescriptorIndex index2;
+            index2.Build(descriptors2);
+            std::vector<DMatch> matches;
+            if (!index.Empty())
+                mFilter.Match(descriptors2, index2, index, buffers, matches);
 
             std::sort (matches.begin(), matches.end());
 
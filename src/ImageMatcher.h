@@ -11,23 +11,410 @@
 #ifndef dataset_analyzer_h
 #define dataset_analyzer_h
 
+#include "DescriptorIndex.h"
+#include "DescriptorQuantizer.h"
+#include "FeatureExtractor.h"
 #include "ImageReader.h"
+#include "MatchFilter.h"
+#include "ResultCache.h"
+#include "SignatureIndex.h"
+#include "ThreadPool.h"
+#include "TrainingArena.h"
+#include "Vocabulary.h"
 
 #include <vector>
 #include <string>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/tss.hpp>
 #include <opencv2/core/core.hpp>
 #include <opencv2/features2d/features2d.hpp>
 
+namespace boost { namespace interprocess { class mapped_region; } }
+
+/**
+ * @brief The outcome of a query
+ */
+struct MatchResult
+{
+    MatchResult() : index(-1), confidence(0), distance(100),
+        secondDistance(100), inliers(0), candidatesVerified(0) {}
+
+    /**
+     * @brief File name of the best match, "No match found" if none
+     */
+    std::string fileName;
+    /**
+     * @brief Index of the best match in the training set, -1 if none
+     */
+    int index;
+    /**
+     * @brief Distance between the second best and the best match
+     */
+    float confidence;
+    /**
+     * @brief Distance of the best match, 100 if none
+     */
+    float distance;
+    /**
+     * @brief Distance of the second best match, at most 100 (the
+     * distance of an image that does not match)
+     */
+    float secondDistance;
+    /**
+     * @brief Number of RANSAC inliers of the best match
+     */
+    int inliers;
+    /**
+     * @brief Homography from the query to the best match, empty if it
+     * could not be estimated
+     */
+    cv::Mat homography;
+    /**
+     * @brief Number of training images that went through homography
+     * verification
+     */
+    unsigned int candidatesVerified;
+    /**
+     * @brief Why the query could not be answered, empty on success
+     */
+    std::string error;
+};
+
+/**
+ * @brief Keypoints found and kept by the last Train()
+ */
+struct TrainingStats
+{
+    TrainingStats() : totalDetected(0), totalKept(0), descriptorBytes(0),
+        bytesSaved(0) {}
+
+    std::vector<std::string> fileNames;
+    /**
+     * @brief Keypoints found in every training image, before the budget
+     */
+    std::vector<size_t> detected;
+    /**
+     * @brief Keypoints kept for every training image
+     */
+    std::vector<size_t> kept;
+    size_t totalDetected;
+    size_t totalKept;
+    /**
+     * @brief Memory taken by the kept descriptors, as stored
+     */
+    size_t descriptorBytes;
+    /**
+     * @brief Memory the dropped keypoints and their descriptors would
+     * have taken
+     */
+    size_t bytesSaved;
+};
+
 class ImageMatcher
 {
 public:
 
-    ImageMatcher(int minHessian = 400);
+    /**
+     * @brief Constructor
+     * @param[in] minHessian SURF Hessian threshold
+     * @param[in] numThreads Number of worker threads, zero means one per
+     * hardware thread
+     * @param[in] features The local features to compute. Loading an
+     * index switches to the features it was built with.
+     */
+    ImageMatcher(int minHessian = 400, unsigned int numThreads = 0,
+                 FeatureType features = FEATURE_SURF);
+
+    /**
+     * @brief Set the number of worker threads
+     * @param[in] numThreads Number of worker threads, zero means one per
+     * hardware thread
+     */
+    void SetNumThreads(unsigned int numThreads);
+
+    /**
+     * @brief Set how many candidates are verified for every query.
+     *
+     * With a non-zero count all the training descriptors are put in one
+     * approximate nearest neighbour index. Every query descriptor votes
+     * for the image its nearest neighbour belongs to, and only the most
+     * voted images go through homography verification. Zero (default)
+     * verifies every image in the dataset.
+     * @param[in] candidateCount Number of candidates to verify
+     * @note The index holds a copy of all the training descriptors. When
+     * a vocabulary is set, candidates are scored by their visual words
+     * instead, see BuildVocabulary().
+     */
+    void SetCandidateCount(unsigned int candidateCount);
+
+    /**
+     * @brief Keep only the images that look most like the query before
+     * any local feature is compared.
+     *
+     * Every training image gets a global signature at Train() (a
+     * thumbnail and a color histogram, see SignatureIndex); a query is
+     * compared to all of them in one scan and only the prefilterCount
+     * closest go on to candidate selection and verification, in order
+     * of similarity. The other images keep the "no match" distance.
+     * @param[in] prefilterCount Number of images kept, zero (default)
+     * disables the prefilter
+     * @note Needs the signatures: index files written before they were
+     * saved, and queries given as features (MatchFeatures()), go
+     * without the prefilter.
+     */
+    void SetPrefilter(unsigned int prefilterCount);
+
+    /**
+     * @brief Rank the training images by the similarity of their global
+     * signature to a query, as the prefilter does.
+     * @param[in] image The query image
+     * @param[out] ranking The indices of the images in the dataset, most
+     * similar first; empty if the dataset has no signatures
+     */
+    void RankBySignature(const cv::Mat &image,
+                         std::vector<int> &ranking) const;
+
+    /**
+     * @brief Set how the training descriptors are kept in memory.
+     *
+     * STORAGE_INT8 and STORAGE_FLOAT16 quantize float descriptors with
+     * per-dimension scales, see DescriptorQuantizer. The candidates are
+     * then verified by exact search over the codes instead of through
+     * per-image FLANN indices, which would need float copies: the memory
+     * saved is paid with a slower verification of every candidate, so a
+     * short candidate list (SetCandidateCount()) matters more. Binary
+     * descriptors are already compact and are kept as they are.
+     * @param[in] storage The storage, STORAGE_FLOAT by default
+     * @note Takes effect at the next Train() or LoadIndex(). An index
+     * saved with compact descriptors loads them as they are.
+     */
+    void SetDescriptorStorage(DescriptorStorage storage);
+
+    /**
+     * @brief Stop verifying candidates once the best one is clear.
+     *
+     * Candidates are verified by decreasing prior score: visual words
+     * with a vocabulary, nearest neighbour votes otherwise (the voting
+     * index is built even if SetCandidateCount() is zero). The search
+     * stops as soon as the leader has at least minInliers RANSAC inliers
+     * and its confidence against a verified runner-up reaches
+     * minConfidence, so at least two candidates are always verified.
+     * Skipped images are then reported as unverified.
+     * @param[in] minInliers Inliers needed to stop, zero disables the
+     * early exit (default)
+     * @param[in] minConfidence Confidence needed to stop
+     */
+    void SetEarlyExit(int minInliers, float minConfidence);
+
+    /**
+     * @brief Set how the nearest neighbours between a query and a
+     * candidate are filtered before the homography is estimated.
+     *
+     * The mutual check (default) searches both directions; the ratio
+     * test and the cached mutual check do less nearest neighbour work,
+     * see MatchFilter.
+     * @param[in] filter The filter
+     */
+    void SetMatchFilter(const MatchFilter &filter);
+
+    /**
+     * @brief Keep the results of recent queries and answer the same
+     * image, or a near-identical one, from them.
+     *
+     * Images are recognized by a hash of their decoded pixels, or by a
+     * perceptual hash at most maxHashDistance bits away (see
+     * ResultCache). The extraction and matching are skipped, the decoding
+     * of the queries loaded from files is not. The results are dropped
+     * whenever the dataset or a setting that changes them does.
+     * @param[in] capacity Number of results kept, zero (default) disables
+     * the cache
+     * @param[in] maxHashDistance Largest perceptual hash distance of a
+     * near-identical image, negative for identical images only
+     * @note Only FindBestMatch() goes through the cache.
+     */
+    void SetResultCache(size_t capacity, int maxHashDistance = 4);
+
+    /**
+     * @brief Retrieve the hits and misses of the result cache
+     */
+    ResultCacheStats GetResultCacheStats() const;
+
+    /**
+     * @brief Set how training and query images are decoded.
+     *
+     * Capping the resolution cuts decoding, the Hessian pyramid and the
+     * peak memory of large photos; see ImageReader for how JPEG files
+     * are scaled while decoding.
+     * @param[in] policy The decode policy, full resolution BGR by default
+     * @note Applies to the next Train() and to the queries loaded from
+     * files; images passed as matrices are used as they are.
+     */
+    void SetDecodePolicy(const DecodePolicy &policy);
+
+    /**
+     * @brief Retrieve how training and query images are decoded
+     */
+    const DecodePolicy &GetDecodePolicy() const;
+
+    /**
+     * @brief Limit the keypoints kept for every training image.
+     *
+     * Fewer keypoints make a smaller dataset and faster verification;
+     * the strongest responses are the most repeatable ones.
+     * @param[in] budget The budget, unlimited by default
+     * @note Applies to the next Train() and to the images added later.
+     */
+    void SetTrainKeypointBudget(const KeypointBudget &budget);
+
+    /**
+     * @brief Limit the keypoints kept for every query image
+     * @param[in] budget The budget, unlimited by default
+     */
+    void SetQueryKeypointBudget(const KeypointBudget &budget);
+
+    /**
+     * @brief Retrieve the keypoint counts of the last Train(), empty
+     * after LoadIndex()
+     */
+    TrainingStats GetTrainingStats() const;
+
+    /**
+     * @brief Train on one shard of the image directory only.
+     *
+     * A dataset too large for one process is split among shardCount
+     * matchers trained on the same directory, each one with its own
+     * shard; images are assigned by ImageReader::ShardOf(). The shards
+     * are queried together through a ShardCoordinator.
+     * @param[in] shard This matcher's shard, in [0, shardCount)
+     * @param[in] shardCount Number of shards, 1 (default) for the whole
+     * dataset
+     * @note Applies to the next Train(); AddImage() and UpdateImage()
+     * take any image, see OwnsImage().
+     */
+    void SetShard(unsigned int shard, unsigned int shardCount);
+
+    /**
+     * @brief Check whether an image belongs to this matcher's shard
+     * @param[in] name The image file name, without the directory
+     */
+    bool OwnsImage(const std::string &name) const;
+
+    /**
+     * @brief Retrieve the names of the images in the dataset, removed
+     * ones excluded
+     */
+    std::vector<std::string> GetImageNames() const;
+
+    /**
+     * @brief Build a vocabulary tree from the training descriptors and
+     * use it to select the candidates.
+     *
+     * Every training image is indexed by its visual words in a tf-idf
+     * inverted file; a query scores the images sharing words with it,
+     * and the best SetCandidateCount() of them are verified.
+     * @param[in] branching Number of children of every tree node
+     * @param[in] depth Number of levels of the tree
+     * @note The classifier must be trained.
+     */
+    void BuildVocabulary(int branching = 10, int depth = 4);
+
+    /**
+     * @brief Save the vocabulary built by BuildVocabulary()
+     * @param[in] vocabularyFile Name of the vocabulary file to be written
+     */
+    void SaveVocabulary(const std::string &vocabularyFile) const;
+
+    /**
+     * @brief Load a vocabulary written by SaveVocabulary() and use it to
+     * select the candidates. The vocabulary is kept across Train() and
+     * LoadIndex(), the inverted file is rebuilt for the new dataset.
+     * @param[in] vocabularyFile Name of the vocabulary file to be loaded
+     * @throw VocabularyIOException if the file cannot be read or holds
+     * words of other descriptors than the ones of the matcher
+     */
+    void LoadVocabulary(const std::string &vocabularyFile);
 
     /**
      * @brief Train the classifier by feeding a dataset of images.
+     *
+     * Images are decoded and described in parallel; the results keep
+     * the (sorted) order of the file names. Images that cannot be read
+     * are kept with no descriptors, so they never match.
+     * @param[in] imageDirectory A directory of images, or an
+     * uncompressed tar archive of them
      */
     void Train(const std::string &imageDirectory);
+    /**
+     * @brief Train the classifier on a set of images held anywhere, e.g.
+     * in memory buffers (see ImageReader::SetBuffers()).
+     *
+     * The images are decoded with this matcher's decode policy. The set
+     * is kept, and with it the buffers it owns.
+     * @param[in] images The training set
+     */
+    void Train(const ImageReader &images);
+
+    /**
+     * @brief Add one image to the dataset.
+     *
+     * Only the new image is described; the search indices are updated
+     * in place (the voting index of SetCandidateCount() is rebuilt once
+     * enough images have been added). Like RemoveImage() and
+     * UpdateImage(), it can be called while other threads run queries.
+     * @param[in] fileName Path of the image, its file name (without
+     * the directory) becomes its name in the dataset
+     * @throw ImageMatcherIOException if the name is already in use
+     */
+    void AddImage(const std::string &fileName);
+    /**
+     * @brief Add one decoded image to the dataset, see AddImage()
+     * @param[in] name The name reported when the image is matched
+     * @param[in] image The image
+     */
+    void AddImage(const std::string &name, const cv::Mat &image);
+
+    /**
+     * @brief Remove one image from the dataset.
+     *
+     * The image is left out of the matching right away and out of the
+     * index file at the next SaveIndex().
+     * @param[in] name The name of the image in the dataset
+     * @return False if there is no such image
+     */
+    bool RemoveImage(const std::string &name);
+
+    /**
+     * @brief Replace one image of the dataset, or add it if missing
+     * @param[in] fileName Path of the image, see AddImage()
+     */
+    void UpdateImage(const std::string &fileName);
+    /**
+     * @brief Replace one image of the dataset with a decoded image, or
+     * add it if missing
+     * @param[in] name The name of the image in the dataset
+     * @param[in] image The image
+     */
+    void UpdateImage(const std::string &name, const cv::Mat &image);
+
+    /**
+     * @brief Save the trained dataset (file names, keypoints and
+     * descriptors) to a binary index file.
+     * @param[in] indexFile Name of the index file to be written
+     * @note The classifier must be trained.
+     */
+    void SaveIndex(const std::string &indexFile) const;
+
+    /**
+     * @brief Load a dataset previously written by SaveIndex().
+     *
+     * The index file is memory-mapped and the descriptors are used in
+     * place, so the mapping is kept alive as long as this object (or
+     * until the next call to LoadIndex()).
+     * @param[in] indexFile Name of the index file to be loaded
+     */
+    void LoadIndex(const std::string &indexFile);
 
     /**
      * @brief Find the best match among the images in the dataset.
@@ -38,31 +425,278 @@ public:
     const std::string FindBestMatch(const std::string &fileName,
                                     float &confidence);
 
+    /**
+     * @brief Find the best match for an image already in memory.
+     * @param[in] image The query image
+     * @param[out] result The best match
+     * @note The classifier must be trained. Several threads can query
+     * the same classifier at once.
+     */
+    void FindBestMatch(const cv::Mat &image, MatchResult &result);
+
+    /**
+     * @brief Find the best match for an encoded image in memory, e.g.
+     * received over the network, without writing it to a file.
+     * @param[in] data The encoded image, decoded in place
+     * @param[in] size Its size in bytes
+     * @param[out] result The best match
+     * @throw ImageReaderIOException if the image cannot be decoded
+     */
+    void FindBestMatch(const unsigned char *data, size_t size,
+                       MatchResult &result);
+
+    /**
+     * @brief Find the best match for every image in a list.
+     *
+     * Decoding, feature extraction and matching run as a pipeline over
+     * bounded queues, so different queries go through different stages
+     * at the same time.
+     * @param[in] fileNames The query images
+     * @return One result per query, in the same order. Queries that fail
+     * (e.g. missing files) carry the error message instead of throwing.
+     * @note The classifier must be trained.
+     */
+    std::vector<MatchResult> FindBestMatches(
+            const std::vector<std::string> &fileNames);
+    /**
+     * @brief Find the best match for every image of a set, e.g. the
+     * members of an archive, see above
+     * @param[in] images The query images, decoded with this matcher's
+     * decode policy
+     * @return One result per image of the set, in its order
+     */
+    std::vector<MatchResult> FindBestMatches(const ImageReader &images);
+
+    /**
+     * @brief Detect and describe the features of a query image, with
+     * the query keypoint budget. Needs no training.
+     * @param[in] image The query image
+     * @param[out] keypoints The keypoints found
+     * @param[out] descriptors One descriptor per keypoint
+     */
+    void ExtractFeatures(const cv::Mat &image,
+                         std::vector<cv::KeyPoint> &keypoints,
+                         cv::Mat &descriptors);
+
+    /**
+     * @brief Find the best match for query features computed elsewhere,
+     * e.g. by the ExtractFeatures() of a matcher with the same features.
+     *
+     * Only the keypoint positions are used.
+     * @param[in] keypoints The query keypoints
+     * @param[in] descriptors One descriptor per keypoint
+     * @param[out] result The best match
+     * @param[in] candidates If not NULL, verify these training images
+     * only (e.g. the one matched by the previous video frame) instead of
+     * selecting the candidates; the others keep the "no match" distance
+     * @throw ImageMatcherIOException if the descriptors are not of the
+     * kind of the training ones
+     */
+    void MatchFeatures(const std::vector<cv::KeyPoint> &keypoints,
+                       const cv::Mat &descriptors, MatchResult &result,
+                       const std::vector<int> *candidates = NULL);
+
     const std::string MatchImageDebug (const std::string &imageDirectory,
                                        const std::string &fileName);
 
 private:
 
-    void ComputeDescriptors(const cv::Mat &image, cv::Mat &desc);
+    class TrainTask;
+    class IndexTask;
+    class MatchTask;
+    class QueryPipeline;
+    class WordsTask;
+    struct QueryContext;
+
+    /**
+     * @brief Everything the matching needs to know about a query image
+     */
+    struct QueryFeatures
+    {
+        cv::Mat descriptors;
+        std::vector<cv::KeyPoint> keypoints;
+        DescriptorIndex index;
+        /**
+         * @brief Global signature, empty when there is no prefilter
+         */
+        cv::Mat signature;
+#ifdef SHOW_WARPED
+        cv::Mat image;
+#endif
+    };
+
+    /**
+     * @brief Buffers reused by the matching done on one worker thread
+     */
+    struct MatchScratch
+    {
+        MatchBuffers buffers;
+        std::vector<cv::DMatch> filteredMatches;
+        std::vector<cv::Point2f> obj;
+        std::vector<cv::Point2f> scene;
+        cv::Mat mask;
+    };
+
+    void BuildInvertedFile(const Vocabulary &vocabulary,
+                           InvertedFile &invertedFile) const;
+    void BuildSearchIndex();
+    void RebuildSearchIndex();
+
+    QueryContext &GetQueryContext();
+
+    void SelectCandidates(const QueryFeatures &query,
+                          QueryContext &context) const;
+    bool UsePrefilter(const QueryFeatures &query) const;
+    void RankSignatures(const cv::Mat &signature, size_t count,
+                        std::vector<float> &similarities,
+                        std::vector<int> &order,
+                        std::vector<int> &nearest) const;
+
+    void DescribeQuery(const cv::Mat &image, QueryFeatures &query);
+
+    void MatchQuery(const QueryFeatures &query, MatchResult &result,
+                    const std::vector<int> *chosen = NULL);
+
+    void DescribeImage(const cv::Mat &image, cv::Mat &descriptors,
+                       std::vector<cv::KeyPoint> &keypoints,
+                       cv::Mat &signature);
+    int FindImage(const std::string &name) const;
+    void EraseImage(size_t index);
+    void InsertImage(const std::string &name, const cv::Mat &descriptors,
+                     const std::vector<cv::KeyPoint> &keypoints,
+                     const cv::Mat &signature);
+
+    void CompactDescriptors();
+    void GetFloatDescriptors(size_t index, cv::Mat &descriptors) const;
+
+    void ComputeDescriptors(const cv::Mat &image, cv::Mat &desc,
+                            const KeypointBudget &budget);
     void ComputeDescriptors(const cv::Mat &image, cv::Mat &desc,
-                            std::vector<cv::KeyPoint> &keypoints);
+                            std::vector<cv::KeyPoint> &keypoints,
+                            const KeypointBudget &budget,
+                            size_t *detected = NULL);
+    void ComputeTrainingStats(const std::vector<size_t> &detected);
 
     float HomographyMatching(const cv::Mat &objDescriptors,
-                             const cv::Mat &sceneDescriptors,
+                             const DescriptorIndex &objIndex,
+                             const DescriptorIndex &sceneIndex,
                              const std::vector<cv::KeyPoint> &objKeypoints,
-                             const std::vector<cv::KeyPoint> &sceneKeypoints,
-                             cv::Mat &homography);
+                             const KeypointSpan &scenePoints,
+                             MatchScratch &scratch,
+                             cv::Mat &homography,
+                             int &inliers);
+    float HomographyMatching(const cv::Mat &objDescriptors,
+                             const cv::Mat &sceneCodes,
+                             const std::vector<cv::KeyPoint> &objKeypoints,
+                             const KeypointSpan &scenePoints,
+                             MatchScratch &scratch,
+                             cv::Mat &homography,
+                             int &inliers);
+    float VerifyMatches(const std::vector<cv::KeyPoint> &objKeypoints,
+                        const KeypointSpan &scenePoints,
+                        MatchScratch &scratch,
+                        cv::Mat &homography,
+                        int &inliers);
 
     ImageReader mImageReader;
 
-    cv::FlannBasedMatcher mMatcher;
-//    cv::BFMatcher mMatcher;
+    boost::shared_ptr<ThreadPool> mThreadPool;
+    /**
+     * @brief One set of matching buffers per worker of mThreadPool
+     */
+    std::vector<MatchScratch> mWorkerScratch;
+    /**
+     * @brief The buffers of the queries run by every calling thread,
+     * created on its first query and freed when it exits
+     */
+    boost::thread_specific_ptr<QueryContext> mQueryContexts;
 
     std::vector<std::string> mFileNames;
-    std::vector<cv::Mat> mTrainDescriptors;
-    std::vector<std::vector<cv::KeyPoint> > mTrainKeypoints;
+    /**
+     * @brief The training descriptors and keypoint positions, one slot
+     * per entry of mFileNames
+     */
+    TrainingArena mArena;
+    /**
+     * @brief The global signature of every image, for the prefilter.
+     * Empty if they are not known (older index files).
+     */
+    SignatureIndex mSignatures;
+    /**
+     * @brief Tombstones of the images removed since the last Train() or
+     * LoadIndex(); their slots are kept empty
+     */
+    std::vector<bool> mRemoved;
+    size_t mRemovedCount;
+    /**
+     * @brief Arena rows still held by removed images
+     */
+    size_t mRemovedRows;
+
+    /**
+     * @brief Held shared by queries, exclusively by dataset changes
+     */
+    mutable boost::shared_mutex mDatasetMutex;
+
+    DescriptorStorage mStorage;
+    /**
+     * @brief Set when mArena holds compact codes
+     */
+    DescriptorQuantizer mQuantizer;
 
-    int mMinHessian;
+    /**
+     * @brief One prebuilt index per training image, reused by all
+     * queries. Left empty for compact descriptors.
+     */
+    std::vector<DescriptorIndex> mTrainIndices;
+
+    /**
+     * @brief All training descriptors, for candidate voting
+     */
+    DescriptorIndex mGlobalIndex;
+    /**
+     * @brief The training image every row of mGlobalIndex comes from
+     */
+    std::vector<int> mGlobalImageIds;
+    /**
+     * @brief Number of images when mGlobalIndex was built, the ones
+     * added later are not in it
+     */
+    size_t mGlobalImageCount;
+
+    boost::shared_ptr<Vocabulary> mVocabulary;
+    /**
+     * @brief The training images indexed by their visual words
+     */
+    InvertedFile mInvertedFile;
+
+    unsigned int mCandidateCount;
+    unsigned int mPrefilterCount;
+    int mEarlyExitInliers;
+    float mEarlyExitMargin;
+    MatchFilter mFilter;
+
+    /**
+     * @brief Read-only mapping of the index file the descriptors point into
+     */
+    boost::shared_ptr<boost::interprocess::mapped_region> mIndexRegion;
+
+    FeatureExtractor mExtractor;
+    KeypointBudget mTrainBudget;
+    KeypointBudget mQueryBudget;
+    TrainingStats mTrainingStats;
+
+    unsigned int mShard;
+    unsigned int mShardCount;
+
+    ResultCache mResultCache;
+};
+
+class ImageMatcherIOException : public std::runtime_error
+{
+public:
+    ImageMatcherIOException(const std::string &msg = "") :
+        runtime_error(msg) {}
 };
 
 #endif
@@ -1,27 +1,804 @@
+#include "AsyncMatcher.h"
+#include "FrameTracker.h"
 #include "ImageMatcher.h"
 #include "ImageReader.h"
+#include "MatchServer.h"
+#include "ShardCoordinator.h"
+#include "Stats.h"
 #include "config.h"
 
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <opencv2/highgui/highgui.hpp>
+#include <sstream>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 #include <gtest/gtest.h>
 
-TEST(ImageMatcherTest, FindBestMatch)
+/**
+ * Each query shows the training image of the same rank in file name
+ * order.
+ */
+class ImageMatcherTest : public ::testing::Test
 {
-    std::string trainingDir(TRAINING_DIR);
-    std::string queryDir(QUERY_DIR);
+protected:
 
-    ImageReader reader(queryDir);
-    std::vector<std::string> queryNames = reader.GetFileNames();
+    virtual void SetUp()
+    {
+        mTrainingDir = TRAINING_DIR;
+        mQueryDir = QUERY_DIR;
+
+        ImageReader reader(mQueryDir);
+        mQueryNames = reader.GetFileNames();
+
+        reader(mTrainingDir);
+        mTrainNames = reader.GetFileNames();
+    }
+
+    /**
+     * Match every query image and check it against its training image
+     */
+    void ExpectAllQueriesMatch(ImageMatcher &matcher)
+    {
+        for (size_t i = 0; i < mQueryNames.size(); ++i)
+        {
+            std::string matchName =
+                matcher.FindBestMatch(mQueryDir + mQueryNames[i]);
+            EXPECT_STREQ (mTrainNames[i].c_str(), matchName.c_str())
+                << mQueryNames[i];
+        }
+    }
+
+    std::string mTrainingDir;
+    std::string mQueryDir;
+    std::vector<std::string> mQueryNames;
+    std::vector<std::string> mTrainNames;
+};
+
+TEST_F(ImageMatcherTest, FindBestMatch)
+{
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    ExpectAllQueriesMatch(matcher);
+}
+
+
+TEST_F(ImageMatcherTest, SaveAndLoadIndex)
+{
+    std::string indexFile("ImageMatcherTest.idx");
 
-    reader(trainingDir);
-    std::vector<std::string> trainNames = reader.GetFileNames();
+    ImageMatcher trained;
+    trained.Train(mTrainingDir);
+    trained.SaveIndex(indexFile);
 
     ImageMatcher matcher;
-    matcher.Train(trainingDir);
+    matcher.LoadIndex(indexFile);
 
-    for (int i = 0; i < queryNames.size(); ++i)
+    ExpectAllQueriesMatch(matcher);
+
+    std::remove(indexFile.c_str());
+}
+
+TEST_F(ImageMatcherTest, FindBestMatchAmongCandidates)
+{
+    ImageMatcher matcher;
+    matcher.SetCandidateCount(3);
+    matcher.Train(mTrainingDir);
+
+    ExpectAllQueriesMatch(matcher);
+}
+
+TEST_F(ImageMatcherTest, FindBestMatches)
+{
+    std::vector<std::string> queries;
+    for (int i = 0; i < mQueryNames.size(); ++i)
+        queries.push_back(mQueryDir + mQueryNames[i]);
+    queries.push_back(mQueryDir + "missing.jpg");
+
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    std::vector<MatchResult> results = matcher.FindBestMatches(queries);
+    ASSERT_EQ (queries.size(), results.size());
+
+    for (int i = 0; i < mQueryNames.size(); ++i)
     {
-        std::string matchName = matcher.FindBestMatch(queryDir + queryNames[i]);
-        ASSERT_STREQ (trainNames[i].c_str(), matchName.c_str());
+        ASSERT_TRUE (results[i].error.empty());
+        ASSERT_STREQ (mTrainNames[i].c_str(), results[i].fileName.c_str());
     }
+    ASSERT_FALSE (results.back().error.empty());
 }
 
+TEST_F(ImageMatcherTest, FindBestMatchWithVocabulary)
+{
+    std::string vocabularyFile("ImageMatcherTest.voc");
+
+    ImageMatcher trained;
+    trained.Train(mTrainingDir);
+    trained.BuildVocabulary(8, 3);
+    trained.SaveVocabulary(vocabularyFile);
+
+    ImageMatcher matcher;
+    matcher.SetCandidateCount(5);
+    matcher.LoadVocabulary(vocabularyFile);
+    matcher.Train(mTrainingDir);
+
+    ExpectAllQueriesMatch(matcher);
+
+    // SURF words cannot quantize ORB descriptors
+    ImageMatcher binary(400, 0, FEATURE_ORB);
+    EXPECT_THROW (binary.LoadVocabulary(vocabularyFile),
+                  VocabularyIOException);
+
+    // A root whose children start at the root itself would loop forever.
+    // The first node follows the magic, the version and six header fields.
+    {
+        std::fstream file(vocabularyFile.c_str(),
+                          std::ios::in | std::ios::out | std::ios::binary);
+        const int32_t firstChild = 0;
+        file.seekp(8 + sizeof(uint32_t) + 6 * sizeof(int32_t));
+        file.write(reinterpret_cast<const char *>(&firstChild),
+                   sizeof(firstChild));
+    }
+    ImageMatcher corrupted;
+    EXPECT_THROW (corrupted.LoadVocabulary(vocabularyFile),
+                  VocabularyIOException);
+
+    std::remove(vocabularyFile.c_str());
+}
+
+TEST_F(ImageMatcherTest, FindBestMatchWithBinaryFeatures)
+{
+    std::string indexFile("ImageMatcherTest.orb.idx");
+
+    ImageMatcher trained(400, 0, FEATURE_ORB);
+    trained.Train(mTrainingDir);
+    trained.SaveIndex(indexFile);
+
+    // The index brings its features with it
+    ImageMatcher matcher;
+    matcher.LoadIndex(indexFile);
+
+    ExpectAllQueriesMatch(matcher);
+
+    std::remove(indexFile.c_str());
+}
+
+TEST_F(ImageMatcherTest, FindBestMatchWithCompactDescriptors)
+{
+    std::string indexFile("ImageMatcherTest.int8.idx");
+
+    DescriptorStorage storages[] = { STORAGE_INT8, STORAGE_FLOAT16 };
+    for (int s = 0; s < 2; ++s)
+    {
+        ImageMatcher matcher;
+        matcher.SetDescriptorStorage(storages[s]);
+        matcher.Train(mTrainingDir);
+
+        ExpectAllQueriesMatch(matcher);
+
+        if (storages[s] == STORAGE_INT8)
+            matcher.SaveIndex(indexFile);
+    }
+
+    // The codes and their scales are loaded as they were saved
+    ImageMatcher loaded;
+    loaded.LoadIndex(indexFile);
+
+    ExpectAllQueriesMatch(loaded);
+
+    std::remove(indexFile.c_str());
+}
+
+TEST_F(ImageMatcherTest, FindBestMatchWithDecodePolicy)
+{
+    DecodePolicy policy(400, true);
+
+    cv::Mat image = ImageReader::LoadImage(mQueryDir + mQueryNames[0], policy);
+    ASSERT_EQ (1, image.channels());
+    ASSERT_LE (std::max(image.rows, image.cols), policy.maxDimension);
+
+    ImageMatcher matcher;
+    matcher.SetDecodePolicy(policy);
+    matcher.Train(mTrainingDir);
+
+    ExpectAllQueriesMatch(matcher);
+}
+
+TEST_F(ImageMatcherTest, FindBestMatchWithEarlyExit)
+{
+    const int minInliers = 15;
+
+    ImageMatcher matcher;
+    matcher.SetEarlyExit(minInliers, 1.0f);
+    matcher.Train(mTrainingDir);
+
+    for (int i = 0; i < mQueryNames.size(); ++i)
+    {
+        MatchResult result;
+        cv::Mat image = ImageReader::LoadImage(mQueryDir + mQueryNames[i]);
+        matcher.FindBestMatch(image, result);
+        ASSERT_STREQ (mTrainNames[i].c_str(), result.fileName.c_str());
+        // Never stops before a competitor has been scored
+        ASSERT_GE (result.candidatesVerified,
+                   std::min<size_t>(2, mTrainNames.size()));
+        ASSERT_LE (result.candidatesVerified, mTrainNames.size());
+        if (result.candidatesVerified < mTrainNames.size())
+        {
+            ASSERT_GE (result.inliers, minInliers);
+        }
+    }
+}
+
+TEST_F(ImageMatcherTest, AddAndRemoveImages)
+{
+    ImageMatcher matcher;
+    matcher.SetCandidateCount(3);
+    matcher.Train(mTrainingDir);
+
+    // Removed images are never matched again
+    ASSERT_TRUE (matcher.RemoveImage(mTrainNames[0]));
+    ASSERT_FALSE (matcher.RemoveImage(mTrainNames[0]));
+    std::string matchName = matcher.FindBestMatch(mQueryDir + mQueryNames[0]);
+    ASSERT_STRNE (mTrainNames[0].c_str(), matchName.c_str());
+
+    // Added images are matched before the voting index is rebuilt
+    matcher.AddImage(mTrainingDir + mTrainNames[0]);
+    ASSERT_THROW (matcher.AddImage(mTrainingDir + mTrainNames[0]),
+                  ImageMatcherIOException);
+    matcher.UpdateImage(mTrainingDir + mTrainNames[1]);
+
+    ExpectAllQueriesMatch(matcher);
+}
+
+TEST_F(ImageMatcherTest, FindBestMatchWithKeypointBudget)
+{
+    const int maxKeypoints = 300;
+
+    ImageMatcher matcher;
+    matcher.SetTrainKeypointBudget(KeypointBudget(maxKeypoints, 200));
+    matcher.SetQueryKeypointBudget(KeypointBudget(2 * maxKeypoints));
+    matcher.Train(mTrainingDir);
+
+    TrainingStats stats = matcher.GetTrainingStats();
+    ASSERT_EQ (mTrainNames.size(), stats.kept.size());
+    for (size_t i = 0; i < stats.kept.size(); ++i)
+    {
+        ASSERT_LE (stats.kept[i], static_cast<size_t>(maxKeypoints));
+    }
+    ASSERT_LE (stats.totalKept, stats.totalDetected);
+
+    ExpectAllQueriesMatch(matcher);
+}
+
+TEST_F(ImageMatcherTest, StatsCountTheQueryStages)
+{
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    Stats &stats = Stats::Instance();
+    stats.Reset();
+    matcher.FindBestMatch(mQueryDir + mQueryNames[0]);
+
+    if (!Stats::Enabled())
+    {
+        ASSERT_EQ (0u, stats.GetCounter(COUNTER_QUERIES));
+        return;
+    }
+
+    ASSERT_EQ (1u, stats.GetCounter(COUNTER_QUERIES));
+    ASSERT_EQ (1u, stats.GetCounter(COUNTER_IMAGES_DECODED));
+    ASSERT_GT (stats.GetCounter(COUNTER_BYTES_DECODED), 0u);
+    ASSERT_GT (stats.GetCounter(COUNTER_KEYPOINTS), 0u);
+    ASSERT_GT (stats.GetCounter(COUNTER_INLIERS), 0u);
+    ASSERT_EQ (1u, stats.GetStageCount(STAGE_QUERY));
+    ASSERT_EQ (stats.GetCounter(COUNTER_CANDIDATES_VERIFIED),
+               stats.GetStageCount(STAGE_MATCH));
+}
+
+TEST_F(ImageMatcherTest, CompactAndSaveIndexAfterChanges)
+{
+    std::string indexFile("/tmp/paintMatcherArenaTest.idx");
+
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    // Removing more than half of the images compacts the arena, adding
+    // them back grows it again
+    size_t removed = mTrainNames.size() / 2 + 1;
+    for (size_t i = 0; i < removed; ++i)
+    {
+        ASSERT_TRUE (matcher.RemoveImage(mTrainNames[i]));
+    }
+    for (size_t i = 0; i < removed; ++i)
+    {
+        matcher.AddImage(mTrainingDir + mTrainNames[i]);
+    }
+    matcher.SaveIndex(indexFile);
+
+    ImageMatcher loaded;
+    loaded.LoadIndex(indexFile);
+    std::remove(indexFile.c_str());
+
+    ExpectAllQueriesMatch(matcher);
+    ExpectAllQueriesMatch(loaded);
+}
+
+
+TEST_F(ImageMatcherTest, FindBestMatchAcrossShards)
+{
+    const unsigned int shardCount = 3;
+
+    ImageMatcher whole;
+    whole.Train(mTrainingDir);
+
+    // Every shard is served by its own matcher, as by a worker process
+    std::vector<boost::shared_ptr<ImageMatcher> > shards;
+    std::vector<boost::shared_ptr<MatchServer> > servers, retired;
+    std::vector<std::string> sockets;
+    boost::thread_group threads;
+    size_t shardImages = 0;
+    for (unsigned int s = 0; s < shardCount; ++s)
+    {
+        std::ostringstream socket;
+        socket << "/tmp/paintMatcherShardTest" << s << ".sock";
+        sockets.push_back(socket.str());
+
+        shards.push_back(boost::shared_ptr<ImageMatcher>(new ImageMatcher()));
+        shards[s]->SetShard(s, shardCount);
+        shards[s]->Train(mTrainingDir);
+        shardImages += shards[s]->GetTrainingStats().fileNames.size();
+
+        servers.push_back(boost::shared_ptr<MatchServer>(
+                new MatchServer(*shards[s], sockets[s])));
+        threads.add_thread(new boost::thread(&MatchServer::Run,
+                                             servers[s].get()));
+    }
+    ASSERT_EQ (mTrainNames.size(), shardImages);
+
+    {
+        ImageMatcher extractor;
+        ShardCoordinator coordinator(extractor, sockets);
+
+        for (int i = 0; i < mQueryNames.size(); ++i)
+        {
+            float expected, confidence;
+            whole.FindBestMatch(mQueryDir + mQueryNames[i], expected);
+            std::string matchName = coordinator.FindBestMatch(
+                    mQueryDir + mQueryNames[i], confidence);
+            ASSERT_STREQ (mTrainNames[i].c_str(), matchName.c_str());
+            EXPECT_NEAR (expected, confidence, 1e-4);
+        }
+
+        // A shard that goes away fails the query, without leaving the
+        // other connections out of step once it is back
+        servers[0]->Stop();
+        float confidence;
+        EXPECT_THROW (coordinator.FindBestMatch(mQueryDir + mQueryNames[0],
+                                                confidence),
+                      ShardCoordinatorIOException);
+
+        retired.push_back(servers[0]);
+        servers[0].reset(new MatchServer(*shards[0], sockets[0]));
+        threads.add_thread(new boost::thread(&MatchServer::Run,
+                                             servers[0].get()));
+        for (int i = 0; i < mQueryNames.size(); ++i)
+        {
+            std::string matchName = coordinator.FindBestMatch(
+                    mQueryDir + mQueryNames[i], confidence);
+            ASSERT_STREQ (mTrainNames[i].c_str(), matchName.c_str());
+        }
+    }
+
+    for (unsigned int s = 0; s < shardCount; ++s)
+        servers[s]->Interrupt();
+    threads.join_all();
+}
+
+
+TEST_F(ImageMatcherTest, ServerRejectsBadRequestsAndStops)
+{
+    const std::string socketPath("/tmp/paintMatcherServerTest.sock");
+
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    MatchServer server(matcher, socketPath);
+    boost::thread running(&MatchServer::Run, &server);
+
+    // A size that cannot be honoured is answered, then the connection ends
+    UnixSocket client;
+    client.Connect(socketPath);
+    client.Write("IMAGE 99999999999\n");
+    std::string answer;
+    ASSERT_TRUE (client.ReadLine(answer));
+    EXPECT_EQ (0u, answer.find("ERR "));
+    EXPECT_FALSE (client.ReadLine(answer));
+
+    // An idle client does not keep Stop() waiting. The first answer
+    // tells that its thread is serving it.
+    UnixSocket idle;
+    idle.Connect(socketPath);
+    idle.Write("PING\n");
+    ASSERT_TRUE (idle.ReadLine(answer));
+    server.Stop();
+    running.join();
+    EXPECT_FALSE (idle.ReadLine(answer));
+}
+
+
+TEST_F(ImageMatcherTest, TrackFrames)
+{
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    // Every query stands for a few frames showing the same painting
+    const unsigned int framesPerShot = 4;
+    FrameTracker tracker(matcher, 15, 0);
+
+    for (int i = 0; i < mQueryNames.size(); ++i)
+    {
+        cv::Mat frame = ImageReader::LoadImage(mQueryDir + mQueryNames[i]);
+        for (unsigned int f = 0; f < framesPerShot; ++f)
+        {
+            MatchResult result;
+            bool tracked = tracker.Track(frame, result);
+            ASSERT_STREQ (mTrainNames[i].c_str(), result.fileName.c_str());
+            if (f > 0)
+            {
+                EXPECT_TRUE (tracked);
+            }
+        }
+    }
+
+    // The dataset is searched once per painting only
+    EXPECT_EQ (mQueryNames.size(), tracker.GetSearchCount());
+    EXPECT_EQ (mQueryNames.size() * framesPerShot, tracker.GetFrameCount());
+}
+
+
+TEST_F(ImageMatcherTest, FindBestMatchWithEveryFilter)
+{
+    const MatchFilterType filters[] =
+        { FILTER_MUTUAL, FILTER_RATIO, FILTER_MUTUAL_CACHED };
+
+    for (int f = 0; f < 3; ++f)
+    {
+        ImageMatcher matcher;
+        matcher.SetMatchFilter(MatchFilter(filters[f]));
+        matcher.Train(mTrainingDir);
+
+        SCOPED_TRACE (MatchFilter::GetTypeName(filters[f]));
+        ExpectAllQueriesMatch(matcher);
+    }
+}
+
+
+TEST_F(ImageMatcherTest, RepeatedQueriesReuseTheirBuffers)
+{
+    // The ratio test searches the training indices only, which are built
+    // once, so the repeated queries find the very same neighbours
+    ImageMatcher matcher;
+    matcher.SetMatchFilter(MatchFilter(FILTER_RATIO));
+    matcher.Train(mTrainingDir);
+
+    std::vector<cv::Mat> images;
+    std::vector<MatchResult> first(mQueryNames.size());
+    for (int i = 0; i < mQueryNames.size(); ++i)
+    {
+        images.push_back(ImageReader::LoadImage(mQueryDir + mQueryNames[i]));
+        matcher.FindBestMatch(images[i], first[i]);
+        ASSERT_STREQ (mTrainNames[i].c_str(), first[i].fileName.c_str());
+    }
+
+    // A query restricted to one candidate leaves shorter buffers behind
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    matcher.ExtractFeatures(images[0], keypoints, descriptors);
+    std::vector<int> only(1, first[0].index);
+    MatchResult restricted;
+    matcher.MatchFeatures(keypoints, descriptors, restricted, &only);
+    EXPECT_EQ (1u, restricted.candidatesVerified);
+
+    // The same queries again, in reverse order and into the same result,
+    // give the same answers as the first time
+    MatchResult result;
+    for (int i = mQueryNames.size() - 1; i >= 0; --i)
+    {
+        matcher.FindBestMatch(images[i], result);
+        EXPECT_STREQ (first[i].fileName.c_str(), result.fileName.c_str());
+        EXPECT_EQ (first[i].candidatesVerified, result.candidatesVerified);
+        EXPECT_EQ (first[i].inliers, result.inliers);
+        EXPECT_FLOAT_EQ (first[i].distance, result.distance);
+        EXPECT_FLOAT_EQ (first[i].secondDistance, result.secondDistance);
+        EXPECT_FALSE (result.homography.empty());
+    }
+}
+
+
+TEST_F(ImageMatcherTest, SubmitQueriesAsynchronously)
+{
+    ImageMatcher matcher;
+    matcher.Train(mTrainingDir);
+
+    std::vector<cv::Mat> images;
+    for (int i = 0; i < mQueryNames.size(); ++i)
+        images.push_back(ImageReader::LoadImage(mQueryDir + mQueryNames[i]));
+
+    {
+        // Room for every query: all of them are answered
+        AsyncMatcher async(matcher, 2, images.size());
+        std::vector<boost::shared_future<MatchResult> > futures;
+        for (int i = 0; i < images.size(); ++i)
+            futures.push_back(async.Submit(images[i]));
+
+        for (int i = 0; i < futures.size(); ++i)
+        {
+            const MatchResult &result = futures[i].get();
+            EXPECT_TRUE (result.error.empty()) << result.error;
+            EXPECT_STREQ (mTrainNames[i].c_str(), result.fileName.c_str());
+        }
+        EXPECT_EQ (0u, async.GetRejectedCount());
+    }
+
+    {
+        // A burst larger than one running and one waiting query: the
+        // rest is rejected at once, and every query gets an answer
+        AsyncMatcher async(matcher, 1, 1);
+        std::vector<boost::shared_future<MatchResult> > futures;
+        for (int r = 0; r < 4; ++r)
+        {
+            for (int i = 0; i < images.size(); ++i)
+                futures.push_back(async.Submit(images[i]));
+        }
+
+        unsigned long rejected = 0;
+        for (int f = 0; f < futures.size(); ++f)
+        {
+            const MatchResult &result = futures[f].get();
+            if (!result.error.empty())
+            {
+                EXPECT_EQ (-1, result.index);
+                rejected++;
+            }
+            else
+            {
+                EXPECT_STREQ (mTrainNames[f % images.size()].c_str(),
+                              result.fileName.c_str());
+            }
+        }
+        EXPECT_GT (rejected, 0u);
+        EXPECT_EQ (rejected, async.GetRejectedCount());
+        EXPECT_EQ (futures.size(), async.GetSubmittedCount());
+    }
+
+    {
+        // With a tiny deadline, the queries queued behind a running one
+        // expire instead of being matched
+        AsyncMatcher async(matcher, 1, images.size() * 2, 1);
+        std::vector<boost::shared_future<MatchResult> > futures;
+        for (int r = 0; r < 2; ++r)
+        {
+            for (int i = 0; i < images.size(); ++i)
+                futures.push_back(async.Submit(images[i]));
+        }
+
+        for (int f = 0; f < futures.size(); ++f)
+            futures[f].wait();
+        EXPECT_GT (async.GetExpiredCount(), 0u);
+        EXPECT_EQ (0u, async.GetRejectedCount());
+    }
+}
+
+
+TEST_F(ImageMatcherTest, CacheRepeatedQueries)
+{
+    ImageMatcher matcher;
+    matcher.SetResultCache(2, 4);
+    matcher.Train(mTrainingDir);
+
+    cv::Mat first = ImageReader::LoadImage(mQueryDir + mQueryNames[0]);
+    cv::Mat second = ImageReader::LoadImage(mQueryDir + mQueryNames[1]);
+    cv::Mat third = ImageReader::LoadImage(mQueryDir + mQueryNames[2]);
+
+    MatchResult computed, cached;
+    matcher.FindBestMatch(first, computed);
+    matcher.FindBestMatch(first, cached);
+    ASSERT_STREQ (mTrainNames[0].c_str(), computed.fileName.c_str());
+    EXPECT_STREQ (computed.fileName.c_str(), cached.fileName.c_str());
+    EXPECT_FLOAT_EQ (computed.confidence, cached.confidence);
+
+    ResultCacheStats stats = matcher.GetResultCacheStats();
+    EXPECT_EQ (1u, stats.hits);
+    EXPECT_EQ (0u, stats.nearHits);
+    EXPECT_EQ (1u, stats.misses);
+
+    // The same photo saved again with a lower quality is a near hit
+    std::vector<uchar> buffer;
+    std::vector<int> parameters;
+    parameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+    parameters.push_back(70);
+    cv::imencode(".jpg", first, buffer, parameters);
+    cv::Mat recompressed = cv::imdecode(cv::Mat(buffer), CV_LOAD_IMAGE_COLOR);
+
+    ImageHash a, b;
+    ResultCache::Hash(first, a);
+    ResultCache::Hash(recompressed, b);
+    EXPECT_NE (a.content, b.content);
+
+    matcher.FindBestMatch(recompressed, cached);
+    EXPECT_STREQ (mTrainNames[0].c_str(), cached.fileName.c_str());
+    stats = matcher.GetResultCacheStats();
+    EXPECT_EQ (2u, stats.hits);
+    EXPECT_EQ (1u, stats.nearHits);
+
+    // Two more paintings push the least recently used one out
+    matcher.FindBestMatch(second, computed);
+    matcher.FindBestMatch(third, computed);
+    EXPECT_STREQ (mTrainNames[2].c_str(), computed.fileName.c_str());
+    stats = matcher.GetResultCacheStats();
+    EXPECT_EQ (1u, stats.evictions);
+    EXPECT_EQ (2u, stats.size);
+
+    matcher.FindBestMatch(first, computed);
+    EXPECT_EQ (4u, matcher.GetResultCacheStats().misses);
+
+    // A dataset change drops every result
+    matcher.RemoveImage(mTrainNames[0]);
+    stats = matcher.GetResultCacheStats();
+    EXPECT_EQ (1u, stats.invalidations);
+    EXPECT_EQ (0u, stats.size);
+
+    matcher.FindBestMatch(first, computed);
+    EXPECT_STRNE (mTrainNames[0].c_str(), computed.fileName.c_str());
+    EXPECT_EQ (5u, matcher.GetResultCacheStats().misses);
+}
+
+TEST_F(ImageMatcherTest, PrefilterBySignature)
+{
+    std::string indexFile("ImageMatcherTest.idx");
+
+    ImageMatcher matcher;
+    matcher.SetPrefilter(1);
+    matcher.Train(mTrainingDir);
+
+    // Every training image looks most like itself, and is the only one
+    // verified when the prefilter keeps one image
+    std::vector<int> ranking;
+    for (int i = 0; i < mTrainNames.size(); ++i)
+    {
+        cv::Mat image = ImageReader::LoadImage(mTrainingDir + mTrainNames[i]);
+        matcher.RankBySignature(image, ranking);
+        ASSERT_EQ (mTrainNames.size(), ranking.size());
+        EXPECT_EQ (i, ranking[0]);
+
+        MatchResult result;
+        matcher.FindBestMatch(image, result);
+        EXPECT_STREQ (mTrainNames[i].c_str(), result.fileName.c_str());
+        EXPECT_EQ (1u, result.candidatesVerified);
+    }
+
+    // The signatures are saved with the index
+    cv::Mat query = ImageReader::LoadImage(mTrainingDir + mTrainNames[0]);
+    matcher.SaveIndex(indexFile);
+    ImageMatcher loaded;
+    loaded.LoadIndex(indexFile);
+    std::vector<int> loadedRanking;
+    matcher.RankBySignature(query, ranking);
+    loaded.RankBySignature(query, loadedRanking);
+    EXPECT_EQ (ranking, loadedRanking);
+    std::remove(indexFile.c_str());
+
+    // Removed images are not ranked
+    matcher.RemoveImage(mTrainNames[0]);
+    matcher.RankBySignature(query, ranking);
+    ASSERT_EQ (mTrainNames.size() - 1, ranking.size());
+    EXPECT_EQ (ranking.end(), std::find(ranking.begin(), ranking.end(), 0));
+}
+
+
+static std::vector<unsigned char>
+ReadFile(const std::string &fileName)
+{
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    return std::vector<unsigned char>(std::istreambuf_iterator<char>(file),
+                                      std::istreambuf_iterator<char>());
+}
+
+/**
+ * Write files into a ustar archive, under a "paintings" directory.
+ */
+static void
+WriteTar(const std::string &archiveFile, const std::string &directory,
+         const std::vector<std::string> &names)
+{
+    std::ofstream out(archiveFile.c_str(), std::ios::binary);
+    const char zeros[1024] = { 0 };
+
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        std::vector<unsigned char> data = ReadFile(directory + names[i]);
+        std::string path = "paintings/" + names[i];
+
+        char header[512] = { 0 };
+        memcpy(header, path.c_str(), std::min<size_t>(path.size(), 99));
+        sprintf(header + 100, "%07o", 0644);
+        sprintf(header + 108, "%07o", 0);
+        sprintf(header + 116, "%07o", 0);
+        sprintf(header + 124, "%011lo", (unsigned long)data.size());
+        sprintf(header + 136, "%011o", 0);
+        header[156] = '0';
+        memcpy(header + 257, "ustar", 6);
+        memcpy(header + 263, "00", 2);
+
+        memset(header + 148, ' ', 8);
+        unsigned int sum = 0;
+        for (int k = 0; k < 512; ++k)
+            sum += (unsigned char)header[k];
+        sprintf(header + 148, "%06o", sum);
+
+        out.write(header, sizeof(header));
+        out.write((const char *)&data[0], data.size());
+        out.write(zeros, (512 - data.size() % 512) % 512);
+    }
+    out.write(zeros, sizeof(zeros));
+}
+
+
+TEST_F(ImageMatcherTest, TrainAndMatchFromMemory)
+{
+    std::string trainArchive("ImageMatcherTest.tar");
+    std::string queryArchive("ImageMatcherTestQueries.tar");
+
+    // Training images received as buffers, given in reverse order
+    std::vector<std::vector<unsigned char> > files;
+    for (int i = 0; i < mTrainNames.size(); ++i)
+        files.push_back(ReadFile(mTrainingDir + mTrainNames[i]));
+    std::vector<ImageBuffer> buffers;
+    for (int i = mTrainNames.size() - 1; i >= 0; --i)
+        buffers.push_back(ImageBuffer(mTrainNames[i], &files[i][0],
+                                      files[i].size()));
+
+    ImageReader images;
+    images.SetBuffers(buffers);
+    ASSERT_EQ (mTrainNames, images.GetFileNames());
+
+    ImageMatcher matcher;
+    matcher.Train(images);
+
+    for (int i = 0; i < mQueryNames.size(); ++i)
+    {
+        std::vector<unsigned char> query = ReadFile(mQueryDir + mQueryNames[i]);
+        MatchResult result;
+        matcher.FindBestMatch(&query[0], query.size(), result);
+        ASSERT_STREQ (mTrainNames[i].c_str(), result.fileName.c_str());
+    }
+
+    // The same sets as archives, decoded from their mapping
+    WriteTar(trainArchive, mTrainingDir, mTrainNames);
+    WriteTar(queryArchive, mQueryDir, mQueryNames);
+
+    ImageMatcher archived;
+    archived.Train(trainArchive);
+    std::vector<std::string> archivedNames =
+        archived.GetTrainingStats().fileNames;
+    ASSERT_EQ (mTrainNames.size(), archivedNames.size());
+    EXPECT_EQ ("paintings/" + mTrainNames[0], archivedNames[0]);
+
+    ImageReader queries;
+    queries.OpenArchive(queryArchive);
+    std::vector<MatchResult> results = archived.FindBestMatches(queries);
+    ASSERT_EQ (mQueryNames.size(), results.size());
+    for (int i = 0; i < results.size(); ++i)
+    {
+        EXPECT_TRUE (results[i].error.empty());
+        EXPECT_EQ ("paintings/" + mTrainNames[i], results[i].fileName);
+    }
+
+    std::remove(trainArchive.c_str());
+    std::remove(queryArchive.c_str());
+}
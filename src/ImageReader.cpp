@@ -9,10 +9,357 @@
  */
 
 #include "ImageReader.h"
+#include "Stats.h"
 
+#include <stdio.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <algorithm>
+#include <fstream>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+namespace
+{
+
+bool
+IsDefault(const DecodePolicy &policy)
+{
+    return policy.maxDimension <= 0 && !policy.grayscale;
+}
+
+bool
+IsJpeg(const unsigned char *data, size_t size)
+{
+    return size >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff;
+}
+
+struct JpegErrorManager
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void
+JpegErrorExit(j_common_ptr cinfo)
+{
+    JpegErrorManager *err = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+    longjmp(err->jump, 1);
+}
+
+void
+JpegSilence(j_common_ptr)
+{
+}
+
+/**
+ * Decode a JPEG with the smallest IDCT scaling that still covers the
+ * requested dimension. Returns false if libjpeg cannot decode it (e.g.
+ * CMYK to grayscale), the caller then falls back to OpenCV.
+ *
+ * libjpeg reports errors with longjmp, so the image lives in the
+ * caller's frame and nothing in this one needs a destructor.
+ */
+bool
+DecodeJpeg(const unsigned char *data, size_t size, const DecodePolicy &policy,
+           cv::Mat &image)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager err;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = JpegErrorExit;
+    err.pub.output_message = JpegSilence;
+
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        image.release();
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // Grayscale decodes the luma only, chroma is never upsampled
+    cinfo.out_color_space = policy.grayscale ? JCS_GRAYSCALE : JCS_RGB;
+
+    if (policy.maxDimension > 0)
+    {
+        // Output dimensions are rounded up by libjpeg
+        unsigned int largest = std::max(cinfo.image_width, cinfo.image_height);
+        unsigned int denom = 1;
+        while (denom < 8 && (largest + 2 * denom - 1) / (2 * denom) >=
+                static_cast<unsigned int>(policy.maxDimension))
+            denom *= 2;
+
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = denom;
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    image.create(cinfo.output_height, cinfo.output_width,
+                 cinfo.output_components == 1 ? CV_8UC1 : CV_8UC3);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = image.ptr(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    if (image.channels() == 3)
+        cv::cvtColor(image, image, CV_RGB2BGR);
+
+    return true;
+}
+
+/**
+ * Scale the image down so that it fits the policy.
+ */
+void
+Shrink(cv::Mat &image, const DecodePolicy &policy)
+{
+    int largest = std::max(image.rows, image.cols);
+    if (policy.maxDimension <= 0 || largest <= policy.maxDimension)
+        return;
+
+    double scale = static_cast<double>(policy.maxDimension) / largest;
+    cv::Mat resized;
+    cv::resize(image, resized, cv::Size(), scale, scale, cv::INTER_AREA);
+    image = resized;
+}
+
+int
+LoadFlags(const DecodePolicy &policy)
+{
+    return policy.grayscale ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR;
+}
+
+/**
+ * Read an image file according to the policy, an empty image on error.
+ */
+cv::Mat
+ReadImage(const std::string &fileName, const DecodePolicy &policy)
+{
+    if (IsDefault(policy))
+        return cv::imread(fileName, CV_LOAD_IMAGE_COLOR);
+
+    cv::Mat image;
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    unsigned char magic[3] = { 0, 0, 0 };
+    file.read(reinterpret_cast<char *>(magic), sizeof(magic));
+
+    if (file && IsJpeg(magic, sizeof(magic)))
+    {
+        file.seekg(0, std::ios::end);
+        std::vector<unsigned char> data(static_cast<size_t>(file.tellg()));
+        file.seekg(0, std::ios::beg);
+        file.read(reinterpret_cast<char *>(&data[0]), data.size());
+
+        if (file)
+            DecodeJpeg(&data[0], data.size(), policy, image);
+    }
+
+    if (!image.data)
+        image = cv::imread(fileName, LoadFlags(policy));
+
+    if (image.data)
+        Shrink(image, policy);
+
+    return image;
+}
+
+/**
+ * Header of a tar member, as laid out by POSIX ustar; older archives
+ * have the same fields up to linkName.
+ */
+struct TarHeader
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkName[100];
+    char magic[6];
+    char version[2];
+    char userName[32];
+    char groupName[32];
+    char deviceMajor[8];
+    char deviceMinor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+const size_t TAR_BLOCK = 512;
+
+/**
+ * Read an octal field, space or NUL terminated.
+ */
+bool
+ParseOctal(const char *field, size_t length, uint64_t &value)
+{
+    size_t i = 0;
+    while (i < length && field[i] == ' ')
+        ++i;
+
+    value = 0;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = value * 8 + (field[i] - '0');
+
+    return i == length || field[i] == '\0' || field[i] == ' ';
+}
+
+std::string
+FieldString(const char *field, size_t length)
+{
+    return std::string(field, std::find(field, field + length, '\0'));
+}
+
+/**
+ * The checksum is the sum of the header bytes, its own field counting
+ * as spaces.
+ */
+bool
+HasValidChecksum(const TarHeader &header)
+{
+    uint64_t expected;
+    if (!ParseOctal(header.checksum, sizeof(header.checksum), expected))
+        return false;
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&header);
+    const size_t first = offsetof(TarHeader, checksum);
+    const size_t last = first + sizeof(header.checksum);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+        sum += (i >= first && i < last) ? ' ' : bytes[i];
+
+    return sum == expected;
+}
+
+/**
+ * The path record of a pax extended header, empty if none. Records read
+ * "<length> <key>=<value>\n", the length counting the whole record.
+ */
+std::string
+PaxPath(const char *data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t length = 0;
+        size_t i = pos;
+        while (i < size && data[i] >= '0' && data[i] <= '9')
+            length = length * 10 + (data[i++] - '0');
+
+        if (i >= size || data[i] != ' ' || length <= i + 1 - pos ||
+                length > size - pos)
+            break;
+
+        std::string record(data + i + 1, data + pos + length - 1);
+        if (record.compare(0, 5, "path=") == 0)
+            return record.substr(5);
+
+        pos += length;
+    }
+    return "";
+}
+
+/**
+ * List the images among the regular files of a tar archive in memory.
+ */
+void
+ListArchive(const char *data, size_t size, const std::string &archiveFile,
+            std::vector<ImageBuffer> &members)
+{
+    // Name given by the extension header of the next member
+    std::string longName;
+
+    size_t offset = 0;
+    while (offset + TAR_BLOCK <= size)
+    {
+        const TarHeader *header =
+            reinterpret_cast<const TarHeader *>(data + offset);
+
+        // The archive ends with zero blocks
+        if (header->name[0] == '\0')
+            break;
+
+        uint64_t length;
+        if (!HasValidChecksum(*header) ||
+                !ParseOctal(header->size, sizeof(header->size), length))
+            throw ImageReaderIOException("Not a tar archive: " + archiveFile);
+
+        const size_t begin = offset + TAR_BLOCK;
+        if (length > size - begin)
+            throw ImageReaderIOException("Archive is truncated: " + archiveFile);
+        const char *content = data + begin;
+
+        switch (header->type)
+        {
+        case 'L':
+            // GNU long name
+            longName = FieldString(content, length);
+            break;
+        case 'x':
+            longName = PaxPath(content, length);
+            break;
+        case '0':
+        case '\0':
+        case '7':
+        {
+            std::string name = longName;
+            if (name.empty())
+            {
+                name = FieldString(header->name, sizeof(header->name));
+                if (memcmp(header->magic, "ustar", 5) == 0 &&
+                        header->prefix[0] != '\0')
+                    name = FieldString(header->prefix, sizeof(header->prefix)) +
+                           "/" + name;
+            }
+            if (name.compare(0, 2, "./") == 0)
+                name.erase(0, 2);
+
+            if (ImageReader::IsSupported(name))
+                members.push_back(ImageBuffer(
+                        name, reinterpret_cast<const unsigned char *>(content),
+                        length));
+            longName.clear();
+            break;
+        }
+        default:
+            // Directories, links, global headers
+            longName.clear();
+            break;
+        }
+
+        offset = begin + (length + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+}
+
+bool
+NameBefore(const ImageBuffer &a, const ImageBuffer &b)
+{
+    return a.name < b.name;
+}
+
+} // namespace
 
 ImageReader::ImageReader() :
     mLastImageIndex(0)
@@ -29,16 +376,21 @@ ImageReader::ImageReader(const std::string &imageDirectory) :
 }
 
 cv::Mat
-ImageReader::LoadImage (const std::string &fileName)
+ImageReader::LoadImage (const std::string &fileName,
+                        const DecodePolicy &policy)
 {
     cv::Mat image;
     namespace fs = boost::filesystem;
+    STATS_TIMER(timer, STAGE_DECODE);
 
     if (fs::exists(fileName) && fs::is_regular_file(fileName))
     {
-        image = cv::imread(fileName, CV_LOAD_IMAGE_COLOR);
+        image = ReadImage(fileName, policy);
         if (!image.data)
             throw ImageReaderIOException("Canot load image: " + fileName);
+
+        STATS_ADD(COUNTER_IMAGES_DECODED, 1);
+        STATS_ADD(COUNTER_BYTES_DECODED, fs::file_size(fileName));
     }
     else
     {
@@ -48,6 +400,36 @@ ImageReader::LoadImage (const std::string &fileName)
     return image;
 }
 
+cv::Mat
+ImageReader::DecodeImage (const unsigned char *data, size_t size,
+                          const DecodePolicy &policy)
+{
+    if (size == 0)
+        throw ImageReaderIOException("Empty image buffer");
+
+    STATS_TIMER(timer, STAGE_DECODE);
+    cv::Mat image;
+    if (!IsDefault(policy) && IsJpeg(data, size))
+        DecodeJpeg(data, size, policy, image);
+
+    if (!image.data)
+    {
+        // Wrap the buffer without copying it
+        cv::Mat buffer(1, static_cast<int>(size), CV_8U,
+                       const_cast<unsigned char *>(data));
+
+        image = cv::imdecode(buffer, LoadFlags(policy));
+        if (!image.data)
+            throw ImageReaderIOException("Cannot decode image buffer");
+    }
+
+    Shrink(image, policy);
+
+    STATS_ADD(COUNTER_IMAGES_DECODED, 1);
+    STATS_ADD(COUNTER_BYTES_DECODED, size);
+    return image;
+}
+
 void
 ImageReader::operator() (const std::string &imageDirectory)
 {
@@ -57,31 +439,150 @@ ImageReader::operator() (const std::string &imageDirectory)
     if (fs::exists(inputDir) && fs::is_directory(inputDir))
     {
         mFileNames.clear();
+        mBuffers.clear();
+        mOwner.reset();
+        mLastImageIndex = 0;
         fs::directory_iterator end, it(inputDir);
 
         mFilesPath = it->path().parent_path().string() + "/";
 
         for (; it != end; ++it)
         {
-            // File types must be supported by OpenCV
-            /// @todo There should be a bettwer way to check
-            /// file type/extension
-            if (it->path().extension() == ".tiff" ||
-                    it->path().extension() == ".JPG" ||
-                    it->path().extension() == ".jpg")
-            {
+            if (IsSupported(it->path().string()))
                 mFileNames.push_back(it->path().filename().string());
-            }
         }
 
         std::sort(mFileNames.begin(), mFileNames.end());
     }
+    else if (fs::is_regular_file(inputDir) && IsArchive(imageDirectory))
+    {
+        OpenArchive(imageDirectory);
+    }
     else
     {
         throw ImageReaderIOException("No such directory: " + imageDirectory);
     }
 }
 
+void
+ImageReader::SetBuffers(const std::vector<ImageBuffer> &buffers,
+                        const boost::shared_ptr<const void> &owner)
+{
+    // Only the names are copied, never the encoded images
+    std::vector<ImageBuffer> sorted(buffers);
+    std::stable_sort(sorted.begin(), sorted.end(), NameBefore);
+
+    mFileNames.clear();
+    for (size_t i = 0; i < sorted.size(); ++i)
+        mFileNames.push_back(sorted[i].name);
+
+    mBuffers.swap(sorted);
+    mOwner = owner;
+    mFilesPath.clear();
+    mLastImageIndex = 0;
+}
+
+void
+ImageReader::OpenArchive(const std::string &archiveFile)
+{
+    namespace ipc = boost::interprocess;
+    boost::shared_ptr<ipc::mapped_region> region;
+
+    try
+    {
+        ipc::file_mapping mapping(archiveFile.c_str(), ipc::read_only);
+        region.reset(new ipc::mapped_region(mapping, ipc::read_only));
+    }
+    catch (const ipc::interprocess_exception &ex)
+    {
+        throw ImageReaderIOException("Cannot map archive " + archiveFile +
+                                     ": " + ex.what());
+    }
+
+    std::vector<ImageBuffer> members;
+    ListArchive(static_cast<const char *>(region->get_address()),
+                region->get_size(), archiveFile, members);
+
+    SetBuffers(members, region);
+}
+
+bool
+ImageReader::IsSupported(const std::string &fileName)
+{
+    // File types must be supported by OpenCV
+    /// @todo There should be a bettwer way to check
+    /// file type/extension
+    namespace fs = boost::filesystem;
+    fs::path extension = fs::path(fileName).extension();
+    return extension == ".tiff" || extension == ".JPG" || extension == ".jpg";
+}
+
+bool
+ImageReader::IsArchive(const std::string &fileName)
+{
+    namespace fs = boost::filesystem;
+    return fs::path(fileName).extension() == ".tar";
+}
+
+void
+ImageReader::Conform(cv::Mat &image, const DecodePolicy &policy)
+{
+    if (policy.grayscale && image.channels() == 3)
+    {
+        cv::Mat gray;
+        cv::cvtColor(image, gray, CV_BGR2GRAY);
+        image = gray;
+    }
+
+    Shrink(image, policy);
+}
+
+unsigned int
+ImageReader::ShardOf(const std::string &fileName, unsigned int shardCount)
+{
+    // FNV-1a, stable across runs and platforms unlike std::hash
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < fileName.size(); ++i)
+    {
+        hash ^= static_cast<unsigned char>(fileName[i]);
+        hash *= 16777619u;
+    }
+
+    return shardCount > 1 ? hash % shardCount : 0;
+}
+
+void
+ImageReader::KeepShard(unsigned int shard, unsigned int shardCount)
+{
+    std::vector<std::string> kept;
+    std::vector<ImageBuffer> keptBuffers;
+    for (size_t i = 0; i < mFileNames.size(); ++i)
+    {
+        if (ShardOf(mFileNames[i], shardCount) == shard)
+        {
+            kept.push_back(mFileNames[i]);
+            if (!mBuffers.empty())
+                keptBuffers.push_back(mBuffers[i]);
+        }
+    }
+
+    mFileNames.swap(kept);
+    mBuffers.swap(keptBuffers);
+    mLastImageIndex = 0;
+}
+
+void
+ImageReader::SetDecodePolicy(const DecodePolicy &policy)
+{
+    mPolicy = policy;
+}
+
+const DecodePolicy&
+ImageReader::GetDecodePolicy() const
+{
+    return mPolicy;
+}
+
 const std::vector<std::string>&
 ImageReader::GetFileNames() const
 {
@@ -92,11 +593,9 @@ std::vector<cv::Mat>
 ImageReader::LoadAllImages() const
 {
     std::vector<cv::Mat> imageSet;
-    typedef std::vector<std::string>::const_iterator fileIt;
-
-    for (fileIt it = mFileNames.begin(); it != mFileNames.end(); ++it)
+    for (size_t i = 0; i < mFileNames.size(); ++i)
     {
-        cv::Mat image = cv::imread(mFilesPath + *it, CV_LOAD_IMAGE_COLOR);
+        cv::Mat image = Read(i);
         if (image.data)
             imageSet.push_back(image);
     }
@@ -115,8 +614,7 @@ ImageReader::LoadNextImage()
         throw ImageReaderIOException("No more images to be loaded");
     }
 
-    cv::Mat image = cv::imread(mFilesPath + mFileNames[mLastImageIndex],
-                               CV_LOAD_IMAGE_COLOR);
+    cv::Mat image = Read(mLastImageIndex);
 
     if (!image.data)
         throw ImageReaderIOException("Could not open image");
@@ -126,12 +624,12 @@ ImageReader::LoadNextImage()
 }
 
 cv::Mat
-ImageReader::LoadImage (unsigned int i)
+ImageReader::LoadImage (unsigned int i) const
 {
     if (i >= mFileNames.size())
         throw ImageReaderIOException("Index exceeds number of images");
 
-    cv::Mat image = cv::imread(mFilesPath + mFileNames[i], CV_LOAD_IMAGE_COLOR);
+    cv::Mat image = Read(i);
 
     if (!image.data)
         throw ImageReaderIOException("Could not open image");
@@ -139,3 +637,19 @@ ImageReader::LoadImage (unsigned int i)
     return image;
 }
 
+cv::Mat
+ImageReader::Read (size_t i) const
+{
+    if (mBuffers.empty())
+        return ReadImage(mFilesPath + mFileNames[i], mPolicy);
+
+    try
+    {
+        return DecodeImage(mBuffers[i].data, mBuffers[i].size, mPolicy);
+    }
+    catch (const ImageReaderIOException &)
+    {
+        return cv::Mat();
+    }
+}
+
@@ -14,8 +14,50 @@
 #include <stdexcept>
 #include <vector>
 #include <string>
+#include <boost/shared_ptr.hpp>
 #include <opencv2/core/core.hpp>
 
+/**
+ * @brief How images are decoded
+ */
+struct DecodePolicy
+{
+    DecodePolicy(int maxDimension = 0, bool grayscale = false) :
+        maxDimension(maxDimension), grayscale(grayscale) {}
+
+    /**
+     * @brief Largest width or height of the decoded image, larger images
+     * are scaled down. Zero keeps the full resolution.
+     */
+    int maxDimension;
+    /**
+     * @brief Decode to a single gray channel instead of BGR
+     */
+    bool grayscale;
+};
+
+/**
+ * @brief An encoded image held in memory, e.g. received over the network
+ * or stored in an archive
+ */
+struct ImageBuffer
+{
+    ImageBuffer(const std::string &name = "",
+                const unsigned char *data = NULL, size_t size = 0) :
+        name(name), data(data), size(size) {}
+
+    /**
+     * @brief The name of the image in the set, like a file name
+     */
+    std::string name;
+    /**
+     * @brief The encoded image (e.g. the content of a JPEG file), not
+     * owned
+     */
+    const unsigned char *data;
+    size_t size;
+};
+
 /**
  * @class ImageReader
  * @brief A helper class for loading images using OpenCV methods.
@@ -24,6 +66,22 @@
  * LoadAllImages() or LoadNextImage() is made. The rationale is to
  * save some memory by not storing all the images, unless not stricty
  * necessary.
+ *
+ * The images of a set come from a directory, from buffers already in
+ * memory or from an uncompressed tar archive. An archive is mapped, not
+ * read, and copies of a reader share the buffers; the mapping stays
+ * alive as long as one of them. JPEG members are decoded straight from
+ * the mapping, with no file opened per image and no copy of the encoded
+ * bytes. TIFF members are not: OpenCV 2.4 has no in-memory TIFF decoder,
+ * and cv::imdecode() writes each one to a temporary file and reads it
+ * back, see DecodeImage().
+ *
+ * A DecodePolicy caps the resolution and the channels of the decoded
+ * images. JPEG files are then decoded by libjpeg at 1/2, 1/4 or 1/8 of
+ * their size directly in the inverse DCT, as long as the result still
+ * covers the requested dimension, and only the luma is decoded for
+ * grayscale; the remaining factor is a resize. Other formats are fully
+ * decoded by OpenCV and resized.
  */
 class ImageReader
 {
@@ -46,9 +104,37 @@ public:
     /**
      * @brief Set the source directory that contains the images
      * @param[in] imageDirectory Name of the directory that contains the images
-     * to be loaded
+     * to be loaded, or of a tar archive (see OpenArchive())
      */
     void operator() (const std::string &imageDirectory);
+    /**
+     * @brief Use images already in memory as the set
+     * @param[in] buffers The encoded images, sorted by name as the files
+     * of a directory
+     * @param[in] owner Kept alive, and with it the buffers, as long as
+     * the reader; if NULL the buffers must outlive the reader
+     */
+    void SetBuffers(const std::vector<ImageBuffer> &buffers,
+                    const boost::shared_ptr<const void> &owner =
+                        boost::shared_ptr<const void>());
+    /**
+     * @brief Use the images of an uncompressed tar archive as the set.
+     *
+     * The archive is memory-mapped and its regular files of a supported
+     * type become the images, named by their path in the archive. POSIX
+     * ustar, GNU long names and pax paths are understood.
+     * @param[in] archiveFile Name of the archive
+     */
+    void OpenArchive(const std::string &archiveFile);
+    /**
+     * @brief Set how the images of the set are decoded
+     * @param[in] policy The decode policy, full resolution BGR by default
+     */
+    void SetDecodePolicy(const DecodePolicy &policy);
+    /**
+     * @brief Retrieve how the images of the set are decoded
+     */
+    const DecodePolicy& GetDecodePolicy() const;
     /**
      * @brief Retrieve image filenames in the source directory
      * @return A vector of filenames
@@ -67,18 +153,73 @@ public:
     /**
      * @brief Load a single image
      * @param[in] fileName Image file name
+     * @param[in] policy How to decode the image
+     * @return An image
+     */
+    static cv::Mat LoadImage (const std::string &fileName,
+                              const DecodePolicy &policy = DecodePolicy());
+    /**
+     * @brief Decode a single image from memory
+     * @note A TIFF image goes through a temporary file, which
+     * cv::imdecode() writes and reads back for the formats OpenCV 2.4
+     * cannot decode from memory. JPEG is decoded in place.
+     * @param[in] data The encoded image (e.g. the content of a JPEG file)
+     * @param[in] size Size of the encoded image in bytes
+     * @param[in] policy How to decode the image
      * @return An image
      */
-    static cv::Mat LoadImage (const std::string &fileName);
+    static cv::Mat DecodeImage (const unsigned char *data, size_t size,
+                                const DecodePolicy &policy = DecodePolicy());
+    /**
+     * @brief Bring an image decoded elsewhere, e.g. a video frame, to a
+     * policy: convert it to gray and scale it down as needed
+     * @param[in,out] image A BGR or gray image
+     * @param[in] policy The decode policy
+     */
+    static void Conform (cv::Mat &image, const DecodePolicy &policy);
+    /**
+     * @brief Check whether a file has one of the image types in a set
+     * @param[in] fileName Image file name
+     */
+    static bool IsSupported (const std::string &fileName);
+    /**
+     * @brief Check whether a file is a tar archive by its name, see
+     * OpenArchive()
+     */
+    static bool IsArchive (const std::string &fileName);
+    /**
+     * @brief The shard an image belongs to, when a dataset is split
+     * among several matchers.
+     *
+     * Depends on the file name only (not on the directory nor on the
+     * other files), so that an image added later goes to the shard that
+     * would have trained it.
+     * @param[in] fileName Image file name, without the directory
+     * @param[in] shardCount Number of shards
+     * @return A shard in [0, shardCount)
+     */
+    static unsigned int ShardOf (const std::string &fileName,
+                                 unsigned int shardCount);
+    /**
+     * @brief Keep only the images of one shard in the set
+     * @param[in] shard The shard to keep, see ShardOf()
+     * @param[in] shardCount Number of shards
+     */
+    void KeepShard (unsigned int shard, unsigned int shardCount);
     /**
      * @brief Load a single image from the set
      * @param[in] i Index of the image
      * @return An image
      */
-    cv::Mat LoadImage (unsigned int i);
+    cv::Mat LoadImage (unsigned int i) const;
 
 private:
 
+    /**
+     * @brief Decode an image of the set, an empty image on error
+     */
+    cv::Mat Read (size_t i) const;
+
     /**
      * @brief A list of image filenames
      */
@@ -87,10 +228,23 @@ private:
      * @brief The image file path
      */
     std::string mFilesPath;
+    /**
+     * @brief The encoded images, one per file name, when the set is not
+     * a directory
+     */
+    std::vector<ImageBuffer> mBuffers;
+    /**
+     * @brief What keeps the buffers alive, e.g. the archive mapping
+     */
+    boost::shared_ptr<const void> mOwner;
     /**
      * @brief The index of the last loaded image
      */
     size_t mLastImageIndex;
+    /**
+     * @brief How the images of the set are decoded
+     */
+    DecodePolicy mPolicy;
 };
 
 inline ImageReader::~ImageReader() {};
@@ -0,0 +1,182 @@
+/**
+ * @brief Tentative correspondences between two sets of descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file MatchFilter.cpp
+ */
+
+#include "MatchFilter.h"
+#include "Stats.h"
+
+#include <cfloat>
+
+MatchFilter::MatchFilter(MatchFilterType type, float ratio) :
+    mType(type),
+    mRatio(ratio)
+{
+}
+
+void
+MatchFilter::Match(const cv::Mat &query, const DescriptorIndex &queryIndex,
+                   const DescriptorIndex &trainIndex, MatchBuffers &buffers,
+                   std::vector<cv::DMatch> &matches) const
+{
+    STATS_TIMER(timer, STAGE_MATCH);
+    switch (mType)
+    {
+    case FILTER_RATIO:
+        trainIndex.KnnMatch(query, buffers.forward, buffers.second,
+                            buffers.search);
+        break;
+    case FILTER_MUTUAL_CACHED:
+        trainIndex.Match(query, buffers.forward, buffers.search);
+        SearchReverse(queryIndex, trainIndex, buffers);
+        break;
+    default:
+        trainIndex.Match(query, buffers.forward, buffers.search);
+        queryIndex.Match(trainIndex.GetDescriptors(), buffers.backward,
+                         buffers.search);
+        break;
+    }
+    STATS_STOP(timer);
+
+    if (mType == FILTER_RATIO)
+        KeepDistinct(buffers, matches);
+    else
+        KeepMutual(buffers, matches);
+}
+
+void
+MatchFilter::Match(const DescriptorQuantizer &quantizer, const cv::Mat &query,
+                   const cv::Mat &codes, MatchBuffers &buffers,
+                   std::vector<cv::DMatch> &matches) const
+{
+    STATS_TIMER(timer, STAGE_MATCH);
+    quantizer.Match(query, codes, buffers.forward, buffers.backward,
+                    mType == FILTER_RATIO ? &buffers.second : NULL);
+    STATS_STOP(timer);
+
+    if (mType == FILTER_RATIO)
+        KeepDistinct(buffers, matches);
+    else
+        KeepMutual(buffers, matches);
+}
+
+void
+MatchFilter::SearchReverse(const DescriptorIndex &queryIndex,
+                           const DescriptorIndex &trainIndex,
+                           MatchBuffers &buffers) const
+{
+    const cv::Mat &train = trainIndex.GetDescriptors();
+    std::vector<int> &slots = buffers.reverseSlots;
+    std::vector<int> &rows = buffers.reverseRows;
+
+    // Every training row reached by a forward match, once
+    slots.assign(train.rows, -1);
+    rows.clear();
+    for (size_t i = 0; i < buffers.forward.size(); ++i)
+    {
+        int t = buffers.forward[i].trainIdx;
+        if (t >= 0 && slots[t] < 0)
+        {
+            slots[t] = rows.size();
+            rows.push_back(t);
+        }
+    }
+
+    buffers.backward.assign(train.rows, cv::DMatch(0, -1, FLT_MAX));
+    if (rows.empty())
+        return;
+
+    cv::Mat &storage = buffers.reverseDescriptors;
+    if (storage.rows < static_cast<int>(rows.size()) ||
+        storage.cols != train.cols || storage.type() != train.type())
+        storage.create(rows.size(), train.cols, train.type());
+
+    cv::Mat reached = storage.rowRange(0, rows.size());
+    for (size_t r = 0; r < rows.size(); ++r)
+    {
+        cv::Mat row = reached.row(r);
+        train.row(rows[r]).copyTo(row);
+    }
+
+    std::vector<cv::DMatch> &reverse = buffers.reverse;
+    queryIndex.Match(reached, reverse, buffers.search);
+
+    for (size_t r = 0; r < rows.size(); ++r)
+    {
+        buffers.backward[rows[r]] = reverse[r];
+        buffers.backward[rows[r]].queryIdx = rows[r];
+    }
+}
+
+void
+MatchFilter::KeepMutual(const MatchBuffers &buffers,
+                        std::vector<cv::DMatch> &matches) const
+{
+    STATS_TIMER(timer, STAGE_CROSS_CHECK);
+    matches.clear();
+
+    for (size_t i = 0; i < buffers.forward.size(); ++i)
+    {
+        const cv::DMatch &forward = buffers.forward[i];
+        if (forward.trainIdx < 0 ||
+            static_cast<size_t>(forward.trainIdx) >= buffers.backward.size())
+            continue;
+
+        if (buffers.backward[forward.trainIdx].trainIdx == forward.queryIdx)
+            matches.push_back(forward);
+    }
+
+    STATS_ADD(COUNTER_CROSS_CHECKED, matches.size());
+}
+
+void
+MatchFilter::KeepDistinct(const MatchBuffers &buffers,
+                          std::vector<cv::DMatch> &matches) const
+{
+    STATS_TIMER(timer, STAGE_CROSS_CHECK);
+    matches.clear();
+
+    for (size_t i = 0; i < buffers.forward.size(); ++i)
+    {
+        const cv::DMatch &forward = buffers.forward[i];
+        if (forward.trainIdx >= 0 &&
+            forward.distance < mRatio * buffers.second[i])
+            matches.push_back(forward);
+    }
+
+    STATS_ADD(COUNTER_CROSS_CHECKED, matches.size());
+}
+
+bool
+MatchFilter::ParseType(const std::string &name, MatchFilterType &type)
+{
+    if (name == "mutual")
+        type = FILTER_MUTUAL;
+    else if (name == "ratio")
+        type = FILTER_RATIO;
+    else if (name == "mutual-cached")
+        type = FILTER_MUTUAL_CACHED;
+    else
+        return false;
+
+    return true;
+}
+
+const char *
+MatchFilter::GetTypeName(MatchFilterType type)
+{
+    switch (type)
+    {
+    case FILTER_RATIO:
+        return "ratio";
+    case FILTER_MUTUAL_CACHED:
+        return "mutual-cached";
+    default:
+        return "mutual";
+    }
+}
@@ -0,0 +1,152 @@
+/**
+ * @brief Tentative correspondences between two sets of descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file MatchFilter.h
+ */
+
+#ifndef match_filter_h
+#define match_filter_h
+
+#include "DescriptorIndex.h"
+#include "DescriptorQuantizer.h"
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+/**
+ * @brief How the nearest neighbours are filtered before RANSAC
+ */
+enum MatchFilterType
+{
+    FILTER_MUTUAL,          ///< Nearest neighbours in both directions agree
+    FILTER_RATIO,           ///< Nearest neighbour clearly closer than the second
+    FILTER_MUTUAL_CACHED    ///< FILTER_MUTUAL, reverse search only where needed
+};
+
+/**
+ * @brief Buffers reused from one call of MatchFilter::Match() to the next
+ */
+struct MatchBuffers
+{
+    std::vector<cv::DMatch> forward;
+    std::vector<cv::DMatch> backward;
+    std::vector<float> second;
+    SearchBuffers search;
+    /**
+     * @brief Train rows reached by a forward match, and their descriptors
+     * (a view over the first rows, the matrix only grows)
+     */
+    std::vector<int> reverseRows;
+    std::vector<int> reverseSlots;
+    cv::Mat reverseDescriptors;
+    std::vector<cv::DMatch> reverse;
+};
+
+/**
+ * @class MatchFilter
+ * @brief Find the correspondences between a query and a training image.
+ *
+ * FILTER_MUTUAL searches every query descriptor among the training ones
+ * and every training descriptor among the query ones, and keeps the
+ * pairs that are each other's nearest neighbour.
+ *
+ * FILTER_RATIO searches in one direction only, for the two nearest
+ * training descriptors, and keeps a match when the nearest is closer
+ * than ratio times the second (Lowe's test): half the searches, and no
+ * query index is needed.
+ *
+ * FILTER_MUTUAL_CACHED keeps the same pairs as FILTER_MUTUAL, but the
+ * reverse search is done only for the training descriptors some query
+ * descriptor fell on, once each. Most training descriptors are nobody's
+ * nearest neighbour, so most of the reverse work goes.
+ *
+ * Against compact codes both directions come from one pass over the
+ * distance matrix, so the two mutual filters cost the same.
+ */
+class MatchFilter
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] type The filter
+     * @param[in] ratio The largest nearest to second nearest distance
+     * ratio of FILTER_RATIO
+     */
+    MatchFilter(MatchFilterType type = FILTER_MUTUAL, float ratio = 0.8f);
+
+    MatchFilterType GetType() const;
+    float GetRatio() const;
+    /**
+     * @brief Check whether the query descriptors must be indexed
+     */
+    bool NeedsQueryIndex() const;
+
+    /**
+     * @brief Match query descriptors against indexed training descriptors
+     * @param[in] query The query descriptors
+     * @param[in] queryIndex An index over them, unused (and possibly
+     * empty) if NeedsQueryIndex() is false
+     * @param[in] trainIndex An index over the training descriptors
+     * @param buffers Work buffers
+     * @param[out] matches The kept matches, from query to training rows
+     */
+    void Match(const cv::Mat &query, const DescriptorIndex &queryIndex,
+               const DescriptorIndex &trainIndex, MatchBuffers &buffers,
+               std::vector<cv::DMatch> &matches) const;
+    /**
+     * @brief Match float query descriptors against compact codes
+     * @param[in] quantizer The quantizer the codes come from
+     * @param[in] query The query descriptors, CV_32F
+     * @param[in] codes The training codes
+     * @param buffers Work buffers
+     * @param[out] matches The kept matches, from query to training rows
+     */
+    void Match(const DescriptorQuantizer &quantizer, const cv::Mat &query,
+               const cv::Mat &codes, MatchBuffers &buffers,
+               std::vector<cv::DMatch> &matches) const;
+
+    /**
+     * @brief Retrieve the filter named "mutual", "ratio" or
+     * "mutual-cached"
+     * @return False if the name is unknown
+     */
+    static bool ParseType(const std::string &name, MatchFilterType &type);
+    static const char *GetTypeName(MatchFilterType type);
+
+private:
+
+    void SearchReverse(const DescriptorIndex &queryIndex,
+                       const DescriptorIndex &trainIndex,
+                       MatchBuffers &buffers) const;
+    void KeepMutual(const MatchBuffers &buffers,
+                    std::vector<cv::DMatch> &matches) const;
+    void KeepDistinct(const MatchBuffers &buffers,
+                      std::vector<cv::DMatch> &matches) const;
+
+    MatchFilterType mType;
+    float mRatio;
+};
+
+inline MatchFilterType MatchFilter::GetType() const
+{
+    return mType;
+}
+
+inline float MatchFilter::GetRatio() const
+{
+    return mRatio;
+}
+
+inline bool MatchFilter::NeedsQueryIndex() const
+{
+    return mType != FILTER_RATIO;
+}
+
+#endif // header guard
@@ -0,0 +1,291 @@
+/**
+ * @brief Serve match requests over a Unix domain socket.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file MatchServer.cpp
+ */
+
+#include "MatchServer.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <boost/thread/thread.hpp>
+#include <opencv2/core/core.hpp>
+
+MatchServer::MatchServer(ImageMatcher &matcher, const std::string &socketPath) :
+    mMatcher(matcher),
+    mSocketPath(socketPath),
+    mClientCount(0),
+    mStopping(false)
+{
+    mListener.Listen(mSocketPath);
+}
+
+MatchServer::~MatchServer()
+{
+    Stop();
+    unlink(mSocketPath.c_str());
+}
+
+void
+MatchServer::Run()
+{
+    while (true)
+    {
+        int fd = mListener.Accept();
+        if (fd < 0)
+            break;
+
+        {
+            boost::mutex::scoped_lock lock(mClientMutex);
+            if (mStopping)
+            {
+                // Accepted while Stop() was shutting the clients down
+                close(fd);
+                break;
+            }
+            mClientCount++;
+        }
+
+        try
+        {
+            boost::thread client(&MatchServer::ServeClient, this, fd);
+            client.detach();
+        }
+        catch (const boost::thread_resource_error &ex)
+        {
+            // Drop this client only, Stop() must not wait for it
+            close(fd);
+            boost::mutex::scoped_lock lock(mClientMutex);
+            if (--mClientCount == 0)
+                mClientsDone.notify_all();
+            std::cerr << "Cannot serve client: " << ex.what() << std::endl;
+        }
+    }
+}
+
+void
+MatchServer::Interrupt()
+{
+    mListener.Shutdown();
+}
+
+void
+MatchServer::Stop()
+{
+    mListener.Shutdown();
+
+    boost::mutex::scoped_lock lock(mClientMutex);
+    mStopping = true;
+
+    // An idle client blocks in ReadLine(), a shut down socket makes it
+    // return end of stream. A busy one fails on its next read or write.
+    for (std::set<UnixSocket *>::iterator it = mClients.begin();
+         it != mClients.end(); ++it)
+        (*it)->Shutdown();
+
+    while (mClientCount > 0)
+        mClientsDone.wait(lock);
+}
+
+void
+MatchServer::ServeClient(int fd)
+{
+    UnixSocket client(fd);
+    std::string request;
+
+    {
+        boost::mutex::scoped_lock lock(mClientMutex);
+        if (mStopping)
+            client.Shutdown();
+        mClients.insert(&client);
+    }
+
+    try
+    {
+        bool keepOpen = true;
+        while (keepOpen && client.ReadLine(request) && request != "QUIT")
+            client.Write(HandleRequest(request, client, keepOpen));
+    }
+    catch (const UnixSocketIOException &ex)
+    {
+        // The client went away, or sent a truncated payload
+        std::cerr << ex.what() << std::endl;
+    }
+
+    // Unregistered before the socket is closed, so that Stop() never
+    // shuts down a descriptor number reused by someone else
+    boost::mutex::scoped_lock lock(mClientMutex);
+    mClients.erase(&client);
+    if (--mClientCount == 0)
+        mClientsDone.notify_all();
+}
+
+std::string
+MatchServer::EncodeFeatures(const std::vector<cv::KeyPoint> &keypoints,
+                            const cv::Mat &descriptors)
+{
+    CV_Assert(keypoints.size() == static_cast<size_t>(descriptors.rows));
+    CV_Assert(descriptors.empty() || descriptors.type() == CV_8U ||
+              descriptors.type() == CV_32F);
+
+    std::ostringstream header;
+    header << "FEATURES " << descriptors.rows << " " << descriptors.cols
+           << " " << descriptors.type() << "\n";
+
+    std::string request = header.str();
+    request.reserve(request.size() + keypoints.size() * 2 * sizeof(float) +
+                    descriptors.rows * descriptors.cols *
+                    descriptors.elemSize());
+
+    for (size_t k = 0; k < keypoints.size(); ++k)
+    {
+        float position[2] = {keypoints[k].pt.x, keypoints[k].pt.y};
+        request.append(reinterpret_cast<const char *>(position),
+                       sizeof(position));
+    }
+
+    const size_t rowSize = descriptors.cols * descriptors.elemSize();
+    for (int r = 0; r < descriptors.rows; ++r)
+        request.append(descriptors.ptr<char>(r), rowSize);
+
+    return request;
+}
+
+bool
+MatchServer::ReadFeatures(const std::string &argument, UnixSocket &client,
+                          std::vector<cv::KeyPoint> &keypoints,
+                          cv::Mat &descriptors)
+{
+    std::istringstream in(argument);
+    unsigned long count, cols;
+    int type;
+    if (!(in >> count >> cols >> type) || !in.eof() ||
+        (type != CV_8U && type != CV_32F) || cols > 4096)
+        return false;
+
+    const size_t elemSize = type == CV_32F ? sizeof(float) : 1;
+    const size_t rowSize = 2 * sizeof(float) + cols * elemSize;
+    if (count > MAX_IMAGE_SIZE / rowSize)
+        return false;
+
+    keypoints.clear();
+    descriptors.release();
+    if (count == 0)
+        return true;
+
+    std::vector<float> positions(2 * count);
+    client.Read(&positions[0], positions.size() * sizeof(float));
+
+    keypoints.resize(count);
+    for (size_t k = 0; k < count; ++k)
+        keypoints[k].pt = cv::Point2f(positions[2 * k], positions[2 * k + 1]);
+
+    descriptors.create(count, cols, type);
+    client.Read(descriptors.data, count * cols * elemSize);
+    return true;
+}
+
+std::string
+MatchServer::HandleRequest(const std::string &request, UnixSocket &client,
+                           bool &keepOpen)
+{
+    std::string command = request.substr(0, request.find(' '));
+    std::string argument;
+    if (command.size() < request.size())
+        argument = request.substr(command.size() + 1);
+
+    // The payload of an IMAGE request must be consumed even if the
+    // request is bound to fail, or the stream gets out of sync. Without
+    // a usable size it cannot be, so the connection ends after the answer.
+    std::vector<unsigned char> buffer;
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    if (command == "FEATURES")
+    {
+        if (!ReadFeatures(argument, client, keypoints, descriptors))
+        {
+            keepOpen = false;
+            return "ERR Bad features: " + argument + "\n";
+        }
+    }
+    else if (command == "IMAGE")
+    {
+        char *end;
+        unsigned long size = strtoul(argument.c_str(), &end, 10);
+        if (argument.empty() || *end != '\0' || argument[0] == '-' ||
+            size > MAX_IMAGE_SIZE)
+        {
+            keepOpen = false;
+            return "ERR Bad image size: " + argument + "\n";
+        }
+
+        buffer.resize(size);
+        if (size > 0)
+            client.Read(&buffer[0], size);
+    }
+
+    int64 start = cv::getTickCount();
+    std::ostringstream answer;
+
+    try
+    {
+        MatchResult result;
+        if (command == "FEATURES")
+        {
+            mMatcher.MatchFeatures(keypoints, descriptors, result);
+        }
+        else if (command == "IMAGE")
+        {
+            // Decoded straight from the request buffer
+            mMatcher.FindBestMatch(buffer.empty() ? NULL : &buffer[0],
+                                   buffer.size(), result);
+        }
+        else if (command == "MATCH")
+        {
+            cv::Mat image = ImageReader::LoadImage(argument,
+                                                   mMatcher.GetDecodePolicy());
+            mMatcher.FindBestMatch(image, result);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown request: " + command);
+        }
+
+        double latency = (cv::getTickCount() - start) * 1000. /
+                         cv::getTickFrequency();
+
+        answer << "OK " << result.index << " ";
+        if (command == "FEATURES")
+        {
+            // The coordinator compares distances across shards, they
+            // must survive the round trip exactly
+            answer << std::setprecision(std::numeric_limits<float>::digits10 + 3)
+                   << result.distance << " " << result.secondDistance << " "
+                   << std::setprecision(6) << result.inliers << " "
+                   << result.candidatesVerified << " ";
+        }
+        else
+        {
+            answer << result.confidence << " ";
+        }
+        answer << latency << " " << result.fileName << "\n";
+
+        std::cout << command << " " << (command == "MATCH" ? argument : "-")
+                  << " -> " << result.fileName << " (" << latency << " ms)"
+                  << std::endl;
+    }
+    catch (const std::exception &ex)
+    {
+        answer << "ERR " << ex.what() << "\n";
+    }
+
+    return answer.str();
+}
@@ -0,0 +1,120 @@
+/**
+ * @brief Serve match requests over a Unix domain socket.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file MatchServer.h
+ */
+
+#ifndef match_server_h
+#define match_server_h
+
+#include "ImageMatcher.h"
+#include "UnixSocket.h"
+
+#include <set>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * @class MatchServer
+ * @brief Answer queries against a trained ImageMatcher.
+ *
+ * Every client gets its own thread, and may send any number of requests
+ * on its connection, one at a time. Requests are text lines:
+ *
+ *   MATCH <path>\n              match an image file readable by the server
+ *   IMAGE <size>\n<size bytes>  match an encoded image sent inline
+ *   FEATURES <n> <cols> <type>\n<payload>
+ *                               match n keypoints and descriptors computed
+ *                               by the client, see EncodeFeatures()
+ *   QUIT\n                      close the connection
+ *
+ * and each one is answered by a single line:
+ *
+ *   OK <index> <confidence> <latency ms> <file name>\n
+ *   ERR <message>\n
+ *
+ * except FEATURES, answered with the distances a ShardCoordinator needs
+ * to merge the answers of several shards:
+ *
+ *   OK <index> <distance> <second distance> <inliers> <verified>
+ *      <latency ms> <file name>\n
+ *
+ * The latency is measured from the end of the request to the answer.
+ * An IMAGE or FEATURES request whose header is malformed, or announces a
+ * payload larger than MAX_IMAGE_SIZE, is answered with ERR and then the
+ * connection is closed, since the payload cannot be skipped reliably.
+ */
+class MatchServer : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] matcher A trained matcher, shared by all the clients
+     * @param[in] socketPath File system path of the listening socket
+     */
+    MatchServer(ImageMatcher &matcher, const std::string &socketPath);
+    /**
+     * @brief Destructor, stops the server
+     */
+    ~MatchServer();
+    /**
+     * @brief Accept clients until Interrupt() or Stop() is called
+     */
+    void Run();
+    /**
+     * @brief Make Run() return. Safe to call from a signal handler.
+     */
+    void Interrupt();
+    /**
+     * @brief Stop accepting clients, shut the connected ones down and wait
+     * for their threads to finish
+     */
+    void Stop();
+
+    /**
+     * @brief Build a FEATURES request.
+     *
+     * The payload is the n keypoint positions, as x y float pairs,
+     * followed by the n descriptor rows, in the byte order of the host.
+     * @param[in] keypoints The query keypoints
+     * @param[in] descriptors One CV_8U or CV_32F row per keypoint
+     * @return The request line and its payload
+     */
+    static std::string EncodeFeatures(const std::vector<cv::KeyPoint> &keypoints,
+                                      const cv::Mat &descriptors);
+
+    /**
+     * @brief Largest payload accepted by an IMAGE or FEATURES request
+     */
+    static const size_t MAX_IMAGE_SIZE = 64 * 1024 * 1024;
+
+private:
+
+    static bool ReadFeatures(const std::string &argument, UnixSocket &client,
+                             std::vector<cv::KeyPoint> &keypoints,
+                             cv::Mat &descriptors);
+
+    void ServeClient(int fd);
+    std::string HandleRequest(const std::string &request, UnixSocket &client,
+                              bool &keepOpen);
+
+    ImageMatcher &mMatcher;
+    std::string mSocketPath;
+    UnixSocket mListener;
+
+    // The sockets of the clients being served, shut down by Stop()
+    std::set<UnixSocket *> mClients;
+    unsigned int mClientCount;
+    bool mStopping;
+    boost::mutex mClientMutex;
+    boost::condition_variable mClientsDone;
+};
+
+#endif // header guard
@@ -0,0 +1,229 @@
+/**
+ * @brief Answers to recent queries, found again by image content.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file ResultCache.cpp
+ */
+
+#include "ResultCache.h"
+#include "ImageMatcher.h"
+
+#include <algorithm>
+#include <string.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Side of the thumbnail the perceptual hash is computed on, and of the
+// low frequency block it keeps
+static const int THUMBNAIL_SIZE = 32;
+static const int HASH_SIZE = 8;
+
+struct ResultCache::Entry
+{
+    ImageHash hash;
+    MatchResult result;
+};
+
+ResultCache::ResultCache(size_t capacity, int maxDistance) :
+    mCapacity(capacity),
+    mMaxDistance(maxDistance),
+    mGeneration(0)
+{
+    mStats.capacity = capacity;
+}
+
+ResultCache::~ResultCache()
+{
+}
+
+void
+ResultCache::SetCapacity(size_t capacity, int maxDistance)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    mCapacity = capacity;
+    mMaxDistance = maxDistance;
+    mStats.capacity = capacity;
+    Drop();
+}
+
+bool
+ResultCache::IsEnabled() const
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    return mCapacity > 0;
+}
+
+void
+ResultCache::Hash(const cv::Mat &image, ImageHash &hash)
+{
+    // 64 bits at a time, FNV-1a style, then the geometry: a few
+    // milliseconds for a large photo, against the hundreds of a query
+    uint64_t content = 14695981039346656037ULL;
+    const size_t rowBytes = image.cols * image.elemSize();
+    for (int y = 0; y < image.rows; ++y)
+    {
+        const uchar *row = image.ptr(y);
+        size_t x = 0;
+        for (; x + sizeof(uint64_t) <= rowBytes; x += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, row + x, sizeof(word));
+            content = (content ^ word) * 1099511628211ULL;
+        }
+        for (; x < rowBytes; ++x)
+            content = (content ^ row[x]) * 1099511628211ULL;
+    }
+    content ^= (static_cast<uint64_t>(image.rows) << 32) ^
+               (static_cast<uint64_t>(image.cols) << 8) ^ image.type();
+    content *= 1099511628211ULL;
+    hash.content = content ^ (content >> 29);
+
+    hash.perceptual = 0;
+    if (image.empty())
+        return;
+
+    // Thumbnail first, so the color conversion is done on 32x32 pixels
+    cv::Mat thumbnail, gray, values, frequencies;
+    cv::resize(image, thumbnail, cv::Size(THUMBNAIL_SIZE, THUMBNAIL_SIZE),
+               0, 0, cv::INTER_AREA);
+    if (thumbnail.channels() == 3)
+        cv::cvtColor(thumbnail, gray, CV_BGR2GRAY);
+    else if (thumbnail.channels() == 4)
+        cv::cvtColor(thumbnail, gray, CV_BGRA2GRAY);
+    else
+        gray = thumbnail;
+    gray.convertTo(values, CV_32F);
+    cv::dct(values, frequencies);
+
+    // One bit per low frequency, set when above the median; the DC term
+    // (the mean brightness) is left out
+    float low[HASH_SIZE * HASH_SIZE];
+    for (int v = 0; v < HASH_SIZE; ++v)
+    {
+        for (int u = 0; u < HASH_SIZE; ++u)
+            low[v * HASH_SIZE + u] = frequencies.at<float>(v, u);
+    }
+
+    float sorted[HASH_SIZE * HASH_SIZE - 1];
+    std::copy(low + 1, low + HASH_SIZE * HASH_SIZE, sorted);
+    const int middle = (HASH_SIZE * HASH_SIZE - 1) / 2;
+    std::nth_element(sorted, sorted + middle, sorted + HASH_SIZE * HASH_SIZE - 1);
+    const float median = sorted[middle];
+
+    for (int i = 1; i < HASH_SIZE * HASH_SIZE; ++i)
+    {
+        if (low[i] > median)
+            hash.perceptual |= static_cast<uint64_t>(1) << i;
+    }
+}
+
+unsigned long
+ResultCache::GetGeneration() const
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    return mGeneration;
+}
+
+bool
+ResultCache::Find(const ImageHash &hash, MatchResult &result)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    if (mCapacity == 0)
+        return false;
+
+    EntryList::iterator found = mEntries.end();
+    std::map<uint64_t, EntryList::iterator>::iterator exact =
+            mByContent.find(hash.content);
+
+    if (exact != mByContent.end())
+    {
+        found = exact->second;
+    }
+    else if (mMaxDistance >= 0)
+    {
+        // The closest perceptual hash, the most recent one on ties
+        int bestDistance = mMaxDistance + 1;
+        for (EntryList::iterator e = mEntries.begin(); e != mEntries.end(); ++e)
+        {
+            int distance = __builtin_popcountll(e->hash.perceptual ^
+                                                hash.perceptual);
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                found = e;
+            }
+        }
+        if (found != mEntries.end())
+            mStats.nearHits++;
+    }
+
+    if (found == mEntries.end())
+    {
+        mStats.misses++;
+        return false;
+    }
+
+    mStats.hits++;
+    mEntries.splice(mEntries.begin(), mEntries, found);
+    result = found->result;
+    return true;
+}
+
+void
+ResultCache::Insert(const ImageHash &hash, const MatchResult &result,
+                    unsigned long generation)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    if (mCapacity == 0 || generation != mGeneration)
+        return;
+
+    std::map<uint64_t, EntryList::iterator>::iterator exact =
+            mByContent.find(hash.content);
+    if (exact != mByContent.end())
+    {
+        // Answered twice at once, the newer result wins
+        exact->second->result = result;
+        mEntries.splice(mEntries.begin(), mEntries, exact->second);
+        return;
+    }
+
+    while (mByContent.size() >= mCapacity)
+    {
+        mByContent.erase(mEntries.back().hash.content);
+        mEntries.pop_back();
+        mStats.evictions++;
+    }
+
+    Entry entry;
+    entry.hash = hash;
+    entry.result = result;
+    mEntries.push_front(entry);
+    mByContent[hash.content] = mEntries.begin();
+}
+
+void
+ResultCache::Clear()
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    mStats.invalidations++;
+    Drop();
+}
+
+void
+ResultCache::Drop()
+{
+    mEntries.clear();
+    mByContent.clear();
+    mGeneration++;
+}
+
+ResultCacheStats
+ResultCache::GetStats() const
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    ResultCacheStats stats = mStats;
+    stats.size = mByContent.size();
+    return stats;
+}
@@ -0,0 +1,165 @@
+/**
+ * @brief Answers to recent queries, found again by image content.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file ResultCache.h
+ */
+
+#ifndef result_cache_h
+#define result_cache_h
+
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <opencv2/core/core.hpp>
+
+struct MatchResult;
+
+/**
+ * @brief What a query image is known by in the cache
+ */
+struct ImageHash
+{
+    ImageHash() : content(0), perceptual(0) {}
+
+    /**
+     * @brief Hash of the decoded pixels, equal for the same image only
+     */
+    uint64_t content;
+    /**
+     * @brief DCT hash of a 32x32 grayscale thumbnail, a few bits apart
+     * for near-identical images (recompressed, slightly moved)
+     */
+    uint64_t perceptual;
+};
+
+/**
+ * @brief Lookups and evictions since the cache was created
+ */
+struct ResultCacheStats
+{
+    ResultCacheStats() : hits(0), nearHits(0), misses(0), evictions(0),
+        invalidations(0), size(0), capacity(0) {}
+
+    /**
+     * @brief Lookups answered from the cache, near hits included
+     */
+    unsigned long hits;
+    /**
+     * @brief Hits on a different image with a close perceptual hash
+     */
+    unsigned long nearHits;
+    unsigned long misses;
+    /**
+     * @brief Entries dropped to make room for newer ones
+     */
+    unsigned long evictions;
+    /**
+     * @brief Times the whole cache was dropped, e.g. by a dataset change
+     */
+    unsigned long invalidations;
+    size_t size;
+    size_t capacity;
+};
+
+/**
+ * @class ResultCache
+ * @brief A fixed number of recent query results, least recently used
+ * first out.
+ *
+ * A lookup first tries the exact content hash, a retried upload for
+ * instance, then the closest perceptual hash within the distance limit,
+ * for the same painting taken again from about the same spot. A near
+ * hit returns the result of the other image as it was, homography
+ * included.
+ *
+ * The results are only valid for the dataset and settings they were
+ * computed with: Clear() drops them and starts a new generation, and a
+ * result computed in an older generation is not inserted.
+ *
+ * All the methods can be called from several threads at once.
+ */
+class ResultCache : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] capacity Number of results kept, zero disables the cache
+     * @param[in] maxDistance Differing bits two perceptual hashes may
+     * have to be taken for the same image, negative for exact hits only
+     */
+    ResultCache(size_t capacity = 0, int maxDistance = 4);
+    ~ResultCache();
+
+    /**
+     * @brief Resize the cache, dropping its entries
+     */
+    void SetCapacity(size_t capacity, int maxDistance);
+    bool IsEnabled() const;
+
+    /**
+     * @brief Compute the hashes of an image
+     * @param[in] image The decoded image, gray or BGR
+     * @param[out] hash Its hashes
+     */
+    static void Hash(const cv::Mat &image, ImageHash &hash);
+
+    /**
+     * @brief Retrieve the current generation, to be passed to Insert()
+     * once the result is computed
+     */
+    unsigned long GetGeneration() const;
+
+    /**
+     * @brief Look a result up, counting a hit or a miss
+     * @param[in] hash The hashes of the query
+     * @param[out] result The result, set on a hit only
+     * @return True on a hit
+     */
+    bool Find(const ImageHash &hash, MatchResult &result);
+
+    /**
+     * @brief Keep a result, evicting the least recently used one if full
+     * @param[in] hash The hashes of the query
+     * @param[in] result Its result
+     * @param[in] generation The generation when the query started; the
+     * result is dropped if the cache was cleared since
+     */
+    void Insert(const ImageHash &hash, const MatchResult &result,
+                unsigned long generation);
+
+    /**
+     * @brief Drop every result, e.g. because the dataset changed
+     */
+    void Clear();
+
+    ResultCacheStats GetStats() const;
+
+private:
+
+    struct Entry;
+    typedef std::list<Entry> EntryList;
+
+    void Drop();
+
+    size_t mCapacity;
+    int mMaxDistance;
+    unsigned long mGeneration;
+
+    /**
+     * @brief Most recently used first
+     */
+    EntryList mEntries;
+    std::map<uint64_t, EntryList::iterator> mByContent;
+
+    ResultCacheStats mStats;
+    mutable boost::mutex mMutex;
+};
+
+#endif // header guard
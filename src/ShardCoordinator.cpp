@@ -0,0 +1,178 @@
+/**
+ * @brief Query a dataset split among several matcher processes.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file ShardCoordinator.cpp
+ */
+
+#include "ShardCoordinator.h"
+#include "MatchServer.h"
+
+#include <algorithm>
+#include <sstream>
+
+ShardCoordinator::ShardCoordinator(ImageMatcher &matcher,
+                                   const std::vector<std::string> &shardSockets) :
+    mMatcher(matcher),
+    mShardSockets(shardSockets)
+{
+    if (shardSockets.empty())
+        throw ShardCoordinatorIOException("No shards");
+
+    Connect();
+}
+
+ShardCoordinator::~ShardCoordinator()
+{
+    for (size_t s = 0; s < mShards.size(); ++s)
+    {
+        try
+        {
+            mShards[s]->Write("QUIT\n");
+        }
+        catch (const UnixSocketIOException &)
+        {
+            // The shard is already gone
+        }
+    }
+}
+
+void
+ShardCoordinator::Connect()
+{
+    std::vector<boost::shared_ptr<UnixSocket> > shards;
+    for (size_t s = 0; s < mShardSockets.size(); ++s)
+    {
+        boost::shared_ptr<UnixSocket> shard(new UnixSocket());
+        shard->Connect(mShardSockets[s]);
+        shards.push_back(shard);
+    }
+
+    mShards.swap(shards);
+}
+
+void
+ShardCoordinator::ReadAnswer(size_t shard, MatchResult &result,
+                             std::string &error)
+{
+    std::string line;
+    if (!mShards[shard]->ReadLine(line))
+        throw UnixSocketIOException("Shard disconnected");
+
+    std::istringstream in(line);
+    std::string status;
+    double latency;
+    in >> status;
+
+    if (status == "OK" &&
+        in >> result.index >> result.distance >> result.secondDistance
+           >> result.inliers >> result.candidatesVerified >> latency)
+    {
+        in.get();
+        std::getline(in, result.fileName);
+        return;
+    }
+
+    std::ostringstream message;
+    message << "Shard " << shard << ": "
+            << (status == "ERR" ? line.substr(std::min<size_t>(4, line.size()))
+                               : "bad answer " + line);
+    error = message.str();
+}
+
+void
+ShardCoordinator::FindBestMatch(const cv::Mat &image, MatchResult &result)
+{
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    mMatcher.ExtractFeatures(image, keypoints, descriptors);
+
+    const std::string request = MatchServer::EncodeFeatures(keypoints,
+                                                            descriptors);
+    std::vector<MatchResult> answers(mShardSockets.size());
+    std::string error;
+
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+
+        try
+        {
+            if (mShards.empty())
+                Connect();
+
+            // Every shard reads its whole request before matching, so the
+            // shards work in parallel while the next ones are written to
+            for (size_t s = 0; s < mShards.size(); ++s)
+                mShards[s]->Write(request);
+
+            // All the answers are read, even after an error, to keep the
+            // connections in step
+            for (size_t s = 0; s < mShards.size(); ++s)
+            {
+                std::string shardError;
+                ReadAnswer(s, answers[s], shardError);
+                if (error.empty())
+                    error = shardError;
+            }
+        }
+        catch (const UnixSocketIOException &ex)
+        {
+            // Some answers were left unread, and would be taken for the
+            // answers to the next query. Closing every connection is the
+            // only way to get back in step.
+            mShards.clear();
+            throw ShardCoordinatorIOException(
+                    std::string("Shard connection lost: ") + ex.what());
+        }
+    }
+
+    if (!error.empty())
+        throw ShardCoordinatorIOException(error);
+
+    result = MatchResult();
+    result.fileName = "No match found";
+
+    // Ties go to the first shard, like ties within a shard go to the
+    // first image
+    int winner = -1;
+    for (size_t s = 0; s < answers.size(); ++s)
+    {
+        result.candidatesVerified += answers[s].candidatesVerified;
+        if (answers[s].index >= 0 &&
+            (winner < 0 || answers[s].distance < answers[winner].distance))
+            winner = s;
+    }
+
+    if (winner < 0)
+        return;
+
+    float second = answers[winner].secondDistance;
+    for (size_t s = 0; s < answers.size(); ++s)
+    {
+        if (answers[s].index >= 0 && static_cast<int>(s) != winner)
+            second = std::min(second, answers[s].distance);
+    }
+
+    result.fileName = answers[winner].fileName;
+    result.index = answers[winner].index;
+    result.inliers = answers[winner].inliers;
+    result.distance = answers[winner].distance;
+    result.secondDistance = std::min(second, 100.0f);
+    result.confidence = result.secondDistance - result.distance;
+}
+
+const std::string
+ShardCoordinator::FindBestMatch(const std::string &fileName, float &confidence)
+{
+    cv::Mat image = ImageReader::LoadImage(fileName,
+                                           mMatcher.GetDecodePolicy());
+
+    MatchResult result;
+    FindBestMatch(image, result);
+
+    confidence = result.confidence;
+    return result.fileName;
+}
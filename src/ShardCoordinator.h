@@ -0,0 +1,104 @@
+/**
+ * @brief Query a dataset split among several matcher processes.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file ShardCoordinator.h
+ */
+
+#ifndef shard_coordinator_h
+#define shard_coordinator_h
+
+#include "ImageMatcher.h"
+#include "UnixSocket.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * @class ShardCoordinator
+ * @brief Scatter every query to the shards of a dataset and gather the
+ * best match.
+ *
+ * Every shard is a MatchServer over a matcher trained with
+ * ImageMatcher::SetShard(). The query features are computed once, here,
+ * and sent to all the shards at once as a FEATURES request; the shards
+ * verify their own candidates in parallel and answer with their best
+ * and second best distances. The global best is the best of the shards,
+ * the global second best the better of its shard's second best and the
+ * other shards' best, so the confidence is the one a single matcher
+ * over the whole dataset would give.
+ *
+ * Queries are serialized on the shard connections; run one coordinator
+ * per client thread to overlap them. If a shard connection fails in the
+ * middle of a query, the answers still pending on the other connections
+ * can no longer be matched to their queries: all the connections are
+ * then dropped, and opened again by the next query.
+ */
+class ShardCoordinator : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor, connects to every shard
+     * @param[in] matcher Computes the query features. It needs no
+     * training, but must use the features and the decode policy of the
+     * shards.
+     * @param[in] shardSockets The listening socket of every shard
+     */
+    ShardCoordinator(ImageMatcher &matcher,
+                     const std::vector<std::string> &shardSockets);
+    /**
+     * @brief Destructor, disconnects from the shards
+     */
+    ~ShardCoordinator();
+
+    /**
+     * @brief Find the best match among all the shards.
+     * @param[in] image The query image
+     * @param[out] result The best match. Its index is the one in the
+     * shard it comes from.
+     * @throw ShardCoordinatorIOException if a shard fails the query or
+     * cannot be reached
+     */
+    void FindBestMatch(const cv::Mat &image, MatchResult &result);
+
+    const std::string FindBestMatch(const std::string &fileName,
+                                    float &confidence);
+
+    size_t GetShardCount() const;
+
+private:
+
+    void Connect();
+    void ReadAnswer(size_t shard, MatchResult &result, std::string &error);
+
+    ImageMatcher &mMatcher;
+    std::vector<std::string> mShardSockets;
+    // Empty while disconnected, after a failed query
+    std::vector<boost::shared_ptr<UnixSocket> > mShards;
+    /**
+     * @brief Keeps the requests and answers of one query together
+     */
+    boost::mutex mMutex;
+};
+
+inline size_t ShardCoordinator::GetShardCount() const
+{
+    return mShardSockets.size();
+}
+
+class ShardCoordinatorIOException : public std::runtime_error
+{
+public:
+    ShardCoordinatorIOException(const std::string &msg = "") :
+        runtime_error(msg) {}
+};
+
+#endif // header guard
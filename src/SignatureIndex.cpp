@@ -0,0 +1,147 @@
+/**
+ * @brief Global image signatures, for a coarse first pass over the dataset.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file SignatureIndex.cpp
+ */
+
+#include "SignatureIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Side of the thumbnail the histogram is taken on, and of the layout one
+static const int THUMBNAIL_SIZE = 32;
+static const int LAYOUT_SIZE = 8;
+static const int LAYOUT_VALUES = LAYOUT_SIZE * LAYOUT_SIZE;
+// Levels per channel of the color histogram
+static const int COLOR_LEVELS = 4;
+
+/**
+ * Scale values to a norm of 1/sqrt(2), so that the two halves of a
+ * signature weigh the same and the whole has a unit norm.
+ */
+static void
+NormalizeHalf (float *values, int count)
+{
+    double sum = 0;
+    for (int i = 0; i < count; ++i)
+        sum += values[i] * values[i];
+    if (sum <= 0)
+        return;
+
+    const float scale = static_cast<float>(1 / std::sqrt(2 * sum));
+    for (int i = 0; i < count; ++i)
+        values[i] *= scale;
+}
+
+void
+SignatureIndex::Compute(const cv::Mat &image, cv::Mat &signature)
+{
+    signature.create(1, SIGNATURE_SIZE, CV_32F);
+    float *values = signature.ptr<float>(0);
+    std::fill(values, values + SIGNATURE_SIZE, 0.0f);
+
+    if (image.empty())
+        return;
+
+    // One resize over the full image, the rest works on 32x32 pixels
+    cv::Mat thumbnail, gray, layout;
+    cv::resize(image, thumbnail, cv::Size(THUMBNAIL_SIZE, THUMBNAIL_SIZE),
+               0, 0, cv::INTER_AREA);
+    const int channels = thumbnail.channels();
+
+    // Color histogram, square-rooted so that a large flat background
+    // does not outweigh everything else
+    float *histogram = values + LAYOUT_VALUES;
+    const int shift = 6; // the top two bits, COLOR_LEVELS levels
+    for (int y = 0; y < thumbnail.rows; ++y)
+    {
+        const uchar *p = thumbnail.ptr(y);
+        for (int x = 0; x < thumbnail.cols; ++x, p += channels)
+        {
+            int b = p[0] >> shift;
+            int g = channels >= 3 ? p[1] >> shift : b;
+            int r = channels >= 3 ? p[2] >> shift : b;
+            histogram[(b * COLOR_LEVELS + g) * COLOR_LEVELS + r] += 1;
+        }
+    }
+    for (int i = 0; i < SIGNATURE_SIZE - LAYOUT_VALUES; ++i)
+        histogram[i] = std::sqrt(histogram[i]);
+    NormalizeHalf(histogram, SIGNATURE_SIZE - LAYOUT_VALUES);
+
+    // Layout, with the mean brightness taken out
+    if (channels == 3)
+        cv::cvtColor(thumbnail, gray, CV_BGR2GRAY);
+    else if (channels == 4)
+        cv::cvtColor(thumbnail, gray, CV_BGRA2GRAY);
+    else
+        gray = thumbnail;
+    cv::resize(gray, layout, cv::Size(LAYOUT_SIZE, LAYOUT_SIZE), 0, 0,
+               cv::INTER_AREA);
+
+    float mean = 0;
+    for (int i = 0; i < LAYOUT_VALUES; ++i)
+    {
+        values[i] = layout.at<uchar>(i / LAYOUT_SIZE, i % LAYOUT_SIZE);
+        mean += values[i];
+    }
+    mean /= LAYOUT_VALUES;
+    for (int i = 0; i < LAYOUT_VALUES; ++i)
+        values[i] -= mean;
+    NormalizeHalf(values, LAYOUT_VALUES);
+}
+
+void
+SignatureIndex::Assign(const std::vector<cv::Mat> &signatures)
+{
+    mSignatures.create(signatures.size(), SIGNATURE_SIZE, CV_32F);
+    for (size_t i = 0; i < signatures.size(); ++i)
+    {
+        cv::Mat row = mSignatures.row(i);
+        if (signatures[i].empty())
+            row.setTo(cv::Scalar(0));
+        else
+            signatures[i].copyTo(row);
+    }
+}
+
+void
+SignatureIndex::Assign(const cv::Mat &signatures)
+{
+    mSignatures = signatures.clone();
+}
+
+void
+SignatureIndex::Add(const cv::Mat &signature)
+{
+    // push_back() grows the matrix geometrically, like the arena
+    if (signature.empty())
+        mSignatures.push_back(cv::Mat::zeros(1, SIGNATURE_SIZE, CV_32F));
+    else
+        mSignatures.push_back(signature);
+}
+
+void
+SignatureIndex::Clear()
+{
+    mSignatures.release();
+}
+
+void
+SignatureIndex::Score(const cv::Mat &signature,
+                      std::vector<float> &similarities) const
+{
+    similarities.resize(mSignatures.rows);
+    if (mSignatures.empty())
+        return;
+
+    // One matrix-vector product over the contiguous rows, written
+    // straight into the caller's buffer
+    cv::Mat scores(mSignatures.rows, 1, CV_32F, &similarities[0]);
+    cv::gemm(mSignatures, signature, 1, cv::Mat(), 0, scores, cv::GEMM_2_T);
+}
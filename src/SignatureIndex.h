@@ -0,0 +1,97 @@
+/**
+ * @brief Global image signatures, for a coarse first pass over the dataset.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file SignatureIndex.h
+ */
+
+#ifndef signature_index_h
+#define signature_index_h
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+/**
+ * @class SignatureIndex
+ * @brief One small global signature per training image, compared to the
+ * signature of a query in a single linear scan.
+ *
+ * A signature is a unit CV_32F row made of two halves of equal weight:
+ * an 8x8 grayscale thumbnail with its mean removed (the layout of the
+ * painting, whatever the exposure) and a 4x4x4 color histogram of a
+ * 32x32 thumbnail, square-rooted (the palette, whatever the framing).
+ * The similarity of two signatures is their dot product, in [-1, 1].
+ *
+ * The signatures are kept in one contiguous matrix, image after image,
+ * so scoring a query is a single matrix-vector product. Images without
+ * a signature (unreadable ones) have a zero row and score 0.
+ */
+class SignatureIndex
+{
+public:
+
+    /**
+     * @brief Number of values of a signature
+     */
+    static const int SIGNATURE_SIZE = 128;
+
+    /**
+     * @brief Compute the signature of an image
+     * @param[in] image The decoded image, 8-bit gray, BGR or BGRA
+     * @param[out] signature One CV_32F row of SIGNATURE_SIZE values, all
+     * zeros for an empty image
+     */
+    static void Compute(const cv::Mat &image, cv::Mat &signature);
+
+    /**
+     * @brief Replace the content with the signatures of a set of images
+     * @param[in] signatures One signature per image, empty if missing
+     */
+    void Assign(const std::vector<cv::Mat> &signatures);
+    /**
+     * @brief Replace the content with a copy of a signature matrix
+     * @param[in] signatures One signature per row
+     */
+    void Assign(const cv::Mat &signatures);
+    /**
+     * @brief Append the signature of one image, empty if missing
+     */
+    void Add(const cv::Mat &signature);
+    void Clear();
+
+    /**
+     * @brief Number of images with a row, with or without a signature
+     */
+    size_t GetCount() const;
+    /**
+     * @brief All the signatures, one per row
+     */
+    const cv::Mat &GetSignatures() const;
+
+    /**
+     * @brief Compare a query to every image
+     * @param[in] signature The signature of the query
+     * @param[out] similarities One similarity per image, higher is closer
+     */
+    void Score(const cv::Mat &signature,
+               std::vector<float> &similarities) const;
+
+private:
+
+    cv::Mat mSignatures;
+};
+
+inline size_t SignatureIndex::GetCount() const
+{
+    return mSignatures.rows;
+}
+
+inline const cv::Mat &SignatureIndex::GetSignatures() const
+{
+    return mSignatures;
+}
+
+#endif // header guard
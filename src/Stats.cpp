@@ -0,0 +1,236 @@
+/**
+ * @brief Latency histograms and counters of the matching stages.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file Stats.cpp
+ */
+
+#include "Stats.h"
+
+#include <stdio.h>
+#include <fstream>
+
+namespace
+{
+
+const char *STAGE_NAMES[STAGE_COUNT] =
+{
+    "decode", "extract", "candidates", "match", "cross_check", "ransac",
+    "query"
+};
+
+const char *COUNTER_NAMES[COUNTER_COUNT] =
+{
+    "queries", "images_decoded", "bytes_decoded", "keypoints",
+    "candidates_verified", "cross_checked_matches", "inliers"
+};
+
+/**
+ * Counters are read while other threads update them, and a plain 64 bit
+ * read may tear on 32 bit targets.
+ */
+uint64_t
+Load(const uint64_t &value)
+{
+    return __sync_fetch_and_add(const_cast<uint64_t *>(&value), 0);
+}
+
+} // namespace
+
+Stats::Stats()
+{
+    Reset();
+}
+
+Stats &
+Stats::Instance()
+{
+    static Stats instance;
+    return instance;
+}
+
+bool
+Stats::Enabled()
+{
+#ifdef WITH_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void
+Stats::Record(StatsStage stage, int64_t micros)
+{
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && micros > GetBucketBound(bucket))
+        bucket++;
+
+    Histogram &histogram = mStages[stage];
+    __sync_fetch_and_add(&histogram.buckets[bucket], 1);
+    __sync_fetch_and_add(&histogram.count, 1);
+    __sync_fetch_and_add(&histogram.sum, static_cast<uint64_t>(micros));
+}
+
+void
+Stats::Add(StatsCounter counter, uint64_t n)
+{
+    __sync_fetch_and_add(&mCounters[counter], n);
+}
+
+void
+Stats::Reset()
+{
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+            __sync_lock_test_and_set(&mStages[s].buckets[b], 0);
+        __sync_lock_test_and_set(&mStages[s].count, 0);
+        __sync_lock_test_and_set(&mStages[s].sum, 0);
+    }
+    for (int c = 0; c < COUNTER_COUNT; ++c)
+        __sync_lock_test_and_set(&mCounters[c], 0);
+}
+
+uint64_t
+Stats::GetCounter(StatsCounter counter) const
+{
+    return Load(mCounters[counter]);
+}
+
+uint64_t
+Stats::GetStageCount(StatsStage stage) const
+{
+    return Load(mStages[stage].count);
+}
+
+uint64_t
+Stats::GetStageSum(StatsStage stage) const
+{
+    return Load(mStages[stage].sum);
+}
+
+uint64_t
+Stats::GetBucket(StatsStage stage, int bucket) const
+{
+    return Load(mStages[stage].buckets[bucket]);
+}
+
+int64_t
+Stats::GetBucketBound(int bucket)
+{
+    return bucket < BUCKET_COUNT - 1 ? static_cast<int64_t>(1) << bucket : 0;
+}
+
+const char *
+Stats::GetStageName(StatsStage stage)
+{
+    return STAGE_NAMES[stage];
+}
+
+const char *
+Stats::GetCounterName(StatsCounter counter)
+{
+    return COUNTER_NAMES[counter];
+}
+
+void
+Stats::WriteJson(std::ostream &out) const
+{
+    out << "{\n  \"enabled\": " << (Enabled() ? "true" : "false")
+        << ",\n  \"bucket_bounds_us\": [";
+    for (int b = 0; b < BUCKET_COUNT - 1; ++b)
+        out << (b ? ", " : "") << GetBucketBound(b);
+
+    out << "],\n  \"stages\": {";
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        StatsStage stage = static_cast<StatsStage>(s);
+        uint64_t count = GetStageCount(stage);
+        uint64_t sum = GetStageSum(stage);
+
+        out << (s ? ",\n" : "\n") << "    \"" << GetStageName(stage)
+            << "\": {\"count\": " << count
+            << ", \"sum_ms\": " << sum / 1000.
+            << ", \"mean_ms\": " << (count ? sum / 1000. / count : 0)
+            << ", \"buckets\": [";
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+            out << (b ? ", " : "") << GetBucket(stage, b);
+        out << "]}";
+    }
+
+    out << "\n  },\n  \"counters\": {";
+    for (int c = 0; c < COUNTER_COUNT; ++c)
+    {
+        StatsCounter counter = static_cast<StatsCounter>(c);
+        out << (c ? ",\n" : "\n") << "    \"" << GetCounterName(counter)
+            << "\": " << GetCounter(counter);
+    }
+    out << "\n  }\n}\n";
+}
+
+void
+Stats::WritePrometheus(std::ostream &out) const
+{
+    // Bucket bounds are labels, they must be printed exactly
+    std::streamsize precision = out.precision(12);
+
+    out << "# HELP paintmatcher_stage_seconds Latency of the matching stages\n"
+        << "# TYPE paintmatcher_stage_seconds histogram\n";
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        StatsStage stage = static_cast<StatsStage>(s);
+        const char *name = GetStageName(stage);
+
+        // Prometheus buckets are cumulative
+        uint64_t cumulative = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            cumulative += GetBucket(stage, b);
+            out << "paintmatcher_stage_seconds_bucket{stage=\"" << name
+                << "\",le=\"";
+            if (b < BUCKET_COUNT - 1)
+                out << GetBucketBound(b) / 1e6;
+            else
+                out << "+Inf";
+            out << "\"} " << cumulative << "\n";
+        }
+        out << "paintmatcher_stage_seconds_sum{stage=\"" << name << "\"} "
+            << GetStageSum(stage) / 1e6 << "\n"
+            << "paintmatcher_stage_seconds_count{stage=\"" << name << "\"} "
+            << GetStageCount(stage) << "\n";
+    }
+
+    for (int c = 0; c < COUNTER_COUNT; ++c)
+    {
+        StatsCounter counter = static_cast<StatsCounter>(c);
+        const char *name = GetCounterName(counter);
+        out << "# TYPE paintmatcher_" << name << "_total counter\n"
+            << "paintmatcher_" << name << "_total " << GetCounter(counter)
+            << "\n";
+    }
+
+    out.precision(precision);
+}
+
+void
+Stats::Dump(const std::string &fileName, bool prometheus) const
+{
+    std::string temporary = fileName + ".tmp";
+    {
+        std::ofstream out(temporary.c_str());
+        if (prometheus)
+            WritePrometheus(out);
+        else
+            WriteJson(out);
+
+        if (!out)
+            throw StatsIOException("Cannot write " + temporary);
+    }
+
+    if (rename(temporary.c_str(), fileName.c_str()) != 0)
+        throw StatsIOException("Cannot replace " + fileName);
+}
@@ -0,0 +1,194 @@
+/**
+ * @brief Latency histograms and counters of the matching stages.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file Stats.h
+ */
+
+#ifndef stats_h
+#define stats_h
+
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+
+/**
+ * @brief The timed stages of a query
+ */
+enum StatsStage
+{
+    STAGE_DECODE,       ///< Reading and decoding an image
+    STAGE_EXTRACT,      ///< Keypoint detection and description
+    STAGE_CANDIDATES,   ///< Choosing the training images to verify
+    STAGE_MATCH,        ///< Nearest neighbours in both directions
+    STAGE_CROSS_CHECK,  ///< Keeping the mutual nearest neighbours
+    STAGE_RANSAC,       ///< Homography estimation
+    STAGE_QUERY,        ///< A whole query against the dataset, extraction excluded
+    STAGE_COUNT
+};
+
+/**
+ * @brief The counted quantities
+ */
+enum StatsCounter
+{
+    COUNTER_QUERIES,
+    COUNTER_IMAGES_DECODED,
+    COUNTER_BYTES_DECODED,      ///< Encoded size of the decoded images
+    COUNTER_KEYPOINTS,          ///< Keypoints kept, training and queries
+    COUNTER_CANDIDATES_VERIFIED,
+    COUNTER_CROSS_CHECKED,      ///< Matches surviving the cross-check
+    COUNTER_INLIERS,
+    COUNTER_COUNT
+};
+
+/**
+ * @class Stats
+ * @brief Process-wide latency histograms and counters.
+ *
+ * Recording is lock-free, a few atomic increments per event. It is only
+ * compiled in the hot path when WITH_STATS is defined (see the STATS_*
+ * macros below); otherwise the class is still there and reports zeros.
+ *
+ * Latencies go to power-of-two buckets from 1 us to about 4 s, plus
+ * one overflow bucket.
+ */
+class Stats
+{
+public:
+
+    static const int BUCKET_COUNT = 24;
+
+    /**
+     * @brief The instance shared by the whole process
+     */
+    static Stats &Instance();
+    /**
+     * @brief Check whether the hot path was compiled with WITH_STATS
+     */
+    static bool Enabled();
+
+    /**
+     * @brief Add one latency to the histogram of a stage
+     */
+    void Record(StatsStage stage, int64_t micros);
+    /**
+     * @brief Increase a counter
+     */
+    void Add(StatsCounter counter, uint64_t n);
+    /**
+     * @brief Set every histogram and counter back to zero
+     */
+    void Reset();
+
+    uint64_t GetCounter(StatsCounter counter) const;
+    /**
+     * @brief Number of latencies recorded for a stage
+     */
+    uint64_t GetStageCount(StatsStage stage) const;
+    /**
+     * @brief Sum of the latencies recorded for a stage, in microseconds
+     */
+    uint64_t GetStageSum(StatsStage stage) const;
+    /**
+     * @brief Number of latencies in one bucket (not cumulative)
+     */
+    uint64_t GetBucket(StatsStage stage, int bucket) const;
+    /**
+     * @brief Upper bound of a bucket in microseconds, 0 for the
+     * overflow bucket
+     */
+    static int64_t GetBucketBound(int bucket);
+
+    static const char *GetStageName(StatsStage stage);
+    static const char *GetCounterName(StatsCounter counter);
+
+    /**
+     * @brief Write everything as one JSON object
+     */
+    void WriteJson(std::ostream &out) const;
+    /**
+     * @brief Write everything in the Prometheus text exposition format
+     */
+    void WritePrometheus(std::ostream &out) const;
+    /**
+     * @brief Replace a file with a dump, atomically so that a collector
+     * never reads half of it
+     * @param[in] fileName The file to write
+     * @param[in] prometheus Prometheus text format instead of JSON
+     */
+    void Dump(const std::string &fileName, bool prometheus) const;
+
+private:
+
+    Stats();
+    Stats(const Stats &);
+    Stats &operator=(const Stats &);
+
+    struct Histogram
+    {
+        uint64_t buckets[BUCKET_COUNT];
+        uint64_t count;
+        uint64_t sum;
+    };
+
+    Histogram mStages[STAGE_COUNT];
+    uint64_t mCounters[COUNTER_COUNT];
+};
+
+/**
+ * @class StageTimer
+ * @brief Record the time from construction to Stop() or destruction
+ */
+class StageTimer
+{
+public:
+
+    explicit StageTimer(StatsStage stage) :
+        mStage(stage), mStart(cv::getTickCount()), mRunning(true) {}
+
+    ~StageTimer()
+    {
+        Stop();
+    }
+
+    void Stop()
+    {
+        if (!mRunning)
+            return;
+
+        mRunning = false;
+        Stats::Instance().Record(mStage, static_cast<int64_t>(
+            (cv::getTickCount() - mStart) * 1e6 / cv::getTickFrequency()));
+    }
+
+private:
+
+    StatsStage mStage;
+    int64 mStart;
+    bool mRunning;
+};
+
+class StatsIOException : public std::runtime_error
+{
+public:
+    StatsIOException(const std::string &message) :
+        std::runtime_error(message) {}
+};
+
+#ifdef WITH_STATS
+#define STATS_TIMER(name, stage) StageTimer name(stage)
+#define STATS_STOP(name) name.Stop()
+#define STATS_ADD(counter, n) Stats::Instance().Add(counter, n)
+#else
+#define STATS_TIMER(name, stage) do {} while (0)
+#define STATS_STOP(name) do {} while (0)
+#define STATS_ADD(counter, n) do {} while (0)
+#endif
+
+#endif // header guard
@@ -0,0 +1,191 @@
+/**
+ * @brief A fixed-size pool of worker threads for data-parallel loops.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file ThreadPool.cpp
+ */
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <boost/thread/tss.hpp>
+
+namespace
+{
+
+/**
+ * Identifies the pool and worker index of the current thread while it
+ * runs an item, so that nested loops can be detected.
+ */
+struct WorkerTag
+{
+    const ThreadPool *pool;
+    unsigned int worker;
+};
+
+void NoCleanup(WorkerTag *) {}
+
+boost::thread_specific_ptr<WorkerTag> sCurrentWorker(NoCleanup);
+
+class WorkerScope
+{
+public:
+
+    WorkerScope(const ThreadPool *pool, unsigned int worker) :
+        mPrevious(sCurrentWorker.get())
+    {
+        mTag.pool = pool;
+        mTag.worker = worker;
+        sCurrentWorker.reset(&mTag);
+    }
+
+    ~WorkerScope()
+    {
+        sCurrentWorker.reset(mPrevious);
+    }
+
+private:
+
+    WorkerTag mTag;
+    WorkerTag *mPrevious;
+};
+
+} // namespace
+
+ThreadPool::ThreadPool(unsigned int numThreads) :
+    mTask(NULL),
+    mCount(0),
+    mNext(0),
+    mBusyWorkers(0),
+    mGeneration(0),
+    mStop(false),
+    mFailed(false),
+    mNumThreads(numThreads)
+{
+    if (mNumThreads == 0)
+        mNumThreads = std::max(1u, boost::thread::hardware_concurrency());
+
+    // Worker 0 is the thread calling ParallelFor()
+    for (unsigned int i = 1; i < mNumThreads; ++i)
+        mThreads.add_thread(new boost::thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mStop = true;
+    }
+    mWakeUp.notify_all();
+    mThreads.join_all();
+}
+
+void
+ThreadPool::ParallelFor(size_t count, ParallelTask &task)
+{
+    if (count == 0)
+        return;
+
+    // Nested loop: the current thread already owns a worker index
+    WorkerTag *current = sCurrentWorker.get();
+    if (current && current->pool == this)
+    {
+        for (size_t i = 0; i < count; ++i)
+            task(i, current->worker);
+        return;
+    }
+
+    boost::mutex::scoped_lock loop(mLoopMutex);
+    WorkerScope scope(this, 0);
+
+    if (mNumThreads == 1 || count == 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+            task(i, 0);
+        return;
+    }
+
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mTask = &task;
+        mCount = count;
+        mNext = 0;
+        mFailed = false;
+        mError.clear();
+        mBusyWorkers = mNumThreads - 1;
+        ++mGeneration;
+    }
+    mWakeUp.notify_all();
+
+    RunItems(0);
+
+    boost::mutex::scoped_lock lock(mMutex);
+    while (mBusyWorkers > 0)
+        mDone.wait(lock);
+    mTask = NULL;
+
+    if (mFailed)
+        throw std::runtime_error(mError);
+}
+
+void
+ThreadPool::WorkerLoop(unsigned int worker)
+{
+    WorkerScope scope(this, worker);
+    unsigned long generation = 0;
+
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            while (!mStop && mGeneration == generation)
+                mWakeUp.wait(lock);
+
+            if (mStop)
+                return;
+
+            generation = mGeneration;
+        }
+
+        RunItems(worker);
+
+        boost::mutex::scoped_lock lock(mMutex);
+        if (--mBusyWorkers == 0)
+            mDone.notify_all();
+    }
+}
+
+void
+ThreadPool::RunItems(unsigned int worker)
+{
+    while (true)
+    {
+        size_t index;
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            if (mNext >= mCount)
+                return;
+            index = mNext++;
+        }
+
+        try
+        {
+            (*mTask)(index, worker);
+        }
+        catch (const std::exception &ex)
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            if (!mFailed)
+            {
+                mFailed = true;
+                mError = ex.what();
+            }
+            // Skip whatever is left
+            mNext = mCount;
+        }
+    }
+}
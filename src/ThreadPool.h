@@ -0,0 +1,111 @@
+/**
+ * @brief A fixed-size pool of worker threads for data-parallel loops.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file ThreadPool.h
+ */
+
+#ifndef thread_pool_h
+#define thread_pool_h
+
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * @class ParallelTask
+ * @brief The body of a loop run by ThreadPool::ParallelFor().
+ */
+class ParallelTask
+{
+public:
+
+    virtual ~ParallelTask() {}
+    /**
+     * @brief Process a single item of the loop
+     * @param[in] index Index of the item, in [0, count)
+     * @param[in] worker Index of the calling worker, in
+     * [0, ThreadPool::GetNumThreads()). No two items are processed
+     * concurrently with the same worker index, so it can be used to
+     * address per-thread state.
+     */
+    virtual void operator() (size_t index, unsigned int worker) = 0;
+};
+
+/**
+ * @class ThreadPool
+ * @brief Run loops over a fixed set of threads.
+ *
+ * Items are handed out one at a time to whichever worker is free, so
+ * uneven items (e.g. images of different size) still keep all the
+ * workers busy. The calling thread takes part in the loop as worker 0.
+ * Loops submitted from different threads are run one after the other;
+ * a loop started from within a running item is run inline.
+ */
+class ThreadPool : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Constructor
+     * @param[in] numThreads Number of workers, including the calling
+     * thread. Zero means one per hardware thread.
+     */
+    explicit ThreadPool(unsigned int numThreads = 0);
+    /**
+     * @brief Destructor, joins the workers
+     */
+    ~ThreadPool();
+    /**
+     * @brief Retrieve the number of workers
+     * @return The number of workers, including the calling thread
+     */
+    unsigned int GetNumThreads() const;
+    /**
+     * @brief Call task(i, worker) for every i in [0, count) and wait
+     * for all of them to complete.
+     * @note If a task throws, the remaining items are skipped and a
+     * std::runtime_error carrying the first message is thrown here.
+     */
+    void ParallelFor(size_t count, ParallelTask &task);
+
+private:
+
+    void WorkerLoop(unsigned int worker);
+    void RunItems(unsigned int worker);
+
+    boost::thread_group mThreads;
+    /**
+     * @brief Serializes the loops submitted by different threads
+     */
+    boost::mutex mLoopMutex;
+    /**
+     * @brief Protects the state of the running loop
+     */
+    boost::mutex mMutex;
+    boost::condition_variable mWakeUp;
+    boost::condition_variable mDone;
+
+    ParallelTask *mTask;
+    size_t mCount;
+    size_t mNext;
+    unsigned int mBusyWorkers;
+    unsigned long mGeneration;
+    bool mStop;
+    bool mFailed;
+    std::string mError;
+
+    unsigned int mNumThreads;
+};
+
+inline unsigned int ThreadPool::GetNumThreads() const
+{
+    return mNumThreads;
+}
+
+#endif // header guard
@@ -0,0 +1,209 @@
+/**
+ * @brief Contiguous storage for the training keypoints and descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file TrainingArena.cpp
+ */
+
+#include "TrainingArena.h"
+
+namespace
+{
+
+/**
+ * Copy the positions of keypoints into rows of the x and y columns.
+ */
+void
+CopyPositions(const std::vector<cv::KeyPoint> &keypoints, int rows,
+              cv::Mat &x, cv::Mat &y, int begin)
+{
+    CV_Assert(keypoints.size() == static_cast<size_t>(rows));
+
+    float *px = x.ptr<float>(0) + begin;
+    float *py = y.ptr<float>(0) + begin;
+    for (int k = 0; k < rows; ++k)
+    {
+        px[k] = keypoints[k].pt.x;
+        py[k] = keypoints[k].pt.y;
+    }
+}
+
+} // namespace
+
+TrainingArena::TrainingArena()
+{
+}
+
+void
+TrainingArena::Assign(const std::vector<cv::Mat> &descriptors,
+                      const std::vector<std::vector<cv::KeyPoint> > &keypoints)
+{
+    CV_Assert(descriptors.size() == keypoints.size());
+
+    Clear();
+    mBegin.resize(descriptors.size());
+    mCount.resize(descriptors.size());
+
+    int rows = 0;
+    int cols = 0;
+    int type = -1;
+    for (size_t i = 0; i < descriptors.size(); ++i)
+    {
+        mBegin[i] = rows;
+        mCount[i] = descriptors[i].rows;
+        rows += descriptors[i].rows;
+
+        if (!descriptors[i].empty() && type < 0)
+        {
+            cols = descriptors[i].cols;
+            type = descriptors[i].type();
+        }
+    }
+
+    if (rows == 0)
+        return;
+
+    mDescriptors.create(rows, cols, type);
+    mX.create(rows, 1, CV_32F);
+    mY.create(rows, 1, CV_32F);
+
+    for (size_t i = 0; i < descriptors.size(); ++i)
+    {
+        if (mCount[i] == 0)
+            continue;
+
+        CV_Assert(descriptors[i].cols == cols && descriptors[i].type() == type);
+        cv::Mat rowsOfImage = mDescriptors.rowRange(mBegin[i],
+                                                    mBegin[i] + mCount[i]);
+        descriptors[i].copyTo(rowsOfImage);
+        CopyPositions(keypoints[i], mCount[i], mX, mY, mBegin[i]);
+    }
+}
+
+void
+TrainingArena::Wrap(const cv::Mat &descriptors, const cv::Mat &x,
+                    const cv::Mat &y, const std::vector<int> &begin,
+                    const std::vector<int> &count)
+{
+    CV_Assert(descriptors.rows == x.rows && x.rows == y.rows);
+    CV_Assert(begin.size() == count.size());
+
+    mDescriptors = descriptors;
+    mX = x;
+    mY = y;
+    mBegin = begin;
+    mCount = count;
+}
+
+size_t
+TrainingArena::Add(const cv::Mat &descriptors,
+                   const std::vector<cv::KeyPoint> &keypoints)
+{
+    const int begin = mX.rows;
+
+    mBegin.push_back(begin);
+    mCount.push_back(descriptors.rows);
+
+    if (!descriptors.empty())
+    {
+        // Mat::push_back grows by half its size when it runs out of
+        // room, and always copies arrays it does not own
+        cv::Mat x(descriptors.rows, 1, CV_32F);
+        cv::Mat y(descriptors.rows, 1, CV_32F);
+        CopyPositions(keypoints, descriptors.rows, x, y, 0);
+
+        mDescriptors.push_back(descriptors);
+        mX.push_back(x);
+        mY.push_back(y);
+    }
+
+    return mBegin.size() - 1;
+}
+
+void
+TrainingArena::Compact(const std::vector<bool> &removed)
+{
+    CV_Assert(removed.size() == mBegin.size());
+
+    int rows = 0;
+    for (size_t i = 0; i < mBegin.size(); ++i)
+    {
+        if (!removed[i])
+            rows += mCount[i];
+    }
+
+    cv::Mat descriptors, x, y;
+    if (rows > 0)
+    {
+        descriptors.create(rows, mDescriptors.cols, mDescriptors.type());
+        x.create(rows, 1, CV_32F);
+        y.create(rows, 1, CV_32F);
+    }
+
+    int next = 0;
+    for (size_t i = 0; i < mBegin.size(); ++i)
+    {
+        if (removed[i])
+            mCount[i] = 0;
+
+        if (mCount[i] > 0)
+        {
+            cv::Range from(mBegin[i], mBegin[i] + mCount[i]);
+            cv::Range to(next, next + mCount[i]);
+            cv::Mat d = descriptors.rowRange(to);
+            cv::Mat px = x.rowRange(to);
+            cv::Mat py = y.rowRange(to);
+            mDescriptors.rowRange(from).copyTo(d);
+            mX.rowRange(from).copyTo(px);
+            mY.rowRange(from).copyTo(py);
+        }
+
+        mBegin[i] = next;
+        next += mCount[i];
+    }
+
+    mDescriptors = descriptors;
+    mX = x;
+    mY = y;
+}
+
+void
+TrainingArena::SetDescriptors(const cv::Mat &descriptors)
+{
+    CV_Assert(descriptors.rows == mX.rows);
+    mDescriptors = descriptors;
+}
+
+void
+TrainingArena::Detach()
+{
+    // Matrices over external data have no reference count
+    if (!mDescriptors.empty() && !mDescriptors.refcount)
+        mDescriptors = mDescriptors.clone();
+    if (!mX.empty() && !mX.refcount)
+        mX = mX.clone();
+    if (!mY.empty() && !mY.refcount)
+        mY = mY.clone();
+}
+
+void
+TrainingArena::Clear()
+{
+    mDescriptors.release();
+    mX.release();
+    mY.release();
+    mBegin.clear();
+    mCount.clear();
+}
+
+cv::Mat
+TrainingArena::GetDescriptors(size_t image) const
+{
+    if (mCount[image] == 0)
+        return cv::Mat();
+
+    return mDescriptors.rowRange(mBegin[image], mBegin[image] + mCount[image]);
+}
@@ -0,0 +1,185 @@
+/**
+ * @brief Contiguous storage for the training keypoints and descriptors.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file TrainingArena.h
+ */
+
+#ifndef training_arena_h
+#define training_arena_h
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+/**
+ * @brief The keypoint positions of one image, as two parallel arrays
+ */
+struct KeypointSpan
+{
+    KeypointSpan() : x(NULL), y(NULL), count(0) {}
+    KeypointSpan(const float *x, const float *y, int count) :
+        x(x), y(y), count(count) {}
+
+    const float *x;
+    const float *y;
+    int count;
+};
+
+/**
+ * @class TrainingArena
+ * @brief The keypoints and descriptors of all the training images, in
+ * structure-of-arrays form.
+ *
+ * Descriptors live in one row-major matrix, image after image; every
+ * image owns a range of its rows. The keypoints are reduced to what
+ * matching needs, their position, kept in two float columns parallel to
+ * the descriptor rows. The three arrays are laid out as in the index
+ * file, so a loaded index is used straight from the mapping.
+ *
+ * Images appended with Add() grow the arrays geometrically, which may
+ * move them; views taken before stay valid but point to the old block.
+ */
+class TrainingArena
+{
+public:
+
+    TrainingArena();
+
+    /**
+     * @brief Replace the content with a set of images, in one allocation
+     * @param[in] descriptors The descriptors of every image, all of the
+     * same type and width (or empty)
+     * @param[in] keypoints The keypoints of every image, as many as its
+     * descriptor rows
+     */
+    void Assign(const std::vector<cv::Mat> &descriptors,
+                const std::vector<std::vector<cv::KeyPoint> > &keypoints);
+    /**
+     * @brief Use arrays held elsewhere, like a file mapping, without
+     * copying them
+     * @param[in] descriptors One descriptor per row
+     * @param[in] x,y Keypoint positions, one CV_32F column each
+     * @param[in] begin First row of every image
+     * @param[in] count Number of rows of every image
+     */
+    void Wrap(const cv::Mat &descriptors, const cv::Mat &x, const cv::Mat &y,
+              const std::vector<int> &begin, const std::vector<int> &count);
+    /**
+     * @brief Append one image
+     * @return The index of the image
+     */
+    size_t Add(const cv::Mat &descriptors,
+               const std::vector<cv::KeyPoint> &keypoints);
+    /**
+     * @brief Drop the rows of the removed images; the images keep their
+     * indices, with no rows
+     * @param[in] removed One flag per image
+     */
+    void Compact(const std::vector<bool> &removed);
+    /**
+     * @brief Replace all the descriptors, e.g. with their codes
+     * @param[in] descriptors As many rows as the current ones
+     */
+    void SetDescriptors(const cv::Mat &descriptors);
+    /**
+     * @brief Copy the arrays set by Wrap(), so that their memory can go
+     */
+    void Detach();
+    /**
+     * @brief Forget every image
+     */
+    void Clear();
+
+    size_t GetImageCount() const;
+    /**
+     * @brief Number of rows in the arrays, removed images included
+     */
+    int GetRowCount() const;
+    /**
+     * @brief First row of an image
+     */
+    int GetBegin(size_t image) const;
+    /**
+     * @brief Number of keypoints of an image
+     */
+    int GetCount(size_t image) const;
+    /**
+     * @brief The descriptors of an image, a view on the arena (empty if
+     * the image has no keypoints)
+     */
+    cv::Mat GetDescriptors(size_t image) const;
+    /**
+     * @brief All the descriptors
+     */
+    const cv::Mat &GetDescriptors() const;
+    /**
+     * @brief The keypoint positions of an image
+     */
+    KeypointSpan GetKeypoints(size_t image) const;
+    /**
+     * @brief All the keypoint abscissae, one CV_32F column
+     */
+    const cv::Mat &GetX() const;
+    /**
+     * @brief All the keypoint ordinates, one CV_32F column
+     */
+    const cv::Mat &GetY() const;
+
+private:
+
+    cv::Mat mDescriptors;
+    cv::Mat mX;
+    cv::Mat mY;
+    std::vector<int> mBegin;
+    std::vector<int> mCount;
+};
+
+inline size_t TrainingArena::GetImageCount() const
+{
+    return mBegin.size();
+}
+
+inline int TrainingArena::GetRowCount() const
+{
+    return mX.rows;
+}
+
+inline int TrainingArena::GetBegin(size_t image) const
+{
+    return mBegin[image];
+}
+
+inline int TrainingArena::GetCount(size_t image) const
+{
+    return mCount[image];
+}
+
+inline const cv::Mat &TrainingArena::GetDescriptors() const
+{
+    return mDescriptors;
+}
+
+inline KeypointSpan TrainingArena::GetKeypoints(size_t image) const
+{
+    if (mCount[image] == 0)
+        return KeypointSpan();
+
+    return KeypointSpan(mX.ptr<float>(mBegin[image]),
+                        mY.ptr<float>(mBegin[image]), mCount[image]);
+}
+
+inline const cv::Mat &TrainingArena::GetX() const
+{
+    return mX;
+}
+
+inline const cv::Mat &TrainingArena::GetY() const
+{
+    return mY;
+}
+
+#endif // header guard
@@ -0,0 +1,201 @@
+/**
+ * @brief Minimal stream sockets over Unix domain addresses.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file UnixSocket.cpp
+ */
+
+#include "UnixSocket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+
+static const size_t BUFFER_SIZE = 64 * 1024;
+
+static sockaddr_un
+MakeAddress (const std::string &path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(address.sun_path))
+        throw UnixSocketIOException("Socket path too long: " + path);
+
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+static std::string
+ErrorString (const std::string &what)
+{
+    return what + ": " + strerror(errno);
+}
+
+UnixSocket::UnixSocket(int fd) :
+    mFd(fd),
+    mBuffer(BUFFER_SIZE),
+    mBegin(0),
+    mEnd(0)
+{
+}
+
+UnixSocket::~UnixSocket()
+{
+    if (mFd >= 0)
+        close(mFd);
+}
+
+void
+UnixSocket::Listen(const std::string &path)
+{
+    sockaddr_un address = MakeAddress(path);
+
+    mFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mFd < 0)
+        throw UnixSocketIOException(ErrorString("socket"));
+
+    unlink(path.c_str());
+
+    if (bind(mFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+        throw UnixSocketIOException(ErrorString("Cannot bind " + path));
+
+    if (listen(mFd, SOMAXCONN) < 0)
+        throw UnixSocketIOException(ErrorString("Cannot listen on " + path));
+}
+
+void
+UnixSocket::Connect(const std::string &path)
+{
+    sockaddr_un address = MakeAddress(path);
+
+    mFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mFd < 0)
+        throw UnixSocketIOException(ErrorString("socket"));
+
+    if (connect(mFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+        throw UnixSocketIOException(ErrorString("Cannot connect to " + path));
+}
+
+int
+UnixSocket::Accept()
+{
+    while (true)
+    {
+        int fd = accept(mFd, NULL, NULL);
+        if (fd >= 0)
+            return fd;
+
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+
+        // Shutdown() makes accept() fail with EINVAL
+        if (errno == EINVAL || errno == EBADF)
+            return -1;
+
+        throw UnixSocketIOException(ErrorString("accept"));
+    }
+}
+
+void
+UnixSocket::Shutdown()
+{
+    if (mFd >= 0)
+        shutdown(mFd, SHUT_RDWR);
+}
+
+bool
+UnixSocket::Fill()
+{
+    if (mBegin == mEnd)
+        mBegin = mEnd = 0;
+
+    while (true)
+    {
+        ssize_t n = read(mFd, &mBuffer[mEnd], mBuffer.size() - mEnd);
+        if (n > 0)
+        {
+            mEnd += n;
+            return true;
+        }
+        if (n == 0)
+            return false;
+        if (errno != EINTR)
+            throw UnixSocketIOException(ErrorString("read"));
+    }
+}
+
+bool
+UnixSocket::ReadLine(std::string &line)
+{
+    line.clear();
+
+    while (true)
+    {
+        char *begin = &mBuffer[0] + mBegin;
+        char *end = &mBuffer[0] + mEnd;
+        char *newline = std::find(begin, end, '\n');
+
+        line.append(begin, newline);
+        if (newline != end)
+        {
+            mBegin += newline - begin + 1;
+            return true;
+        }
+
+        mBegin = mEnd;
+        if (!Fill())
+            return false;
+    }
+}
+
+void
+UnixSocket::Read(void *data, size_t size)
+{
+    char *out = static_cast<char *>(data);
+
+    while (size > 0)
+    {
+        if (mBegin == mEnd && !Fill())
+            throw UnixSocketIOException("Unexpected end of stream");
+
+        size_t n = std::min(size, mEnd - mBegin);
+        memcpy(out, &mBuffer[mBegin], n);
+        mBegin += n;
+        out += n;
+        size -= n;
+    }
+}
+
+void
+UnixSocket::Write(const void *data, size_t size)
+{
+    const char *in = static_cast<const char *>(data);
+
+    while (size > 0)
+    {
+        // Do not get killed by SIGPIPE if the peer went away
+        ssize_t n = send(mFd, in, size, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw UnixSocketIOException(ErrorString("write"));
+        }
+        in += n;
+        size -= n;
+    }
+}
+
+void
+UnixSocket::Write(const std::string &text)
+{
+    Write(text.data(), text.size());
+}
@@ -0,0 +1,103 @@
+/**
+ * @brief Minimal stream sockets over Unix domain addresses.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file UnixSocket.h
+ */
+
+#ifndef unix_socket_h
+#define unix_socket_h
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+/**
+ * @class UnixSocket
+ * @brief A buffered, blocking Unix domain stream socket.
+ *
+ * The socket is closed when the object is destroyed. Reads are buffered,
+ * so that a text line and the binary payload that follows it can be read
+ * from the same stream.
+ */
+class UnixSocket : private boost::noncopyable
+{
+public:
+
+    /**
+     * @brief Take ownership of an open socket descriptor
+     */
+    explicit UnixSocket(int fd = -1);
+    /**
+     * @brief Destructor, closes the socket
+     */
+    ~UnixSocket();
+    /**
+     * @brief Create a listening socket, replacing any stale socket file
+     * @param[in] path File system path of the socket
+     */
+    void Listen(const std::string &path);
+    /**
+     * @brief Connect to a listening socket
+     * @param[in] path File system path of the socket
+     */
+    void Connect(const std::string &path);
+    /**
+     * @brief Wait for a client
+     * @return The descriptor of the accepted connection, -1 once the
+     * socket has been shut down
+     */
+    int Accept();
+    /**
+     * @brief Stop a blocking Accept() or read from another thread
+     */
+    void Shutdown();
+    /**
+     * @brief Read a line, without the trailing newline
+     * @return False on end of stream
+     */
+    bool ReadLine(std::string &line);
+    /**
+     * @brief Read exactly size bytes
+     */
+    void Read(void *data, size_t size);
+    /**
+     * @brief Write exactly size bytes
+     */
+    void Write(const void *data, size_t size);
+    /**
+     * @brief Write a string
+     */
+    void Write(const std::string &text);
+    /**
+     * @brief Retrieve the socket descriptor
+     */
+    int GetDescriptor() const;
+
+private:
+
+    bool Fill();
+
+    int mFd;
+    std::vector<char> mBuffer;
+    size_t mBegin;
+    size_t mEnd;
+};
+
+inline int UnixSocket::GetDescriptor() const
+{
+    return mFd;
+}
+
+class UnixSocketIOException : public std::runtime_error
+{
+public:
+    UnixSocketIOException(const std::string &msg = "") :
+        runtime_error(msg) {}
+};
+
+#endif // header guard
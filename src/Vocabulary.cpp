@@ -0,0 +1,440 @@
+/**
+ * @brief Bag of visual words: vocabulary tree and inverted file.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file Vocabulary.cpp
+ */
+
+#include "Vocabulary.h"
+
+#include <float.h>
+#include <string.h>
+#include <stdint.h>
+#include <cmath>
+#include <fstream>
+#include <algorithm>
+
+static const char VOCABULARY_MAGIC[8] = { 'P', 'M', 'V', 'O', 'C', 'A', 'B', '\0' };
+static const uint32_t VOCABULARY_VERSION = 1;
+
+Vocabulary::Vocabulary() :
+    mBranching(0),
+    mDepth(0),
+    mWordCount(0),
+    mBinary(false)
+{
+}
+
+bool
+Vocabulary::Empty() const
+{
+    return mWordCount == 0;
+}
+
+int
+Vocabulary::GetWordCount() const
+{
+    return mWordCount;
+}
+
+int
+Vocabulary::GetDescriptorSize() const
+{
+    return mCenters.cols;
+}
+
+bool
+Vocabulary::IsBinary() const
+{
+    return mBinary;
+}
+
+void
+Vocabulary::Build(const std::vector<cv::Mat> &descriptors, int branching,
+                  int depth, int maxSamples)
+{
+    CV_Assert(branching > 1 && depth > 0 && maxSamples > 0);
+
+    int total = 0;
+    int cols = 0;
+    bool binary = false;
+    for (size_t i = 0; i < descriptors.size(); ++i)
+    {
+        total += descriptors[i].rows;
+        if (!descriptors[i].empty())
+        {
+            cols = descriptors[i].cols;
+            binary = descriptors[i].type() == CV_8U;
+        }
+    }
+
+    if (total == 0)
+        throw VocabularyIOException("No descriptors to build a vocabulary from");
+
+    // Uniform subsampling, with a fixed seed so that the same training
+    // set always gives the same vocabulary. k-means needs floats, binary
+    // descriptors are clustered on their byte values.
+    cv::RNG rng(0x5eed);
+    int count = std::min(total, maxSamples);
+    cv::Mat samples(count, cols, CV_32F);
+    int row = 0;
+    int seen = 0;
+    for (size_t i = 0; i < descriptors.size(); ++i)
+    {
+        for (int r = 0; r < descriptors[i].rows; ++r, ++seen)
+        {
+            // Selection sampling: keep each row with probability
+            // (still needed) / (still available)
+            if (rng.uniform(0, total - seen) < count - row)
+            {
+                cv::Mat dst = samples.row(row++);
+                descriptors[i].row(r).convertTo(dst, CV_32F);
+            }
+        }
+    }
+
+    mBranching = branching;
+    mDepth = depth;
+    mWordCount = 0;
+    mBinary = binary;
+    mNodes.clear();
+    mCenters.release();
+
+    Node root = { 0, 0, -1 };
+    mNodes.push_back(root);
+    mCenters.push_back(cv::Mat::zeros(1, cols, CV_32F));
+
+    BuildNode(0, samples, 0);
+}
+
+int
+Vocabulary::BuildNode(int node, const cv::Mat &samples, int level)
+{
+    // Leaf: not enough samples, or bottom of the tree
+    if (level == mDepth || samples.rows < mBranching)
+    {
+        mNodes[node].word = mWordCount++;
+        return mNodes[node].word;
+    }
+
+    cv::Mat labels, centers;
+    cv::kmeans(samples, mBranching, labels,
+               cv::TermCriteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS,
+                                10, 1e-3),
+               1, cv::KMEANS_PP_CENTERS, centers);
+
+    int first = mNodes.size();
+    mNodes[node].firstChild = first;
+    mNodes[node].childCount = mBranching;
+
+    for (int c = 0; c < mBranching; ++c)
+    {
+        Node child = { 0, 0, -1 };
+        mNodes.push_back(child);
+        mCenters.push_back(centers.row(c));
+    }
+
+    for (int c = 0; c < mBranching; ++c)
+    {
+        cv::Mat subset;
+        for (int r = 0; r < samples.rows; ++r)
+        {
+            if (labels.at<int>(r) == c)
+                subset.push_back(samples.row(r));
+        }
+
+        BuildNode(first + c, subset, level + 1);
+    }
+
+    return -1;
+}
+
+int
+Vocabulary::QuantizeRow(const float *descriptor) const
+{
+    const int cols = mCenters.cols;
+    int node = 0;
+
+    while (mNodes[node].childCount > 0)
+    {
+        const Node &parent = mNodes[node];
+        float bestDistance = FLT_MAX;
+        int best = parent.firstChild;
+
+        for (int c = parent.firstChild; c < parent.firstChild + parent.childCount; ++c)
+        {
+            const float *center = mCenters.ptr<float>(c);
+            float distance = 0;
+            for (int k = 0; k < cols; ++k)
+            {
+                float d = descriptor[k] - center[k];
+                distance += d * d;
+            }
+
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = c;
+            }
+        }
+
+        node = best;
+    }
+
+    return mNodes[node].word;
+}
+
+void
+Vocabulary::Quantize(const cv::Mat &descriptors, std::vector<int> &words) const
+{
+    CV_Assert(!Empty());
+
+    words.resize(descriptors.rows);
+
+    if (descriptors.empty())
+        return;
+
+    CV_Assert(descriptors.cols == mCenters.cols);
+
+    cv::Mat values = descriptors;
+    if (descriptors.type() != CV_32F)
+        descriptors.convertTo(values, CV_32F);
+
+    for (int r = 0; r < values.rows; ++r)
+        words[r] = QuantizeRow(values.ptr<float>(r));
+}
+
+void
+Vocabulary::Save(const std::string &fileName) const
+{
+    CV_Assert(!Empty());
+
+    std::ofstream stream(fileName.c_str(), std::ios::binary | std::ios::trunc);
+    if (!stream)
+        throw VocabularyIOException("Cannot write vocabulary: " + fileName);
+
+    int32_t header[6] = { mBranching, mDepth, mWordCount,
+                          static_cast<int32_t>(mNodes.size()),
+                          mCenters.cols, mBinary ? 1 : 0 };
+
+    stream.write(VOCABULARY_MAGIC, sizeof(VOCABULARY_MAGIC));
+    stream.write(reinterpret_cast<const char *>(&VOCABULARY_VERSION),
+                 sizeof(VOCABULARY_VERSION));
+    stream.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+    for (size_t i = 0; i < mNodes.size(); ++i)
+    {
+        int32_t node[3] = { mNodes[i].firstChild, mNodes[i].childCount,
+                            mNodes[i].word };
+        stream.write(reinterpret_cast<const char *>(node), sizeof(node));
+    }
+
+    for (int r = 0; r < mCenters.rows; ++r)
+        stream.write(reinterpret_cast<const char *>(mCenters.ptr<float>(r)),
+                     mCenters.cols * sizeof(float));
+
+    if (!stream)
+        throw VocabularyIOException("Cannot write vocabulary: " + fileName);
+}
+
+void
+Vocabulary::Load(const std::string &fileName)
+{
+    std::ifstream stream(fileName.c_str(), std::ios::binary);
+    if (!stream)
+        throw VocabularyIOException("Cannot read vocabulary: " + fileName);
+
+    char magic[8];
+    uint32_t version;
+    int32_t header[6];
+
+    stream.read(magic, sizeof(magic));
+    stream.read(reinterpret_cast<char *>(&version), sizeof(version));
+    stream.read(reinterpret_cast<char *>(header), sizeof(header));
+
+    if (!stream || memcmp(magic, VOCABULARY_MAGIC, sizeof(magic)) != 0)
+        throw VocabularyIOException("Not a vocabulary file: " + fileName);
+    if (version != VOCABULARY_VERSION)
+        throw VocabularyIOException("Unsupported vocabulary version: " + fileName);
+
+    const int nodeCount = header[3];
+    const int cols = header[4];
+    if (header[0] < 2 || header[1] < 1 || header[2] < 1 ||
+            nodeCount < 1 || cols < 1 || header[5] < 0 || header[5] > 1)
+        throw VocabularyIOException("Corrupted vocabulary: " + fileName);
+
+    std::vector<Node> nodes(nodeCount);
+    for (int i = 0; i < nodeCount; ++i)
+    {
+        int32_t node[3];
+        stream.read(reinterpret_cast<char *>(node), sizeof(node));
+        nodes[i].firstChild = node[0];
+        nodes[i].childCount = node[1];
+        nodes[i].word = node[2];
+
+        // Children come after their parent, so QuantizeRow() always
+        // goes down the tree and ends on a leaf
+        bool valid = node[1] == 0 ?
+                     node[2] >= 0 && node[2] < header[2] :
+                     node[1] > 0 && node[0] > i && node[0] < nodeCount &&
+                     node[1] <= nodeCount - node[0];
+        if (!valid)
+            throw VocabularyIOException("Corrupted vocabulary: " + fileName);
+    }
+
+    cv::Mat centers(nodeCount, cols, CV_32F);
+    for (int r = 0; r < nodeCount; ++r)
+        stream.read(reinterpret_cast<char *>(centers.ptr<float>(r)),
+                    cols * sizeof(float));
+
+    if (!stream)
+        throw VocabularyIOException("Truncated vocabulary: " + fileName);
+
+    mBranching = header[0];
+    mDepth = header[1];
+    mWordCount = header[2];
+    mBinary = header[5] == 1;
+    mNodes.swap(nodes);
+    mCenters = centers;
+}
+
+InvertedFile::InvertedFile() :
+    mImageCount(0)
+{
+}
+
+void
+InvertedFile::CountWords(const std::vector<int> &words,
+                         std::vector<std::pair<int, int> > &counts)
+{
+    std::vector<int> sorted(words);
+    std::sort(sorted.begin(), sorted.end());
+
+    counts.clear();
+    for (size_t i = 0; i < sorted.size(); )
+    {
+        size_t j = i;
+        while (j < sorted.size() && sorted[j] == sorted[i])
+            ++j;
+
+        counts.push_back(std::make_pair(sorted[i], static_cast<int>(j - i)));
+        i = j;
+    }
+}
+
+void
+InvertedFile::Build(const std::vector<std::vector<int> > &imageWords,
+                    int wordCount)
+{
+    std::vector<std::vector<std::pair<int, int> > > counts(imageWords.size());
+    std::vector<int> documentFrequency(wordCount, 0);
+
+    for (size_t i = 0; i < imageWords.size(); ++i)
+    {
+        CountWords(imageWords[i], counts[i]);
+        for (size_t w = 0; w < counts[i].size(); ++w)
+            documentFrequency[counts[i][w].first]++;
+    }
+
+    mImageCount = imageWords.size();
+    mIdf.assign(wordCount, 0);
+    for (int w = 0; w < wordCount; ++w)
+    {
+        if (documentFrequency[w] > 0)
+            mIdf[w] = std::log(static_cast<float>(mImageCount) /
+                               documentFrequency[w]);
+    }
+
+    mPostings.assign(wordCount, std::vector<Posting>());
+    for (size_t i = 0; i < counts.size(); ++i)
+        AddPostings(i, counts[i]);
+}
+
+int
+InvertedFile::Add(const std::vector<int> &words)
+{
+    CV_Assert(!Empty());
+
+    // The idf weights are not updated, images added since the last
+    // Build() simply do not change the rarity of the words
+    std::vector<std::pair<int, int> > counts;
+    CountWords(words, counts);
+
+    int image = static_cast<int>(mImageCount++);
+    AddPostings(image, counts);
+    return image;
+}
+
+void
+InvertedFile::AddPostings(int image,
+                          const std::vector<std::pair<int, int> > &counts)
+{
+    // L2 normalized tf-idf vector of the image
+    float norm = 0;
+    for (size_t w = 0; w < counts.size(); ++w)
+    {
+        float v = counts[w].second * mIdf[counts[w].first];
+        norm += v * v;
+    }
+
+    if (norm == 0)
+        return;
+
+    norm = std::sqrt(norm);
+    for (size_t w = 0; w < counts.size(); ++w)
+    {
+        int word = counts[w].first;
+        Posting posting;
+        posting.image = image;
+        posting.weight = counts[w].second * mIdf[word] / norm;
+        mPostings[word].push_back(posting);
+    }
+}
+
+void
+InvertedFile::Clear()
+{
+    mPostings.clear();
+    mIdf.clear();
+    mImageCount = 0;
+}
+
+bool
+InvertedFile::Empty() const
+{
+    return mPostings.empty();
+}
+
+void
+InvertedFile::Score(const std::vector<int> &queryWords,
+                    std::vector<float> &scores) const
+{
+    scores.assign(mImageCount, 0);
+
+    std::vector<std::pair<int, int> > counts;
+    CountWords(queryWords, counts);
+
+    float norm = 0;
+    for (size_t w = 0; w < counts.size(); ++w)
+    {
+        float v = counts[w].second * mIdf[counts[w].first];
+        norm += v * v;
+    }
+
+    if (norm == 0)
+        return;
+
+    norm = std::sqrt(norm);
+    for (size_t w = 0; w < counts.size(); ++w)
+    {
+        int word = counts[w].first;
+        float weight = counts[w].second * mIdf[word] / norm;
+
+        const std::vector<Posting> &postings = mPostings[word];
+        for (size_t p = 0; p < postings.size(); ++p)
+            scores[postings[p].image] += weight * postings[p].weight;
+    }
+}
@@ -0,0 +1,179 @@
+/**
+ * @brief Bag of visual words: vocabulary tree and inverted file.
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file Vocabulary.h
+ */
+
+#ifndef vocabulary_h
+#define vocabulary_h
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+/**
+ * @class Vocabulary
+ * @brief A vocabulary tree built by hierarchical k-means.
+ *
+ * Every node splits its descriptors into (at most) branching clusters,
+ * down to depth levels; the leaves are the visual words. Quantizing a
+ * descriptor costs branching x depth distance computations, instead of
+ * one per word.
+ */
+class Vocabulary
+{
+public:
+
+    /**
+     * @brief Default constructor, creates an empty vocabulary
+     */
+    Vocabulary();
+    /**
+     * @brief Cluster a set of descriptors
+     * @param[in] descriptors One matrix of descriptors (one per row) per
+     * image, as computed for training
+     * @param[in] branching Number of children of every node
+     * @param[in] depth Number of levels below the root
+     * @param[in] maxSamples Descriptors are subsampled to this number
+     * before clustering
+     */
+    void Build(const std::vector<cv::Mat> &descriptors, int branching = 10,
+               int depth = 4, int maxSamples = 200000);
+    /**
+     * @brief Check whether the vocabulary has been built or loaded
+     */
+    bool Empty() const;
+    /**
+     * @brief Retrieve the number of visual words (leaves)
+     */
+    int GetWordCount() const;
+    /**
+     * @brief Retrieve the length of the descriptors it was built from
+     */
+    int GetDescriptorSize() const;
+    /**
+     * @brief Check whether it was built from binary (CV_8U) descriptors
+     */
+    bool IsBinary() const;
+    /**
+     * @brief Find the visual word of every descriptor
+     * @param[in] descriptors One descriptor per row
+     * @param[out] words One word per row
+     */
+    void Quantize(const cv::Mat &descriptors, std::vector<int> &words) const;
+    /**
+     * @brief Save the vocabulary to a binary file
+     */
+    void Save(const std::string &fileName) const;
+    /**
+     * @brief Load a vocabulary written by Save()
+     * @throw VocabularyIOException if the file is not a well-formed tree,
+     * e.g. a child does not come after its parent
+     */
+    void Load(const std::string &fileName);
+
+private:
+
+    struct Node
+    {
+        int firstChild;
+        int childCount;
+        int word;
+    };
+
+    int BuildNode(int node, const cv::Mat &samples, int level);
+    int QuantizeRow(const float *descriptor) const;
+
+    int mBranching;
+    int mDepth;
+    int mWordCount;
+    bool mBinary;
+    /**
+     * @brief The tree, root first; children of a node are contiguous
+     */
+    std::vector<Node> mNodes;
+    /**
+     * @brief Cluster center of every node (the root row is unused)
+     */
+    cv::Mat mCenters;
+};
+
+/**
+ * @class InvertedFile
+ * @brief TF-IDF scoring of images by their visual words.
+ *
+ * For every word, the inverted file lists the images containing it with
+ * their normalized tf-idf weight. The similarities are accumulated over
+ * the lists of the words in the query only, but the scores still come
+ * out as one dense vector: clearing it and ranking it cost one pass over
+ * all the images per query, cheap next to a single verification.
+ */
+class InvertedFile
+{
+public:
+
+    /**
+     * @brief Default constructor, creates an empty index
+     */
+    InvertedFile();
+    /**
+     * @brief Index a set of images
+     * @param[in] imageWords The visual words of every image
+     * @param[in] wordCount Size of the vocabulary
+     */
+    void Build(const std::vector<std::vector<int> > &imageWords,
+               int wordCount);
+    /**
+     * @brief Index one more image, with the idf weights of the last Build()
+     * @param[in] words The visual words of the image
+     * @return The number given to the image, the count of images so far
+     */
+    int Add(const std::vector<int> &words);
+    /**
+     * @brief Release the index
+     */
+    void Clear();
+    /**
+     * @brief Check whether the index has been built
+     */
+    bool Empty() const;
+    /**
+     * @brief Score every indexed image against a query
+     * @param[in] queryWords The visual words of the query
+     * @param[out] scores Cosine similarity of the tf-idf vectors, one per
+     * image, higher is better
+     */
+    void Score(const std::vector<int> &queryWords,
+               std::vector<float> &scores) const;
+
+private:
+
+    struct Posting
+    {
+        int image;
+        float weight;
+    };
+
+    static void CountWords(const std::vector<int> &words,
+                           std::vector<std::pair<int, int> > &counts);
+    void AddPostings(int image,
+                     const std::vector<std::pair<int, int> > &counts);
+
+    std::vector<std::vector<Posting> > mPostings;
+    std::vector<float> mIdf;
+    size_t mImageCount;
+};
+
+class VocabularyIOException : public std::runtime_error
+{
+public:
+    VocabularyIOException(const std::string &msg = "") :
+        runtime_error(msg) {}
+};
+
+#endif // header guard
@@ -0,0 +1,856 @@
+/**
+ * @brief Timing and accuracy benchmark of the matching pipeline
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file bench.cpp
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "config.h"
+#include "AsyncMatcher.h"
+#include "DescriptorIndex.h"
+#include "DescriptorQuantizer.h"
+#include "FeatureExtractor.h"
+#include "ImageMatcher.h"
+#include "ImageReader.h"
+#include "MatchFilter.h"
+
+namespace fs = boost::filesystem;
+
+/**
+ * Heap blocks requested by the whole process. With glibc the allocation
+ * functions are wrapped, so the blocks OpenCV gets through malloc() are
+ * counted as well as the ones of operator new.
+ */
+static volatile unsigned long sAllocations = 0;
+static volatile unsigned long sAllocatedBytes = 0;
+
+#if defined(__GLIBC__)
+static const bool sCountingAllocations = true;
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static inline void
+CountAllocation (size_t size)
+{
+    __sync_fetch_and_add(&sAllocations, 1);
+    __sync_fetch_and_add(&sAllocatedBytes, size);
+}
+
+extern "C" void *
+malloc (size_t size) __THROW
+{
+    CountAllocation(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void *
+calloc (size_t count, size_t size) __THROW
+{
+    CountAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *
+realloc (void *ptr, size_t size) __THROW
+{
+    CountAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+#else
+static const bool sCountingAllocations = false;
+#endif
+
+/**
+ * Command line options
+ */
+struct Options
+{
+    Options() :
+        trainingDir(TRAINING_DIR),
+        queryDir(QUERY_DIR),
+        numThreads(0),
+        candidateCount(0),
+        prefilterCount(0),
+        repeat(3),
+        concurrency(2),
+        queueCapacity(4),
+        deadlineMs(0),
+        featureName("surf"),
+        features(FEATURE_SURF)
+    {
+        sizes.push_back(0);
+        sizes.push_back(250);
+        sizes.push_back(1000);
+        filters.push_back(FILTER_MUTUAL);
+        filters.push_back(FILTER_RATIO);
+        filters.push_back(FILTER_MUTUAL_CACHED);
+        storages.push_back(STORAGE_FLOAT);
+        storages.push_back(STORAGE_INT8);
+        storages.push_back(STORAGE_FLOAT16);
+    }
+
+    std::string trainingDir;
+    std::string queryDir;
+    std::string outputFile;
+    /**
+     * Collection sizes to train on, 0 is the bundled training set
+     */
+    std::vector<int> sizes;
+    unsigned int numThreads;
+    unsigned int candidateCount;
+    unsigned int prefilterCount;
+    int repeat;
+    /**
+     * AsyncMatcher settings of the burst, every query submitted repeat
+     * times at once
+     */
+    unsigned int concurrency;
+    size_t queueCapacity;
+    unsigned int deadlineMs;
+    std::string featureName;
+    FeatureType features;
+    /**
+     * Match filters compared on the bundled training set, the first one
+     * is used for the collections
+     */
+    std::vector<MatchFilterType> filters;
+    /**
+     * Training descriptor storages compared on the bundled training set,
+     * float features only
+     */
+    std::vector<DescriptorStorage> storages;
+};
+
+/**
+ * Latencies of one measured operation, in milliseconds.
+ */
+class Samples
+{
+public:
+
+    void Add(double ms)
+    {
+        mValues.push_back(ms);
+    }
+
+    size_t Count() const
+    {
+        return mValues.size();
+    }
+
+    double Mean() const
+    {
+        double sum = 0;
+        for (size_t i = 0; i < mValues.size(); ++i)
+            sum += mValues[i];
+        return mValues.empty() ? 0 : sum / mValues.size();
+    }
+
+    /**
+     * Nearest-rank percentile, p in [0, 100]
+     */
+    double Percentile(double p) const
+    {
+        if (mValues.empty())
+            return 0;
+
+        std::vector<double> sorted(mValues);
+        std::sort(sorted.begin(), sorted.end());
+        size_t rank = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+        return sorted[rank];
+    }
+
+    void WriteJson(std::ostream &out) const
+    {
+        out << "{\"count\": " << Count()
+            << ", \"mean_ms\": " << Mean()
+            << ", \"p50_ms\": " << Percentile(50)
+            << ", \"p90_ms\": " << Percentile(90)
+            << ", \"p99_ms\": " << Percentile(99)
+            << ", \"max_ms\": " << Percentile(100) << "}";
+    }
+
+private:
+
+    std::vector<double> mValues;
+};
+
+/**
+ * Milliseconds elapsed since a cv::getTickCount() value.
+ */
+static double
+ElapsedMs (int64 start)
+{
+    return (cv::getTickCount() - start) * 1000. / cv::getTickFrequency();
+}
+
+/**
+ * Results on one training collection
+ */
+struct CollectionResult
+{
+    CollectionResult() : filter(FILTER_MUTUAL), storage(STORAGE_FLOAT),
+        images(0), descriptorBytes(0), trainMs(0), correct(0), queries(0),
+        candidatesVerified(0), coldQueries(0), coldAllocations(0),
+        steadyQueries(0), steadyAllocations(0), steadyBytes(0) {}
+
+    MatchFilterType filter;
+    DescriptorStorage storage;
+    size_t images;
+    size_t descriptorBytes;
+    double trainMs;
+    Samples query;
+    int correct;
+    int queries;
+    unsigned long candidatesVerified;
+    /**
+     * Heap blocks taken by the first run of every query, and by the
+     * repeated runs (same image, buffers already grown)
+     */
+    unsigned long coldQueries;
+    unsigned long coldAllocations;
+    unsigned long steadyQueries;
+    unsigned long steadyAllocations;
+    unsigned long steadyBytes;
+    /**
+     * Position of the right image in the signature ranking of every
+     * query with a ground truth, -1 if it is not ranked
+     */
+    std::vector<int> signatureRanks;
+};
+
+/**
+ * Fraction of the ranked queries whose right image is among the first
+ * count of the signature ranking, the recall of a prefilter keeping
+ * count images.
+ */
+static double
+RecallAt (const std::vector<int> &ranks, size_t count)
+{
+    if (ranks.empty())
+        return 0;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < ranks.size(); ++i)
+    {
+        if (ranks[i] >= 0 && static_cast<size_t>(ranks[i]) < count)
+            kept++;
+    }
+    return static_cast<double>(kept) / ranks.size();
+}
+
+/**
+ * Results of a burst of asynchronous queries
+ */
+struct BurstResult
+{
+    BurstResult() : submitted(0), rejected(0), expired(0) {}
+
+    /**
+     * From submission to answer, of the queries that were matched
+     */
+    Samples latency;
+    unsigned long submitted;
+    unsigned long rejected;
+    unsigned long expired;
+};
+
+/**
+ * Callback of a burst query, timing it from its submission.
+ */
+class RecordLatency
+{
+public:
+
+    RecordLatency(BurstResult &burst, boost::mutex &mutex) :
+        mBurst(&burst), mMutex(&mutex), mStart(cv::getTickCount()) {}
+
+    void operator() (const MatchResult &result) const
+    {
+        if (!result.error.empty())
+            return;
+
+        double ms = ElapsedMs(mStart);
+        boost::mutex::scoped_lock lock(*mMutex);
+        mBurst->latency.Add(ms);
+    }
+
+private:
+
+    BurstResult *mBurst;
+    boost::mutex *mMutex;
+    int64 mStart;
+};
+
+static void
+PrintUsage (const char *name)
+{
+    std::cout << "\n\tUsage: " << name << " [options]"
+              << "\n\n\tOptions:"
+              << "\n\t  --training <dir>    training images (default: the bundled set)"
+              << "\n\t  --query <dir>       query images, the i-th one shows the i-th training image"
+              << "\n\t  --sizes <n,n,...>   collection sizes, enlarged with synthetic distractors;"
+              << "\n\t                      0 is the training set alone (default: 0,250,1000)"
+              << "\n\t  --repeat <r>        times every query is repeated (default: 3), the repeats"
+              << "\n\t                      count the steady-state heap allocations"
+              << "\n\t  --threads <n>       number of worker threads (default: one per core)"
+              << "\n\t  --concurrency <n>   queries in progress at once in the burst (default: 2)"
+              << "\n\t  --queue <n>         queries waiting at most in the burst (default: 4)"
+              << "\n\t  --deadline <ms>     longest wait in the burst queue (default: none)"
+              << "\n\t  --features <name>   surf (default), orb, brisk or freak"
+              << "\n\t  --top-k <k>         verify only the k best candidates (default: all)"
+              << "\n\t  --prefilter <m>     keep only the m images closest by global signature"
+              << "\n\t                      (default: all); its recall is measured either way"
+              << "\n\t  --filters <f,...>   match filters to compare, the first one is used for"
+              << "\n\t                      the collections (default: mutual,ratio,mutual-cached)"
+              << "\n\t  --storages <s,...>  descriptor storages to compare, SURF only"
+              << "\n\t                      (default: float,int8,float16)"
+              << "\n\t  --output <file>     write the JSON results to file instead of stdout"
+              << "\n\n";
+}
+
+static bool
+ParseOptions (int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--training") == 0 && i + 1 < argc)
+            options.trainingDir = std::string(argv[++i]) + "/";
+        else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc)
+            options.queryDir = std::string(argv[++i]) + "/";
+        else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+        {
+            options.sizes.clear();
+            std::istringstream list(argv[++i]);
+            std::string size;
+            while (std::getline(list, size, ','))
+                options.sizes.push_back(atoi(size.c_str()));
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            options.repeat = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            options.numThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc)
+            options.concurrency = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+            options.queueCapacity = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc)
+            options.deadlineMs = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--features") == 0 && i + 1 < argc)
+        {
+            options.featureName = argv[++i];
+            if (!FeatureExtractor::ParseType(options.featureName,
+                                             options.features))
+                return false;
+        }
+        else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc)
+            options.candidateCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--prefilter") == 0 && i + 1 < argc)
+            options.prefilterCount = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--filters") == 0 && i + 1 < argc)
+        {
+            options.filters.clear();
+            std::istringstream list(argv[++i]);
+            std::string name;
+            MatchFilterType filter;
+            while (std::getline(list, name, ','))
+            {
+                if (!MatchFilter::ParseType(name, filter))
+                    return false;
+                options.filters.push_back(filter);
+            }
+        }
+        else if (strcmp(argv[i], "--storages") == 0 && i + 1 < argc)
+        {
+            options.storages.clear();
+            std::istringstream list(argv[++i]);
+            std::string name;
+            DescriptorStorage storage;
+            while (std::getline(list, name, ','))
+            {
+                if (!DescriptorQuantizer::ParseStorage(name, storage))
+                    return false;
+                options.storages.push_back(storage);
+            }
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            options.outputFile = argv[++i];
+        else
+            return false;
+    }
+
+    return !options.sizes.empty() && !options.filters.empty();
+}
+
+/**
+ * Paint a distractor: a grid of patches cut from random training images,
+ * some of them mirrored. It has realistic textures and keypoints, but no
+ * consistent geometry with any training image.
+ */
+static cv::Mat
+MakeDistractor (const std::vector<cv::Mat> &sources, cv::RNG &rng)
+{
+    const int grid = 3;
+    const cv::Mat &model = sources[rng.uniform(0, (int)sources.size())];
+    cv::Mat canvas = cv::Mat::zeros(model.size(), model.type());
+    int tileWidth = canvas.cols / grid;
+    int tileHeight = canvas.rows / grid;
+
+    for (int y = 0; y < grid; ++y)
+    {
+        for (int x = 0; x < grid; ++x)
+        {
+            const cv::Mat &source = sources[rng.uniform(0, (int)sources.size())];
+            int width = std::min(source.cols, tileWidth * 2);
+            int height = std::min(source.rows, tileHeight * 2);
+            cv::Rect patch(rng.uniform(0, source.cols - width + 1),
+                           rng.uniform(0, source.rows - height + 1),
+                           width, height);
+
+            cv::Mat tile = canvas(cv::Rect(x * tileWidth, y * tileHeight,
+                                           tileWidth, tileHeight));
+            cv::resize(source(patch), tile, tile.size(), 0, 0, cv::INTER_AREA);
+            if (rng.uniform(0, 2))
+                cv::flip(tile, tile, 1);
+        }
+    }
+
+    return canvas;
+}
+
+/**
+ * Fill a temporary directory with the training images plus synthetic
+ * distractors, up to size images in all.
+ */
+static void
+MakeCollection (const Options &options, const std::vector<std::string> &names,
+                const std::vector<cv::Mat> &images, int size,
+                const fs::path &directory)
+{
+    fs::create_directories(directory);
+    for (size_t i = 0; i < names.size(); ++i)
+        fs::copy_file(options.trainingDir + names[i], directory / names[i]);
+
+    // The same seed gives the same collections from run to run
+    cv::RNG rng(0x5eed);
+    for (int i = names.size(); i < size; ++i)
+    {
+        std::ostringstream name;
+        name << "synthetic_" << i << ".jpg";
+        cv::imwrite((directory / name.str()).string(),
+                    MakeDistractor(images, rng));
+    }
+}
+
+/**
+ * Time the pipeline stages one by one on the ground truth pairs.
+ */
+static void
+MeasureStages (const Options &options,
+               const std::vector<std::string> &trainNames,
+               const std::vector<std::string> &queryNames,
+               std::vector<cv::Mat> &trainImages,
+               std::map<std::string, Samples> &stages)
+{
+    FeatureExtractor extractor(options.features);
+    std::vector<cv::Mat> queryImages;
+
+    for (int r = 0; r < options.repeat; ++r)
+    {
+        trainImages.clear();
+        queryImages.clear();
+
+        for (size_t i = 0; i < trainNames.size() + queryNames.size(); ++i)
+        {
+            bool training = i < trainNames.size();
+            std::string file = training ?
+                options.trainingDir + trainNames[i] :
+                options.queryDir + queryNames[i - trainNames.size()];
+
+            int64 start = cv::getTickCount();
+            cv::Mat image = ImageReader::LoadImage(file);
+            stages["decode"].Add(ElapsedMs(start));
+
+            (training ? trainImages : queryImages).push_back(image);
+        }
+    }
+
+    std::vector<cv::Mat> trainDesc(trainImages.size());
+    std::vector<std::vector<cv::KeyPoint> > trainKp(trainImages.size());
+    std::vector<cv::Mat> queryDesc(queryImages.size());
+    std::vector<std::vector<cv::KeyPoint> > queryKp(queryImages.size());
+
+    for (size_t i = 0; i < trainImages.size(); ++i)
+    {
+        int64 start = cv::getTickCount();
+        extractor.Compute(trainImages[i], trainKp[i], trainDesc[i]);
+        stages["extract"].Add(ElapsedMs(start));
+    }
+    for (size_t i = 0; i < queryImages.size(); ++i)
+    {
+        int64 start = cv::getTickCount();
+        extractor.Compute(queryImages[i], queryKp[i], queryDesc[i]);
+        stages["extract"].Add(ElapsedMs(start));
+    }
+
+    size_t pairs = std::min(trainDesc.size(), queryDesc.size());
+    for (size_t i = 0; i < pairs; ++i)
+    {
+        if (trainDesc[i].empty() || queryDesc[i].empty())
+            continue;
+
+        DescriptorIndex trainIndex, queryIndex;
+        int64 start = cv::getTickCount();
+        trainIndex.Build(trainDesc[i]);
+        stages["flann_build"].Add(ElapsedMs(start));
+        queryIndex.Build(queryDesc[i]);
+
+        std::vector<cv::DMatch> forward;
+        start = cv::getTickCount();
+        trainIndex.Match(queryDesc[i], forward);
+        stages["flann_match"].Add(ElapsedMs(start));
+
+        // Every filter on the same pair, the first one is verified
+        MatchBuffers buffers;
+        std::vector<cv::DMatch> matches, kept;
+        for (size_t f = 0; f < options.filters.size(); ++f)
+        {
+            MatchFilter filter(options.filters[f]);
+            start = cv::getTickCount();
+            filter.Match(queryDesc[i], queryIndex, trainIndex, buffers, kept);
+            stages[std::string("filter_") +
+                   MatchFilter::GetTypeName(options.filters[f])].Add(
+                           ElapsedMs(start));
+            if (f == 0)
+                matches.swap(kept);
+        }
+
+        std::vector<cv::Point2f> obj, scene;
+        for (size_t m = 0; m < matches.size(); ++m)
+        {
+            obj.push_back(queryKp[i][matches[m].queryIdx].pt);
+            scene.push_back(trainKp[i][matches[m].trainIdx].pt);
+        }
+        if (obj.size() < 4)
+            continue;
+
+        start = cv::getTickCount();
+        cv::findHomography(obj, scene, CV_RANSAC);
+        stages["homography"].Add(ElapsedMs(start));
+    }
+}
+
+/**
+ * Train on a collection and match every query against it.
+ */
+static void
+MeasureCollection (const Options &options, const std::string &directory,
+                   const std::vector<std::string> &trainNames,
+                   const std::vector<std::string> &queryNames,
+                   MatchFilterType filter, DescriptorStorage storage,
+                   CollectionResult &result)
+{
+    ImageMatcher matcher(400, options.numThreads, options.features);
+    matcher.SetCandidateCount(options.candidateCount);
+    matcher.SetPrefilter(options.prefilterCount);
+    matcher.SetMatchFilter(MatchFilter(filter));
+    matcher.SetDescriptorStorage(storage);
+    result.filter = filter;
+    result.storage = storage;
+
+    int64 start = cv::getTickCount();
+    matcher.Train(directory);
+    result.trainMs = ElapsedMs(start);
+    const TrainingStats stats = matcher.GetTrainingStats();
+    const std::vector<std::string> &names = stats.fileNames;
+    result.images = names.size();
+    result.descriptorBytes = stats.descriptorBytes;
+
+    // Reused like a server would, so its strings keep their capacity
+    MatchResult match;
+    std::vector<int> ranking;
+
+    for (size_t i = 0; i < queryNames.size(); ++i)
+    {
+        cv::Mat image = ImageReader::LoadImage(options.queryDir + queryNames[i]);
+
+        // Where the right image stands by global signature alone
+        if (i < trainNames.size())
+        {
+            matcher.RankBySignature(image, ranking);
+            int rank = -1;
+            for (size_t r = 0; r < ranking.size() && rank < 0; ++r)
+            {
+                if (names[ranking[r]] == trainNames[i])
+                    rank = r;
+            }
+            result.signatureRanks.push_back(rank);
+        }
+
+        for (int r = 0; r < options.repeat; ++r)
+        {
+            unsigned long allocations = sAllocations;
+            unsigned long bytes = sAllocatedBytes;
+            start = cv::getTickCount();
+            matcher.FindBestMatch(image, match);
+            result.query.Add(ElapsedMs(start));
+
+            if (r == 0)
+            {
+                result.coldQueries++;
+                result.coldAllocations += sAllocations - allocations;
+            }
+            else
+            {
+                result.steadyQueries++;
+                result.steadyAllocations += sAllocations - allocations;
+                result.steadyBytes += sAllocatedBytes - bytes;
+            }
+
+            result.queries++;
+            result.candidatesVerified += match.candidatesVerified;
+            if (i < trainNames.size() && match.fileName == trainNames[i])
+                result.correct++;
+        }
+    }
+}
+
+/**
+ * Submit every query repeat times at once and see how many are matched,
+ * and how fast, with a bounded concurrency and queue.
+ */
+static void
+MeasureBurst (const Options &options,
+              const std::vector<std::string> &queryNames,
+              BurstResult &burst)
+{
+    ImageMatcher matcher(400, options.numThreads, options.features);
+    matcher.SetCandidateCount(options.candidateCount);
+    matcher.SetPrefilter(options.prefilterCount);
+    matcher.SetMatchFilter(MatchFilter(options.filters[0]));
+    matcher.Train(options.trainingDir);
+
+    std::vector<cv::Mat> images;
+    for (size_t i = 0; i < queryNames.size(); ++i)
+        images.push_back(ImageReader::LoadImage(options.queryDir + queryNames[i]));
+
+    boost::mutex mutex;
+    AsyncMatcher async(matcher, options.concurrency, options.queueCapacity,
+                       options.deadlineMs);
+    for (int r = 0; r < options.repeat; ++r)
+    {
+        for (size_t i = 0; i < images.size(); ++i)
+            async.Submit(images[i], RecordLatency(burst, mutex));
+    }
+
+    async.Wait();
+    burst.submitted = async.GetSubmittedCount();
+    burst.rejected = async.GetRejectedCount();
+    burst.expired = async.GetExpiredCount();
+}
+
+static void
+WriteCollections (std::ostream &out, const Options &options,
+                  const std::vector<CollectionResult> &collections)
+{
+    for (size_t i = 0; i < collections.size(); ++i)
+    {
+        const CollectionResult &c = collections[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"filter\": \"" << MatchFilter::GetTypeName(c.filter)
+            << "\", \"storage\": \""
+            << DescriptorQuantizer::GetStorageName(c.storage)
+            << "\", \"images\": " << c.images
+            << ", \"descriptor_kib\": " << c.descriptorBytes / 1024.
+            << ", \"train_ms\": " << c.trainMs
+            << ", \"accuracy\": " << (c.queries ? (double)c.correct / c.queries : 0)
+            << ", \"candidates_verified\": "
+            << (c.queries ? (double)c.candidatesVerified / c.queries : 0)
+            << ", \"prefilter_recall\": {\"1\": "
+            << RecallAt(c.signatureRanks, 1)
+            << ", \"5\": " << RecallAt(c.signatureRanks, 5)
+            << ", \"10\": " << RecallAt(c.signatureRanks, 10)
+            << ", \"50\": " << RecallAt(c.signatureRanks, 50);
+        if (options.prefilterCount > 0)
+            out << ", \"" << options.prefilterCount << "\": "
+                << RecallAt(c.signatureRanks, options.prefilterCount);
+        out << "}";
+        if (sCountingAllocations)
+            out << ", \"cold_allocations_per_query\": "
+                << (c.coldQueries ? (double)c.coldAllocations / c.coldQueries : 0)
+                << ", \"allocations_per_query\": "
+                << (c.steadyQueries ? (double)c.steadyAllocations / c.steadyQueries : 0)
+                << ", \"allocated_kib_per_query\": "
+                << (c.steadyQueries ? c.steadyBytes / 1024. / c.steadyQueries : 0);
+        out << ", \"query\": ";
+        c.query.WriteJson(out);
+        out << "}";
+    }
+}
+
+static void
+WriteResults (std::ostream &out, const Options &options,
+              const std::vector<std::string> &trainNames,
+              const std::vector<std::string> &queryNames,
+              const std::map<std::string, Samples> &stages,
+              const std::vector<CollectionResult> &collections,
+              const std::vector<CollectionResult> &filters,
+              const std::vector<CollectionResult> &storages,
+              const BurstResult &burst)
+{
+    out << "{\n  \"features\": \"" << options.featureName << "\",\n"
+        << "  \"distance_kernels\": \""
+        << DescriptorQuantizer::GetKernelName() << "\",\n"
+        << "  \"threads\": " << options.numThreads << ",\n"
+        << "  \"top_k\": " << options.candidateCount << ",\n"
+        << "  \"prefilter\": " << options.prefilterCount << ",\n"
+        << "  \"training_images\": " << trainNames.size() << ",\n"
+        << "  \"query_images\": " << queryNames.size() << ",\n"
+        << "  \"stages\": {";
+
+    std::map<std::string, Samples>::const_iterator stage;
+    for (stage = stages.begin(); stage != stages.end(); ++stage)
+    {
+        out << (stage == stages.begin() ? "\n" : ",\n")
+            << "    \"" << stage->first << "\": ";
+        stage->second.WriteJson(out);
+    }
+
+    out << "\n  },\n  \"filters\": [";
+    WriteCollections(out, options, filters);
+    out << "\n  ],\n  \"storages\": [";
+    WriteCollections(out, options, storages);
+    out << "\n  ],\n  \"collections\": [";
+    WriteCollections(out, options, collections);
+    out << "\n  ],\n  \"burst\": {\"concurrency\": " << options.concurrency
+        << ", \"queue\": " << options.queueCapacity
+        << ", \"deadline_ms\": " << options.deadlineMs
+        << ", \"submitted\": " << burst.submitted
+        << ", \"rejected\": " << burst.rejected
+        << ", \"expired\": " << burst.expired
+        << ", \"answered\": ";
+    burst.latency.WriteJson(out);
+    out << "}\n}\n";
+}
+
+int
+main (int argc, char *argv[])
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    std::vector<std::string> trainNames, queryNames;
+    std::map<std::string, Samples> stages;
+    std::vector<CollectionResult> collections, filters, storages;
+    BurstResult burst;
+    std::vector<cv::Mat> trainImages;
+
+    try
+    {
+        trainNames = ImageReader(options.trainingDir).GetFileNames();
+        queryNames = ImageReader(options.queryDir).GetFileNames();
+
+        std::cerr << "Measuring the pipeline stages..." << std::endl;
+        MeasureStages(options, trainNames, queryNames, trainImages, stages);
+
+        for (size_t f = 0; f < options.filters.size(); ++f)
+        {
+            std::cerr << "Measuring the "
+                      << MatchFilter::GetTypeName(options.filters[f])
+                      << " filter..." << std::endl;
+
+            CollectionResult result;
+            MeasureCollection(options, options.trainingDir, trainNames,
+                              queryNames, options.filters[f], STORAGE_FLOAT,
+                              result);
+            filters.push_back(result);
+        }
+
+        // Compact storages give up FLANN for an exact scan of the codes,
+        // their query latency is the price of the memory they save
+        for (size_t s = 0; s < options.storages.size() &&
+                options.features == FEATURE_SURF; ++s)
+        {
+            std::cerr << "Measuring the "
+                      << DescriptorQuantizer::GetStorageName(options.storages[s])
+                      << " storage..." << std::endl;
+
+            CollectionResult result;
+            MeasureCollection(options, options.trainingDir, trainNames,
+                              queryNames, options.filters[0],
+                              options.storages[s], result);
+            storages.push_back(result);
+        }
+
+        for (size_t i = 0; i < options.sizes.size(); ++i)
+        {
+            int size = options.sizes[i];
+            std::cerr << "Measuring a collection of "
+                      << std::max<size_t>(size, trainNames.size())
+                      << " images..." << std::endl;
+
+            CollectionResult result;
+            if (size <= static_cast<int>(trainNames.size()))
+                MeasureCollection(options, options.trainingDir, trainNames,
+                                  queryNames, options.filters[0],
+                                  STORAGE_FLOAT, result);
+            else
+            {
+                fs::path directory = fs::temp_directory_path() /
+                                     fs::unique_path("paintMatcherBench-%%%%%%%%");
+                MakeCollection(options, trainNames, trainImages, size,
+                               directory);
+                MeasureCollection(options, directory.string() + "/",
+                                  trainNames, queryNames, options.filters[0],
+                                  STORAGE_FLOAT, result);
+                fs::remove_all(directory);
+            }
+            collections.push_back(result);
+        }
+
+        std::cerr << "Measuring a burst of queries..." << std::endl;
+        MeasureBurst(options, queryNames, burst);
+    }
+    catch (const std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    if (options.outputFile.empty())
+        WriteResults(std::cout, options, trainNames, queryNames, stages,
+                     collections, filters, storages, burst);
+    else
+    {
+        std::ofstream out(options.outputFile.c_str());
+        WriteResults(out, options, trainNames, queryNames, stages,
+                     collections, filters, storages, burst);
+    }
+
+    return (EXIT_SUCCESS);
+}
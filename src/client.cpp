@@ -0,0 +1,92 @@
+/**
+ * @brief Test client for the paintMatcher server mode
+ *
+ * @copyright Copyright 2013, Trya Srl
+ * via Siemens 19 - 39100 Bolzano BZ, ITALY
+ *
+ * @author Piero Donaggio <piero.donaggio@trya.it>
+ * @file client.cpp
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string.h>
+#include <opencv2/core/core.hpp>
+
+#include "UnixSocket.h"
+
+int
+main (int argc, char *argv[])
+{
+    bool sendBytes = false;
+    int first = 2;
+
+    if (argc > 1 && strcmp(argv[1], "--bytes") == 0)
+    {
+        sendBytes = true;
+        first = 3;
+    }
+
+    if (argc <= first)
+    {
+        std::cout << "\n\tUsage: " << argv[0]
+                  << " [--bytes] <socket> <queryImage> [<queryImage> ...]"
+                  << "\n\n\t  --bytes  send the image content instead of its path\n\n";
+        return (EXIT_FAILURE);
+    }
+
+    try
+    {
+        UnixSocket server;
+        server.Connect(argv[first - 1]);
+
+        for (int i = first; i < argc; ++i)
+        {
+            std::ostringstream request;
+            std::vector<char> content;
+
+            if (sendBytes)
+            {
+                std::ifstream file(argv[i], std::ios::binary);
+                content.assign(std::istreambuf_iterator<char>(file),
+                               std::istreambuf_iterator<char>());
+                request << "IMAGE " << content.size() << "\n";
+            }
+            else
+            {
+                request << "MATCH " << argv[i] << "\n";
+            }
+
+            int64 start = cv::getTickCount();
+
+            server.Write(request.str());
+            if (!content.empty())
+                server.Write(&content[0], content.size());
+
+            std::string answer;
+            if (!server.ReadLine(answer))
+            {
+                std::cout << "Connection closed by the server" << std::endl;
+                return (EXIT_FAILURE);
+            }
+
+            double latency = (cv::getTickCount() - start) * 1000. /
+                             cv::getTickFrequency();
+
+            std::cout << argv[i] << ": " << answer
+                      << " (round trip " << latency << " ms)" << std::endl;
+        }
+
+        server.Write("QUIT\n");
+    }
+    catch (const std::exception &ex)
+    {
+        std::cout << ex.what() << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    return (EXIT_SUCCESS);
+}
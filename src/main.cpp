@@ -8,27 +8,637 @@
  * @file main.cpp
  */
 
+#include <algorithm>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <signal.h>
 #include <string.h>
 #include <boost/filesystem.hpp>
+#include <opencv2/highgui/highgui.hpp>
 
+#include "DirectoryWatcher.h"
+#include "FrameTracker.h"
 #include "ImageMatcher.h"
+#include "MatchServer.h"
+#include "ShardCoordinator.h"
+#include "Stats.h"
+
+static MatchServer *sServer = NULL;
+
+static void
+InterruptServer (int)
+{
+    if (sServer)
+        sServer->Interrupt();
+}
+
+/**
+ * Command line options
+ */
+struct Options
+{
+    Options() :
+        numThreads(0),
+        candidateCount(0),
+        prefilterCount(0),
+        earlyExitInliers(0),
+        earlyExitConfidence(0),
+        vocabularyBranching(10),
+        vocabularyDepth(4),
+        features(FEATURE_SURF),
+        storage(STORAGE_FLOAT),
+        filter(FILTER_MUTUAL),
+        ratio(0.8f),
+        maxDimension(0),
+        grayscale(false),
+        printStats(false),
+        shard(0),
+        shardCount(1),
+        trackInliers(15),
+        trackRefresh(30),
+        cacheSize(0),
+        cacheDistance(4) {}
+
+    std::string datasetDir;
+    std::string queryImage;
+    std::string loadIndex;
+    std::string saveIndex;
+    std::string loadVocabulary;
+    std::string buildVocabulary;
+    std::string batchList;
+    std::string serveSocket;
+    std::string video;
+    std::string watchDir;
+    std::string metricsJson;
+    std::string metricsPrometheus;
+    unsigned int numThreads;
+    unsigned int candidateCount;
+    unsigned int prefilterCount;
+    int earlyExitInliers;
+    float earlyExitConfidence;
+    int vocabularyBranching;
+    int vocabularyDepth;
+    FeatureType features;
+    DescriptorStorage storage;
+    MatchFilterType filter;
+    float ratio;
+    int maxDimension;
+    bool grayscale;
+    KeypointBudget trainBudget;
+    KeypointBudget queryBudget;
+    bool printStats;
+    unsigned int shard;
+    unsigned int shardCount;
+    std::vector<std::string> shardSockets;
+    int trackInliers;
+    unsigned int trackRefresh;
+    size_t cacheSize;
+    int cacheDistance;
+};
+
+static void
+PrintUsage (const char *name)
+{
+    std::cout << "\n\tUsage: " << name << " [options] <trainingDir> <queryImage>"
+              << "\n\t       " << name << " [options] --load-index <indexFile> <queryImage>"
+              << "\n\t       " << name << " [options] --batch <listFile> [<trainingDir>]"
+              << "\n\t       " << name << " [options] --serve <socket> [<trainingDir>]"
+              << "\n\t       " << name << " [options] --video <file> [<trainingDir>]"
+              << "\n\t       " << name << " [options] --shards <socket,...> <queryImage>|--batch <listFile>"
+              << "\n\n\t<trainingDir> is a directory of images or an uncompressed .tar archive of them"
+              << "\n\n\tOptions:"
+              << "\n\t  --save-index <file>        save the trained dataset to an index file"
+              << "\n\t  --load-index <file>        use an index file instead of a training directory"
+              << "\n\t  --batch <file>             match every image listed in the file, one path per line"
+              << "\n\t  --serve <socket>           answer requests on a Unix domain socket until interrupted"
+              << "\n\t  --watch <dir>              with --serve, apply image changes in dir while serving"
+              << "\n\t  --video <file>             match the frames of a video file or image sequence"
+              << "\n\t                             (e.g. frame%04d.jpg), following the matched painting"
+              << "\n\t  --track <n> <f>            track matches with n inliers, search again every f"
+              << "\n\t                             frames anyway (default: 15 30, f = 0: never)"
+              << "\n\t  --shard <k> <n>            train on the k-th of n shards of the dataset (from 0)"
+              << "\n\t  --shards <socket,...>      query the shards served on these sockets, in order"
+              << "\n\t  --threads <n>              number of worker threads (default: one per core)"
+              << "\n\t  --features <name>          surf (default), orb, brisk or freak"
+              << "\n\t  --storage <name>           float (default), int8 or float16 training descriptors"
+              << "\n\t  --filter <name>            mutual (default), ratio or mutual-cached match filter"
+              << "\n\t  --ratio <r>                largest distance ratio of the ratio filter (default: 0.8)"
+              << "\n\t  --max-dimension <px>       scale images down to fit in px x px when decoding"
+              << "\n\t  --grayscale                decode images to gray only"
+              << "\n\t  --train-keypoints <m> <t>  keep at most m keypoints per training image, relax"
+              << "\n\t                             the detector for images with fewer than t (0: off)"
+              << "\n\t  --query-keypoints <m> <t>  the same for query images"
+              << "\n\t  --stats                    print the keypoints kept per training image"
+              << "\n\t  --metrics <file>           write stage latencies and counters as JSON on exit"
+              << "\n\t  --metrics-prom <file>      the same in the Prometheus text format"
+              << "\n\t                             (needs a build with WITH_STATS)"
+              << "\n\t  --top-k <k>                verify only the k best candidates (default: all)"
+              << "\n\t  --prefilter <m>            keep only the m images that look most like the query"
+              << "\n\t                             by thumbnail and colors (default: all)"
+              << "\n\t  --early-exit <n> <c>       stop verifying once a match has n inliers and confidence c"
+              << "\n\t  --cache <n> <d>            answer again the last n query images, and the ones at"
+              << "\n\t                             most d bits away by perceptual hash (d < 0: exact only)"
+              << "\n\t  --build-vocabulary <file>  build a vocabulary tree from the dataset and save it"
+              << "\n\t  --vocabulary <file>        select the candidates with a saved vocabulary tree"
+              << "\n\t  --vocabulary-shape <b> <d> branching and depth of the tree (default: 10 4)"
+              << "\n\n";
+}
+
+/**
+ * Parse the command line, return false if it is not valid.
+ */
+static bool
+ParseOptions (int argc, char *argv[], Options &options)
+{
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--load-index") == 0 && i + 1 < argc)
+            options.loadIndex = argv[++i];
+        else if (strcmp(argv[i], "--save-index") == 0 && i + 1 < argc)
+            options.saveIndex = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            options.batchList = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            options.serveSocket = argv[++i];
+        else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc)
+            options.video = argv[++i];
+        else if (strcmp(argv[i], "--track") == 0 && i + 2 < argc)
+        {
+            options.trackInliers = atoi(argv[++i]);
+            options.trackRefresh = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc)
+            options.watchDir = argv[++i];
+        else if (strcmp(argv[i], "--shard") == 0 && i + 2 < argc)
+        {
+            options.shard = atoi(argv[++i]);
+            options.shardCount = atoi(argv[++i]);
+            if (options.shardCount == 0 || options.shard >= options.shardCount)
+                return false;
+        }
+        else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc)
+        {
+            std::string list(argv[++i]);
+            size_t begin = 0;
+            while (begin <= list.size())
+            {
+                size_t end = std::min(list.find(',', begin), list.size());
+                if (end > begin)
+                    options.shardSockets.push_back(list.substr(begin, end - begin));
+                begin = end + 1;
+            }
+            if (options.shardSockets.empty())
+                return false;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            options.numThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--features") == 0 && i + 1 < argc)
+        {
+            if (!FeatureExtractor::ParseType(argv[++i], options.features))
+                return false;
+        }
+        else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc)
+        {
+            if (!DescriptorQuantizer::ParseStorage(argv[++i], options.storage))
+                return false;
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            if (!MatchFilter::ParseType(argv[++i], options.filter))
+                return false;
+        }
+        else if (strcmp(argv[i], "--ratio") == 0 && i + 1 < argc)
+            options.ratio = atof(argv[++i]);
+        else if (strcmp(argv[i], "--max-dimension") == 0 && i + 1 < argc)
+            options.maxDimension = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--grayscale") == 0)
+            options.grayscale = true;
+        else if (strcmp(argv[i], "--train-keypoints") == 0 && i + 2 < argc)
+        {
+            options.trainBudget.maxKeypoints = atoi(argv[++i]);
+            options.trainBudget.targetKeypoints = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--query-keypoints") == 0 && i + 2 < argc)
+        {
+            options.queryBudget.maxKeypoints = atoi(argv[++i]);
+            options.queryBudget.targetKeypoints = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+            options.printStats = true;
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+            options.metricsJson = argv[++i];
+        else if (strcmp(argv[i], "--metrics-prom") == 0 && i + 1 < argc)
+            options.metricsPrometheus = argv[++i];
+        else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc)
+            options.candidateCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--prefilter") == 0 && i + 1 < argc)
+            options.prefilterCount = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--early-exit") == 0 && i + 2 < argc)
+        {
+            options.earlyExitInliers = atoi(argv[++i]);
+            options.earlyExitConfidence = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 2 < argc)
+        {
+            options.cacheSize = std::max(0, atoi(argv[++i]));
+            options.cacheDistance = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--build-vocabulary") == 0 && i + 1 < argc)
+            options.buildVocabulary = argv[++i];
+        else if (strcmp(argv[i], "--vocabulary") == 0 && i + 1 < argc)
+            options.loadVocabulary = argv[++i];
+        else if (strcmp(argv[i], "--vocabulary-shape") == 0 && i + 2 < argc)
+        {
+            options.vocabularyBranching = atoi(argv[++i]);
+            options.vocabularyDepth = atoi(argv[++i]);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+            return false;
+        else
+            args.push_back(argv[i]);
+    }
+
+    // The shards hold the dataset, the coordinator does not serve
+    if (!options.shardSockets.empty() && !options.serveSocket.empty())
+        return false;
+
+    // The training directory is replaced by the index, the query image
+    // by the list of queries or by the server requests
+    bool needDataset = options.loadIndex.empty() && options.shardSockets.empty();
+    bool needQuery = options.batchList.empty() && options.serveSocket.empty() &&
+                     options.video.empty();
+    if (args.size() != (needDataset ? 1u : 0u) + (needQuery ? 1u : 0u))
+        return false;
+
+    if (needDataset)
+        options.datasetDir = args.front();
+    if (needQuery)
+        options.queryImage = args.back();
+
+    return true;
+}
+
+/**
+ * Print the keypoints detected and kept for every training image.
+ */
+static void
+PrintTrainingStats (const ImageMatcher &matcher)
+{
+    TrainingStats stats = matcher.GetTrainingStats();
+
+    for (size_t i = 0; i < stats.kept.size(); ++i)
+        std::cout << stats.fileNames[i] << "\t" << stats.detected[i] << "\t"
+                  << stats.kept[i] << std::endl;
+
+    std::cout << "Keypoints: " << stats.totalKept << " kept of "
+              << stats.totalDetected << " detected" << std::endl;
+    std::cout << "Descriptors: " << stats.descriptorBytes / 1024
+              << " KiB, " << stats.bytesSaved / 1024 << " KiB saved"
+              << std::endl;
+}
+
+/**
+ * Train the matcher or load its index, then save the index if requested.
+ */
+static bool
+LoadDataset (ImageMatcher &matcher, const Options &options)
+{
+    try
+    {
+        // Loaded first, so that the inverted file is built only once
+        if (!options.loadVocabulary.empty())
+            matcher.LoadVocabulary(options.loadVocabulary);
+
+        if (options.loadIndex.empty())
+        {
+            std::cout << "Analyzing the whole dataset..." << std::endl;
+            matcher.Train(options.datasetDir);
+            if (options.printStats)
+                PrintTrainingStats(matcher);
+        }
+        else
+        {
+            std::cout << "Loading index " << options.loadIndex << "..." << std::endl;
+            matcher.LoadIndex(options.loadIndex);
+        }
+
+        if (!options.saveIndex.empty())
+            matcher.SaveIndex(options.saveIndex);
+
+        if (!options.buildVocabulary.empty())
+        {
+            std::cout << "Building the vocabulary..." << std::endl;
+            matcher.BuildVocabulary(options.vocabularyBranching,
+                                    options.vocabularyDepth);
+            matcher.SaveVocabulary(options.buildVocabulary);
+        }
+    }
+    catch (const std::runtime_error &ex)
+    {
+        std::cout << ex.what() << std::endl;
+        return false;
+    }
+    std::cout << "Done!" << std::endl << std::endl;
+
+    return true;
+}
+
+/**
+ * Print how often the result cache answered the queries.
+ */
+static void
+PrintCacheStats (const ImageMatcher &matcher)
+{
+    ResultCacheStats stats = matcher.GetResultCacheStats();
+    unsigned long lookups = stats.hits + stats.misses;
+
+    std::cout << "Result cache: " << stats.hits << " hits ("
+              << stats.nearHits << " near), " << stats.misses << " misses";
+    if (lookups > 0)
+        std::cout << ", " << 100. * stats.hits / lookups << "% hit rate";
+    std::cout << "; " << stats.evictions << " evictions, "
+              << stats.invalidations << " invalidations, " << stats.size
+              << "/" << stats.capacity << " entries" << std::endl;
+}
+
+/**
+ * Write the stage latencies and counters to the requested files.
+ */
+static void
+DumpMetrics (const Options &options)
+{
+    try
+    {
+        if (!options.metricsJson.empty())
+            Stats::Instance().Dump(options.metricsJson, false);
+        if (!options.metricsPrometheus.empty())
+            Stats::Instance().Dump(options.metricsPrometheus, true);
+    }
+    catch (const StatsIOException &ex)
+    {
+        std::cout << ex.what() << std::endl;
+    }
+}
+
+/**
+ * Read the query paths of a list file, one per line, skipping blank lines
+ */
+static bool
+ReadQueryList (const std::string &listFile, std::vector<std::string> &queries)
+{
+    std::ifstream list(listFile.c_str());
+    if (!list)
+    {
+        std::cout << "Cannot read " << listFile << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(list, line))
+    {
+        if (!line.empty())
+            queries.push_back(line);
+    }
+
+    return true;
+}
+
+/**
+ * Match every image listed in a file and print one line per query:
+ * <query> TAB <match> TAB <confidence>, or <query> TAB ERROR TAB <message>
+ */
+static int
+RunBatch (ImageMatcher &matcher, const std::string &listFile)
+{
+    std::vector<std::string> queries;
+    if (!ReadQueryList(listFile, queries))
+        return (EXIT_FAILURE);
+
+    std::vector<MatchResult> results = matcher.FindBestMatches(queries);
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        if (results[i].error.empty())
+            std::cout << queries[i] << "\t" << results[i].fileName
+                      << "\t" << results[i].confidence << std::endl;
+        else
+            std::cout << queries[i] << "\tERROR\t" << results[i].error
+                      << std::endl;
+    }
+
+    return (EXIT_SUCCESS);
+}
+
+/**
+ * Query the shards of a dataset, served by other processes, for the
+ * query image or for every image in the batch list (printed as by
+ * RunBatch()).
+ */
+static int
+RunCoordinator (ImageMatcher &matcher, const Options &options)
+{
+    std::vector<std::string> queries;
+    if (options.batchList.empty())
+        queries.push_back(options.queryImage);
+    else if (!ReadQueryList(options.batchList, queries))
+        return (EXIT_FAILURE);
+
+    try
+    {
+        ShardCoordinator coordinator(matcher, options.shardSockets);
+
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            float confidence;
+            try
+            {
+                std::string matchName = coordinator.FindBestMatch(queries[i],
+                                                                  confidence);
+                if (options.batchList.empty())
+                    std::cout << "Best match found: " << matchName << std::endl
+                              << "Confidence: " << confidence << std::endl
+                              << std::endl << "match_result=" << matchName;
+                else
+                    std::cout << queries[i] << "\t" << matchName << "\t"
+                              << confidence << std::endl;
+            }
+            catch (const ImageReaderIOException &ex)
+            {
+                std::cout << queries[i] << "\tERROR\t" << ex.what()
+                          << std::endl;
+            }
+            catch (const ShardCoordinatorIOException &ex)
+            {
+                std::cout << queries[i] << "\tERROR\t" << ex.what()
+                          << std::endl;
+            }
+        }
+    }
+    catch (const std::runtime_error &ex)
+    {
+        // A shard cannot be reached
+        std::cout << ex.what() << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    return (EXIT_SUCCESS);
+}
+
+/**
+ * Match every frame of a video and print one line per frame:
+ * <frame> TAB <match> TAB <confidence> TAB <track|search> TAB <ms>
+ */
+static int
+RunVideo (ImageMatcher &matcher, const Options &options)
+{
+    cv::VideoCapture capture(options.video);
+    if (!capture.isOpened())
+    {
+        std::cout << "Cannot read " << options.video << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    FrameTracker tracker(matcher, options.trackInliers, options.trackRefresh);
+    cv::Mat frame;
+    double totalMs = 0;
+
+    while (capture.read(frame))
+    {
+        // Frames come decoded, the policy still bounds their size
+        ImageReader::Conform(frame, matcher.GetDecodePolicy());
+
+        int64 start = cv::getTickCount();
+        MatchResult result;
+        bool tracked = tracker.Track(frame, result);
+        double ms = (cv::getTickCount() - start) * 1000. /
+                    cv::getTickFrequency();
+        totalMs += ms;
+
+        std::cout << tracker.GetFrameCount() - 1 << "\t" << result.fileName
+                  << "\t" << result.confidence << "\t"
+                  << (tracked ? "track" : "search") << "\t" << ms
+                  << std::endl;
+    }
+
+    unsigned int frames = tracker.GetFrameCount();
+    std::cout << "Frames: " << frames << ", searches: "
+              << tracker.GetSearchCount() << ", mean "
+              << (frames ? totalMs / frames : 0) << " ms per frame"
+              << std::endl;
+
+    return (EXIT_SUCCESS);
+}
+
+/**
+ * Answer requests on a Unix domain socket until SIGINT or SIGTERM,
+ * optionally following the changes of an image directory.
+ */
+static int
+RunServer (ImageMatcher &matcher, const std::string &socketPath,
+           const std::string &watchDir)
+{
+    try
+    {
+        MatchServer server(matcher, socketPath);
+
+        boost::scoped_ptr<DirectoryWatcher> watcher;
+        if (!watchDir.empty())
+        {
+            watcher.reset(new DirectoryWatcher(matcher, watchDir));
+            std::cout << "Watching " << watchDir << std::endl;
+        }
+
+        sServer = &server;
+        signal(SIGINT, InterruptServer);
+        signal(SIGTERM, InterruptServer);
+
+        std::cout << "Listening on " << socketPath << std::endl;
+        server.Run();
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        sServer = NULL;
+
+        std::cout << "Waiting for clients to disconnect..." << std::endl;
+    }
+    catch (const std::runtime_error &ex)
+    {
+        std::cout << ex.what() << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    return (EXIT_SUCCESS);
+}
 
 int
 main (int argc, char *argv[])
 {
-    if (argc < 3)
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
     {
-        std::cout << "\n\tUsage: " << argv[0] << " <trainingDir> <queryImage>\n\n";
+        PrintUsage(argv[0]);
         return (EXIT_FAILURE);
     }
 
     float confidence;
-    std::string datasetDir(argv[1]);
-    std::string queryImage(argv[2]);
 
-    ImageMatcher matcher;
+    ImageMatcher matcher(400, options.numThreads, options.features);
+    matcher.SetCandidateCount(options.candidateCount);
+    matcher.SetPrefilter(options.prefilterCount);
+    matcher.SetEarlyExit(options.earlyExitInliers, options.earlyExitConfidence);
+    matcher.SetDescriptorStorage(options.storage);
+    matcher.SetMatchFilter(MatchFilter(options.filter, options.ratio));
+    matcher.SetDecodePolicy(DecodePolicy(options.maxDimension, options.grayscale));
+    matcher.SetTrainKeypointBudget(options.trainBudget);
+    matcher.SetQueryKeypointBudget(options.queryBudget);
+    matcher.SetShard(options.shard, options.shardCount);
+    matcher.SetResultCache(options.cacheSize, options.cacheDistance);
+
+    // The coordinator only extracts the query features
+    if (!options.shardSockets.empty())
+    {
+        int status = RunCoordinator(matcher, options);
+        DumpMetrics(options);
+        return status;
+    }
+
+    if (!options.batchList.empty())
+    {
+        if (!LoadDataset(matcher, options))
+            return (EXIT_FAILURE);
+
+        int status = RunBatch(matcher, options.batchList);
+        DumpMetrics(options);
+        return status;
+    }
+
+    if (!options.video.empty())
+    {
+        if (!LoadDataset(matcher, options))
+            return (EXIT_FAILURE);
+
+        int status = RunVideo(matcher, options);
+        DumpMetrics(options);
+        return status;
+    }
+
+    if (!options.serveSocket.empty())
+    {
+        if (!LoadDataset(matcher, options))
+            return (EXIT_FAILURE);
+
+        int status = RunServer(matcher, options.serveSocket, options.watchDir);
+        if (options.cacheSize > 0)
+            PrintCacheStats(matcher);
+        DumpMetrics(options);
+        return status;
+    }
+
+    std::string queryImage(options.queryImage);
 
     namespace fs = boost::filesystem;
     if (!(fs::exists(queryImage) && fs::is_regular_file(queryImage)))
@@ -37,9 +647,8 @@ main (int argc, char *argv[])
         return (EXIT_FAILURE);
     }
 
-    std::cout << "Analyzing the whole dataset..." << std::endl;
-    matcher.Train(datasetDir);
-    std::cout << "Done!" << std::endl << std::endl;
+    if (!LoadDataset(matcher, options))
+        return (EXIT_FAILURE);
 
     std::cout << "Searching best match..." << std::endl;
     std::string matchName = matcher.FindBestMatch(queryImage, confidence);
@@ -48,6 +657,7 @@ main (int argc, char *argv[])
 
     std::cout << "match_result="<< matchName;
 
+    DumpMetrics(options);
+
     return (EXIT_SUCCESS);
 }
-